@@ -174,7 +174,11 @@ static int sc_apdu2bytes(sc_context_t *ctx, const sc_apdu_t *apdu,
 void sc_apdu_log(sc_context_t *ctx, int level, const u8 *data, size_t len, int is_out)
 {
 	size_t blen = len * 5 + 128;
-	char   *buf = malloc(blen);
+	char   *buf;
+
+	if (!SC_LOG_ENABLED(ctx, level))
+		return;
+	buf = malloc(blen);
 	if (buf == NULL)
 		return;
 
@@ -375,10 +379,66 @@ sc_detect_apdu_cse(const sc_card_t *card, sc_apdu_t *apdu)
 }
 
 
+/* Append "<microseconds> <command> <response>" to the APDU transcript */
+static void
+sc_record_apdu(struct sc_context *ctx, const u8 *sbuf, size_t ssize,
+		const struct sc_apdu *apdu, unsigned long usec)
+{
+	u8 *rbuf;
+	char *hex;
+	size_t rsize = apdu->resplen + 2, hexlen;
+
+	/* command and response side by side, so that the line is written
+	 * with a single call and lines of other threads cannot interleave */
+	hexlen = 2 * ssize + 2 + 2 * rsize + 2;
+	rbuf = malloc(rsize);
+	hex = malloc(hexlen);
+	if (rbuf != NULL && hex != NULL) {
+		if (apdu->resplen)
+			memcpy(rbuf, apdu->resp, apdu->resplen);
+		rbuf[rsize - 2] = apdu->sw1;
+		rbuf[rsize - 1] = apdu->sw2;
+
+		sc_bin_to_hex(sbuf, ssize, hex, 2 * ssize + 2, 0);
+		sc_bin_to_hex(rbuf, rsize, hex + 2 * ssize + 2, 2 * rsize + 2, 0);
+		fprintf(ctx->apdu_record, "%lu %s %s\n", usec, hex, hex + 2 * ssize + 2);
+		fflush(ctx->apdu_record);
+	}
+	if (rbuf != NULL) {
+		sc_mem_clear(rbuf, rsize);
+		free(rbuf);
+	}
+	if (hex != NULL) {
+		sc_mem_clear(hex, hexlen);
+		free(hex);
+	}
+}
+
+
+static void
+sc_count_apdu(struct sc_apdu_counter *counter, size_t sent, size_t received,
+		unsigned long usec)
+{
+	unsigned long ms = usec / 1000;
+	int bucket = 0;
+
+	while (bucket < SC_APDU_STATS_BUCKETS - 1 && ms >= (1UL << bucket))
+		bucket++;
+	counter->count++;
+	counter->bytes_sent += sent;
+	counter->bytes_received += received;
+	counter->usec += usec;
+	counter->histogram[bucket]++;
+}
+
+
 static int
 sc_single_transmit(struct sc_card *card, struct sc_apdu *apdu)
 {
 	struct sc_context *ctx  = card->ctx;
+	u8 *sbuf = NULL;
+	size_t ssize = 0, sent;
+	unsigned long start, usec;
 	int rv;
 
 	LOG_FUNC_CALLED(ctx);
@@ -392,8 +452,28 @@ sc_single_transmit(struct sc_card *card, struct sc_apdu *apdu)
 		return sc_sm_single_transmit(card, apdu);
 #endif
 
+	/* encode for the transcript first, the reader may modify the APDU */
+	if (ctx->apdu_record != NULL
+			&& sc_apdu_get_octets(ctx, apdu, &sbuf, &ssize, SC_PROTO_RAW) != SC_SUCCESS)
+		sbuf = NULL;
+	sent = sc_apdu_get_length(apdu, SC_PROTO_RAW);
+
 	/* send APDU to the reader driver */
+	start = sc_trace_clock();
 	rv = card->reader->ops->transmit(card->reader, apdu);
+	usec = sc_trace_clock() - start;
+	sc_trace_apdu(ctx, card->reader, apdu, rv, usec);
+
+	if (rv == SC_SUCCESS) {
+		sc_count_apdu(&card->apdu_stats->total, sent, apdu->resplen + 2, usec);
+		sc_count_apdu(&card->apdu_stats->ins[apdu->ins], sent, apdu->resplen + 2, usec);
+		if (sbuf != NULL)
+			sc_record_apdu(ctx, sbuf, ssize, apdu, usec);
+	}
+	if (sbuf != NULL) {
+		sc_mem_clear(sbuf, ssize);
+		free(sbuf);
+	}
 	LOG_TEST_RET(ctx, rv, "unable to transmit APDU");
 
 	LOG_FUNC_RETURN(ctx, rv);
@@ -425,6 +505,7 @@ sc_set_le_and_transmit(struct sc_card *card, struct sc_apdu *apdu, size_t olen)
 		msleep(40);
 
 	/* re-transmit the APDU with new Le length */
+	card->apdu_stats->retransmits++;
 	rv = sc_single_transmit(card, apdu);
 	LOG_TEST_RET(ctx, rv, "cannot re-transmit APDU");
 
@@ -473,6 +554,7 @@ sc_get_response(struct sc_card *card, struct sc_apdu *apdu, size_t olen)
 		/* call GET RESPONSE to get more date from the card;
 		 * note: GET RESPONSE returns the left amount of data (== SW2) */
 		memset(resp, 0, sizeof(resp));
+		card->apdu_stats->get_responses++;
 		rv = card->ops->get_response(card, &resp_len, resp);
 		if (rv < 0)   {
 #ifdef ENABLE_SM
@@ -553,28 +635,45 @@ sc_transmit(sc_card_t *card, sc_apdu_t *apdu)
 }
 
 
-int sc_transmit_apdu(sc_card_t *card, sc_apdu_t *apdu)
+/* Whether the file selected on the card is still selected after the APDU.
+ * Unknown and proprietary commands are assumed to change it. */
+static int
+sc_apdu_keeps_selection(const sc_apdu_t *apdu)
 {
-	int r = SC_SUCCESS;
-
-	if (card == NULL || apdu == NULL)
-		return SC_ERROR_INVALID_ARGUMENTS;
-
-	LOG_FUNC_CALLED(card->ctx);
-
-	/* determine the APDU type if necessary, i.e. to use
-	 * short or extended APDUs  */
-	sc_detect_apdu_cse(card, apdu);
-	/* basic APDU consistency check */
-	r = sc_check_apdu(card, apdu);
-	if (r != SC_SUCCESS)
-		return SC_ERROR_INVALID_ARGUMENTS;
+	if (apdu->cla & 0x80)
+		return 0;
 
-	r = sc_lock(card);	/* acquire card lock*/
-	if (r != SC_SUCCESS) {
-		sc_log(card->ctx, "unable to acquire lock");
-		return r;
+	switch (apdu->ins) {
+	case 0xB0:	/* READ BINARY */
+	case 0xD0:	/* WRITE BINARY */
+	case 0xD6:	/* UPDATE BINARY */
+		/* a short EF identifier selects that EF */
+		return (apdu->p1 & 0x80) == 0;
+	case 0xB2:	/* READ RECORD */
+	case 0xDC:	/* UPDATE RECORD */
+	case 0xE2:	/* APPEND RECORD */
+		return (apdu->p2 & 0xF8) == 0;
+	case 0x20:	/* VERIFY */
+	case 0x22:	/* MANAGE SECURITY ENVIRONMENT */
+	case 0x24:	/* CHANGE REFERENCE DATA */
+	case 0x2A:	/* PERFORM SECURITY OPERATION */
+	case 0x2C:	/* RESET RETRY COUNTER */
+	case 0x82:	/* EXTERNAL AUTHENTICATE */
+	case 0x84:	/* GET CHALLENGE */
+	case 0x88:	/* INTERNAL AUTHENTICATE */
+	case 0xC0:	/* GET RESPONSE */
+	case 0xCA:	/* GET DATA */
+		return 1;
 	}
+	return 0;
+}
+
+/* Sends an APDU, in chunks if SC_APDU_FLAGS_CHAINING is set; the card
+ * must be locked and the APDU checked */
+static int
+sc_transmit_chained(sc_card_t *card, sc_apdu_t *apdu)
+{
+	int r = SC_SUCCESS;
 
 	if ((apdu->flags & SC_APDU_FLAGS_CHAINING) != 0) {
 		/* divide et impera: transmit APDU in chunks with Lc <= max_send_size
@@ -630,8 +729,11 @@ int sc_transmit_apdu(sc_card_t *card, sc_apdu_t *apdu)
 			} else {
 				/* otherwise check the status bytes */
 				r = sc_check_sw(card, tapdu.sw1, tapdu.sw2);
-				if (r != SC_SUCCESS)
+				if (r != SC_SUCCESS) {
+					apdu->sw1 = tapdu.sw1;
+					apdu->sw2 = tapdu.sw2;
 					break;
+				}
 			}
 			len -= plen;
 			buf += plen;
@@ -639,6 +741,56 @@ int sc_transmit_apdu(sc_card_t *card, sc_apdu_t *apdu)
 	} else
 		/* transmit single APDU */
 		r = sc_transmit(card, apdu);
+
+	/* a failed transmit may mean that the card was reset and is back at
+	 * the MF; this also forgets the security environment */
+	if (r < 0 || !sc_apdu_keeps_selection(apdu))
+		sc_invalidate_selection(card);
+	else if (apdu->ins == 0x22)	/* MANAGE SECURITY ENVIRONMENT */
+		card->cache.sec_env_valid = 0;
+
+	return r;
+}
+
+/* Determines the APDU case and checks the APDU.  With auto_chain, a short
+ * APDU with more data than the card accepts is sent with command chaining */
+static int
+sc_prepare_apdu(sc_card_t *card, sc_apdu_t *apdu, int auto_chain)
+{
+	size_t max_send_size = card->max_send_size > 0 ? card->max_send_size : 255;
+
+	/* determine the APDU type if necessary, i.e. to use
+	 * short or extended APDUs  */
+	sc_detect_apdu_cse(card, apdu);
+	if (auto_chain && (apdu->cse & SC_APDU_EXT) == 0 && apdu->datalen > max_send_size)
+		apdu->flags |= SC_APDU_FLAGS_CHAINING;
+	/* basic APDU consistency check */
+	if (sc_check_apdu(card, apdu) != SC_SUCCESS)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	return SC_SUCCESS;
+}
+
+int sc_transmit_apdu(sc_card_t *card, sc_apdu_t *apdu)
+{
+	int r = SC_SUCCESS;
+
+	if (card == NULL || apdu == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	LOG_FUNC_CALLED(card->ctx);
+
+	r = sc_prepare_apdu(card, apdu, 0);
+	if (r != SC_SUCCESS)
+		return r;
+
+	r = sc_lock(card);	/* acquire card lock*/
+	if (r != SC_SUCCESS) {
+		sc_log(card->ctx, "unable to acquire lock");
+		return r;
+	}
+
+	r = sc_transmit_chained(card, apdu);
+
 	/* all done => release lock */
 	if (sc_unlock(card) != SC_SUCCESS)
 		sc_log(card->ctx, "sc_unlock failed");
@@ -646,6 +798,52 @@ int sc_transmit_apdu(sc_card_t *card, sc_apdu_t *apdu)
 	return r;
 }
 
+int sc_transmit_apdus(sc_card_t *card, struct sc_remote_data *rdata)
+{
+	struct sc_context *ctx;
+	struct sc_remote_apdu *rapdu;
+	int r = SC_SUCCESS;
+
+	if (card == NULL || rdata == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	ctx = card->ctx;
+
+	LOG_FUNC_CALLED(ctx);
+	sc_log(ctx, "%i APDUs", rdata->length);
+
+	for (rapdu = rdata->data; rapdu != NULL; rapdu = rapdu->next)
+		rapdu->status = SC_REMOTE_APDU_NOT_SENT;
+	/* check them all before sending the first one */
+	for (rapdu = rdata->data; rapdu != NULL; rapdu = rapdu->next) {
+		r = sc_prepare_apdu(card, &rapdu->apdu, 1);
+		if (r != SC_SUCCESS) {
+			rapdu->status = r;
+			LOG_TEST_RET(ctx, r, "invalid APDU in the list");
+		}
+	}
+
+	r = sc_lock(card);
+	LOG_TEST_RET(ctx, r, "unable to acquire lock");
+
+	for (rapdu = rdata->data; rapdu != NULL; rapdu = rapdu->next) {
+		r = sc_transmit_chained(card, &rapdu->apdu);
+		if (r == SC_SUCCESS)
+			r = sc_check_sw(card, rapdu->apdu.sw1, rapdu->apdu.sw2);
+		rapdu->status = r;
+		if (r == SC_SUCCESS)
+			continue;
+		if (!(rapdu->flags & SC_REMOTE_APDU_FLAG_NOT_FATAL))
+			break;
+		sc_log(ctx, "APDU %02X %02X failed, not fatal: %s",
+				rapdu->apdu.cla, rapdu->apdu.ins, sc_strerror(r));
+		r = SC_SUCCESS;
+	}
+
+	if (sc_unlock(card) != SC_SUCCESS)
+		sc_log(ctx, "sc_unlock failed");
+
+	LOG_FUNC_RETURN(ctx, r);
+}
 
 int
 sc_bytes2apdu(sc_context_t *ctx, const u8 *buf, size_t len, sc_apdu_t *apdu)
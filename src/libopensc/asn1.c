@@ -34,8 +34,23 @@
 static int asn1_decode(sc_context_t *ctx, struct sc_asn1_entry *asn1,
 		       const u8 *in, size_t len, const u8 **newp, size_t *len_left,
 		       int choice, int depth);
+
+/* Encoder output.  It is written backwards from the end of buf, so that
+ * the length of a constructed value is known when its header is written.
+ * With buf == NULL nothing is written and only len is counted. */
+struct asn1_out {
+	u8 *buf;
+	size_t size;	/* size of buf */
+	size_t len;	/* bytes at the end of buf written so far */
+};
+
+/* tag and length octets of one element */
+#define ASN1_MAX_HEADER_SIZE	(3 + 1 + sizeof(size_t))
+
 static int asn1_encode(sc_context_t *ctx, const struct sc_asn1_entry *asn1,
 		       u8 **ptr, size_t *size, int depth);
+static int asn1_encode_list(sc_context_t *ctx, const struct sc_asn1_entry *asn1,
+		       struct asn1_out *out, int depth);
 static int asn1_write_element(sc_context_t *ctx, unsigned int tag,
 		const u8 * data, size_t datalen, u8 ** out, size_t * outlen);
 
@@ -483,20 +498,14 @@ int sc_asn1_decode_bit_string_ni(const u8 * inbuf, size_t inlen,
 	return decode_bit_string(inbuf, inlen, outbuf, outlen, 0);
 }
 
-static int encode_bit_string(const u8 * inbuf, size_t bits_left, u8 **outbuf,
-			     size_t *outlen, int invert)
+/* outbuf must hold (bits_left + 7) / 8 + 1 bytes */
+static int encode_bit_string(const u8 * inbuf, size_t bits_left, u8 *outbuf,
+			     int invert)
 {
 	const u8 *in = inbuf;
-	u8 *out;
-	size_t bytes;
+	u8 *out = outbuf + 1;
 	int skipped = 0;
 
-	bytes = (bits_left + 7)/8 + 1;
-	*outbuf = out = malloc(bytes);
-	if (out == NULL)
-		return SC_ERROR_OUT_OF_MEMORY;
-	*outlen = bytes;
-	out += 1;
 	while (bits_left) {
 		int i, bits_to_go = 8;
 
@@ -516,8 +525,7 @@ static int encode_bit_string(const u8 * inbuf, size_t bits_left, u8 **outbuf,
 		bits_left -= bits_to_go;
 		out++, in++;
 	}
-	out = *outbuf;
-	out[0] = skipped;
+	outbuf[0] = skipped;
 	return 0;
 }
 
@@ -545,8 +553,9 @@ static int decode_bit_field(const u8 * inbuf, size_t inlen, void *outbuf, size_t
 	return 0;
 }
 
+/* outbuf must hold sizeof(unsigned int) + 1 bytes */
 static int encode_bit_field(const u8 *inbuf, size_t inlen,
-			    u8 **outbuf, size_t *outlen)
+			    u8 *outbuf, size_t *outlen)
 {
 	u8		data[sizeof(unsigned int)];
 	unsigned int	field = 0;
@@ -564,7 +573,8 @@ static int encode_bit_field(const u8 *inbuf, size_t inlen,
 	for (i = 0; i < bits; i += 8)
 		data[i/8] = field >> i;
 
-	return encode_bit_string(data, bits, outbuf, outlen, 1);
+	*outlen = (bits + 7) / 8 + 1;
+	return encode_bit_string(data, bits, outbuf, 1);
 }
 
 int sc_asn1_decode_integer(const u8 * inbuf, size_t inlen, int *out)
@@ -584,7 +594,8 @@ int sc_asn1_decode_integer(const u8 * inbuf, size_t inlen, int *out)
 	return 0;
 }
 
-static int asn1_encode_integer(int in, u8 ** obj, size_t * objsize)
+/* obj must hold sizeof(int) + 1 bytes */
+static int asn1_encode_integer(int in, u8 *obj, size_t * objsize)
 {
 	int i = sizeof(in) * 8, skip_zero, skip_sign;
 	u8 *p, b;
@@ -599,9 +610,7 @@ static int asn1_encode_integer(int in, u8 ** obj, size_t * objsize)
 		skip_sign = 0;
 		skip_zero= 1;
 	}
-	*obj = p = malloc(sizeof(in)+1);
-	if (*obj == NULL)
-		return SC_ERROR_OUT_OF_MEMORY;
+	p = obj;
 	do {
 		i -= 8;
 		b = in >> i;
@@ -633,10 +642,10 @@ static int asn1_encode_integer(int in, u8 ** obj, size_t * objsize)
 	} while (i > 0);
 	if (skip_sign)
 		p++;
-	*objsize = p - *obj;
+	*objsize = p - obj;
 	if (*objsize == 0) {
 		*objsize = 1;
-		(*obj)[0] = 0;
+		obj[0] = 0;
 	}
 	return 0;
 }
@@ -820,11 +829,12 @@ int sc_asn1_write_element(sc_context_t *ctx, unsigned int tag,
 	return asn1_write_element(ctx, tag, data, datalen, out, outlen);
 }
 
-static int asn1_write_element(sc_context_t *ctx, unsigned int tag,
-	const u8 * data, size_t datalen, u8 ** out, size_t * outlen)
+/* out must hold ASN1_MAX_HEADER_SIZE bytes */
+static int asn1_encode_header(sc_context_t *ctx, unsigned int tag,
+	size_t datalen, u8 *out, size_t *outlen)
 {
 	unsigned char t;
-	unsigned char *buf, *p;
+	unsigned char *p = out;
 	int c = 0;
 	unsigned short_tag;
 	unsigned char tag_char[3] = {0, 0, 0};
@@ -871,12 +881,6 @@ static int asn1_write_element(sc_context_t *ctx, unsigned int tag,
 			c++;
 	}
 
-	*outlen = tag_len + 1 + c + datalen;
-	buf = malloc(*outlen);
-	if (buf == NULL)
-		SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_ASN1, SC_ERROR_OUT_OF_MEMORY);
-
-	*out = p = buf;
 	*p++ = t;
 	for (ii=1;ii<tag_len;ii++)
 		*p++ = tag_char[tag_len - ii - 1];
@@ -889,11 +893,73 @@ static int asn1_write_element(sc_context_t *ctx, unsigned int tag,
 	else   {
 		*p++ = datalen & 0x7F;
 	}
-	memcpy(p, data, datalen);
+	*outlen = p - out;
 
 	return SC_SUCCESS;
 }
 
+static int asn1_write_element(sc_context_t *ctx, unsigned int tag,
+	const u8 * data, size_t datalen, u8 ** out, size_t * outlen)
+{
+	u8 hdr[ASN1_MAX_HEADER_SIZE], *buf;
+	size_t hdrlen;
+	int r;
+
+	r = asn1_encode_header(ctx, tag, datalen, hdr, &hdrlen);
+	if (r)
+		return r;
+
+	*outlen = hdrlen + datalen;
+	buf = malloc(*outlen);
+	if (buf == NULL)
+		SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_ASN1, SC_ERROR_OUT_OF_MEMORY);
+
+	memcpy(buf, hdr, hdrlen);
+	if (datalen)
+		memcpy(buf + hdrlen, data, datalen);
+	*out = buf;
+
+	return SC_SUCCESS;
+}
+
+/* Claims len bytes in front of the output written so far; *p is NULL
+ * while sizing */
+static int asn1_out_reserve(struct asn1_out *out, size_t len, u8 **p)
+{
+	*p = NULL;
+	if (out->buf != NULL) {
+		if (len > out->size - out->len)
+			return SC_ERROR_BUFFER_TOO_SMALL;
+		*p = out->buf + out->size - out->len - len;
+	}
+	out->len += len;
+	return SC_SUCCESS;
+}
+
+static int asn1_out_put(struct asn1_out *out, const u8 *data, size_t len)
+{
+	u8 *p;
+	int r;
+
+	r = asn1_out_reserve(out, len, &p);
+	if (r == SC_SUCCESS && p != NULL && len)
+		memcpy(p, data, len);
+	return r;
+}
+
+static int asn1_out_header(sc_context_t *ctx, struct asn1_out *out,
+	unsigned int tag, size_t datalen)
+{
+	u8 hdr[ASN1_MAX_HEADER_SIZE];
+	size_t hdrlen;
+	int r;
+
+	r = asn1_encode_header(ctx, tag, datalen, hdr, &hdrlen);
+	if (r == SC_SUCCESS)
+		r = asn1_out_put(out, hdr, hdrlen);
+	return r;
+}
+
 static const struct sc_asn1_entry c_asn1_path_ext[3] = {
 	{ "aid",  SC_ASN1_OCTET_STRING, SC_ASN1_APP | 0x0F, 0, NULL, NULL },
 	{ "path", SC_ASN1_OCTET_STRING, SC_ASN1_TAG_OCTET_STRING, 0, NULL, NULL },
@@ -975,7 +1041,7 @@ static int asn1_decode_path(sc_context_t *ctx, const u8 *in, size_t len,
 }
 
 static int asn1_encode_path(sc_context_t *ctx, const sc_path_t *path,
-			    u8 **buf, size_t *bufsize, int depth, unsigned int parent_flags)
+			    struct asn1_out *out, int depth, unsigned int parent_flags)
 {
 	int r;
  	struct sc_asn1_entry asn1_path[5];
@@ -989,7 +1055,7 @@ static int asn1_encode_path(sc_context_t *ctx, const sc_path_t *path,
 		sc_format_asn1_entry(asn1_path + 1, (void *) &tpath.index, NULL, 1);
 		sc_format_asn1_entry(asn1_path + 2, (void *) &tpath.count, NULL, 1);
 	}
-	r = asn1_encode(ctx, asn1_path, buf, bufsize, depth + 1);
+	r = asn1_encode_list(ctx, asn1_path, out, depth + 1);
 	return r;
 }
 
@@ -1066,13 +1132,13 @@ err:
 
 static int asn1_encode_se_info(sc_context_t *ctx,
 		struct sc_pkcs15_sec_env_info **se, size_t se_num,
-		unsigned char **buf, size_t *bufsize, int depth)
+		struct asn1_out *out, int depth)
 {
-	unsigned char *ptr = NULL, *out = NULL, *p;
-	size_t ptrlen = 0, outlen = 0, idx;
+	size_t idx;
 	int ret;
 
-	for (idx=0; idx < se_num; idx++)   {
+	/* last one first, the output grows backwards */
+	for (idx = se_num; idx-- > 0; )   {
 		struct sc_asn1_entry asn1_se[2];
 		struct sc_asn1_entry asn1_se_info[4];
 
@@ -1086,30 +1152,12 @@ static int asn1_encode_se_info(sc_context_t *ctx,
 			sc_format_asn1_entry(asn1_se_info + 2, &se[idx]->aid.value, &se[idx]->aid.len, 1);
 		sc_format_asn1_entry(asn1_se + 0, asn1_se_info, NULL, 1);
 
-		ret = sc_asn1_encode(ctx, asn1_se, &ptr, &ptrlen);
+		ret = asn1_encode_list(ctx, asn1_se, out, depth + 1);
 		if (ret != SC_SUCCESS)
-			goto err;
-
-		p = (unsigned char *) realloc(out, outlen + ptrlen);
-		if (!p)   {
-			ret = SC_ERROR_OUT_OF_MEMORY;
-			goto err;
-		}
-		out = p;
-		memcpy(out + outlen, ptr, ptrlen);
-		outlen += ptrlen;
-		free(ptr);
-		ptr = NULL;
-		ptrlen = 0;
+			return ret;
 	}
 
-	*buf = out;
-	*bufsize = outlen;
-	ret = SC_SUCCESS;
-err:
-	if (ret != SC_SUCCESS && out != NULL)
-		free(out);
-	return ret;
+	return SC_SUCCESS;
 }
 
 /* TODO: According to specification type of 'SecurityCondition' is 'CHOICE'.
@@ -1193,7 +1241,7 @@ static int asn1_decode_p15_object(sc_context_t *ctx, const u8 *in,
 }
 
 static int asn1_encode_p15_object(sc_context_t *ctx, const struct sc_asn1_pkcs15_object *obj,
-				  u8 **buf, size_t *bufsize, int depth)
+				  struct asn1_out *out, int depth)
 {
 	struct sc_pkcs15_object p15_obj = *obj->p15_obj;
 	struct sc_asn1_entry    asn1_c_attr[6], asn1_p15_obj[5];
@@ -1244,7 +1292,7 @@ static int asn1_encode_p15_object(sc_context_t *ctx, const struct sc_asn1_pkcs15
 		sc_format_asn1_entry(asn1_p15_obj + 2, obj->asn1_subclass_attr, NULL, 1);
 	sc_format_asn1_entry(asn1_p15_obj + 3, obj->asn1_type_attr, NULL, 1);
 
-	r = asn1_encode(ctx, asn1_p15_obj, buf, bufsize, depth + 1);
+	r = asn1_encode_list(ctx, asn1_p15_obj, out, depth + 1);
 	return r;
 }
 
@@ -1328,6 +1376,12 @@ static int asn1_decode_entry(sc_context_t *ctx,struct sc_asn1_entry *entry,
 				obj++;
 			}
 
+			if ((entry->flags & (SC_ASN1_ALLOC | SC_ASN1_REF)) == (SC_ASN1_ALLOC | SC_ASN1_REF)) {
+				*(const u8 **) parm = obj;
+				*len = objlen;
+				break;
+			}
+
 			/* Allocate buffer if needed */
 			if (entry->flags & SC_ASN1_ALLOC) {
 				u8 **buf = (u8 **) parm;
@@ -1487,7 +1541,7 @@ static int asn1_decode(sc_context_t *ctx, struct sc_asn1_entry *asn1,
 			if (entry->flags & SC_ASN1_OPTIONAL)
 				continue;
 			sc_debug(ctx, SC_LOG_DEBUG_ASN1, "mandatory ASN.1 object '%s' not found\n", entry->name);
-			if (left) {
+			if (left && SC_LOG_ENABLED(ctx, SC_LOG_DEBUG_ASN1)) {
 				u8 line[128], *linep = line;
 				size_t i;
 
@@ -1532,26 +1586,30 @@ int sc_asn1_decode_choice(sc_context_t *ctx, struct sc_asn1_entry *asn1,
 }
 
 static int asn1_encode_entry(sc_context_t *ctx, const struct sc_asn1_entry *entry,
-			     u8 **obj, size_t *objlen, int depth)
+			     struct asn1_out *out, int depth)
 {
 	void *parm = entry->parm;
 	int (*callback_func)(sc_context_t *nctx, void *arg, u8 **nobj,
 			     size_t *nobjlen, int ndepth);
 	const size_t *len = (const size_t *) entry->arg;
 	int r = 0;
-	u8 * buf = NULL;
-	size_t buflen = 0;
+	u8 * buf = NULL, *p;
+	u8 tmp[sizeof(int) + 1];
+	size_t start = out->len, buflen = 0;
 
 	callback_func = parm;
 
-	sc_debug(ctx, SC_LOG_DEBUG_ASN1, "%*.*sencoding '%s'%s\n",
-	       	depth, depth, "", entry->name,
-		(entry->flags & SC_ASN1_PRESENT)? "" : " (not present)");
+	/* log only once, while writing */
+	if (out->buf != NULL)
+		sc_debug(ctx, SC_LOG_DEBUG_ASN1, "%*.*sencoding '%s'%s\n",
+			depth, depth, "", entry->name,
+			(entry->flags & SC_ASN1_PRESENT)? "" : " (not present)");
 	if (!(entry->flags & SC_ASN1_PRESENT))
 		goto no_object;
-	sc_debug(ctx, SC_LOG_DEBUG_ASN1, "%*.*stype=%d, tag=0x%02x, parm=%p, len=%u\n",
-		depth, depth, "",
-		entry->type, entry->tag, parm, len? *len : 0);
+	if (out->buf != NULL)
+		sc_debug(ctx, SC_LOG_DEBUG_ASN1, "%*.*stype=%d, tag=0x%02x, parm=%p, len=%u\n",
+			depth, depth, "",
+			entry->type, entry->tag, parm, len? *len : 0);
 
 	if (entry->type == SC_ASN1_CHOICE) {
 		const struct sc_asn1_entry *list, *choice = NULL;
@@ -1575,7 +1633,7 @@ static int asn1_encode_entry(sc_context_t *ctx, const struct sc_asn1_entry *entr
 		}
 		if (choice == NULL)
 			goto no_object;
-		return asn1_encode_entry(ctx, choice, obj, objlen, depth + 1);
+		return asn1_encode_entry(ctx, choice, out, depth + 1);
 	}
 
 	if (entry->type != SC_ASN1_NULL && parm == NULL) {
@@ -1583,111 +1641,98 @@ static int asn1_encode_entry(sc_context_t *ctx, const struct sc_asn1_entry *entr
 		return SC_ERROR_INVALID_ASN1_OBJECT;
 	}
 
+	/* The value goes into the output directly; only the types encoded
+	 * by other modules still come in a buffer of their own. */
 	switch (entry->type) {
 	case SC_ASN1_STRUCT:
-		r = asn1_encode(ctx, (const struct sc_asn1_entry *) parm, &buf,
-				&buflen, depth + 1);
+		r = asn1_encode_list(ctx, (const struct sc_asn1_entry *) parm,
+				out, depth + 1);
 		break;
 	case SC_ASN1_NULL:
-		buf = NULL;
-		buflen = 0;
 		break;
 	case SC_ASN1_BOOLEAN:
-		buf = malloc(1);
-		if (buf == NULL) {
-			r = SC_ERROR_OUT_OF_MEMORY;
-			break;
-		}
-		buf[0] = *((int *) parm) ? 0xFF : 0;
-		buflen = 1;
+		tmp[0] = *((int *) parm) ? 0xFF : 0;
+		r = asn1_out_put(out, tmp, 1);
 		break;
 	case SC_ASN1_INTEGER:
 	case SC_ASN1_ENUMERATED:
-		r = asn1_encode_integer(*((int *) entry->parm), &buf, &buflen);
+		r = asn1_encode_integer(*((int *) entry->parm), tmp, &buflen);
+		if (r == 0)
+			r = asn1_out_put(out, tmp, buflen);
 		break;
 	case SC_ASN1_BIT_STRING_NI:
 	case SC_ASN1_BIT_STRING:
 		assert(len != NULL);
-		if (entry->type == SC_ASN1_BIT_STRING)
-			r = encode_bit_string((const u8 *) parm, *len, &buf, &buflen, 1);
-		else
-			r = encode_bit_string((const u8 *) parm, *len, &buf, &buflen, 0);
+		r = asn1_out_reserve(out, (*len + 7) / 8 + 1, &p);
+		if (r == 0 && p != NULL)
+			r = encode_bit_string((const u8 *) parm, *len, p,
+					entry->type == SC_ASN1_BIT_STRING);
 		break;
 	case SC_ASN1_BIT_FIELD:
 		assert(len != NULL);
-		r = encode_bit_field((const u8 *) parm, *len, &buf, &buflen);
+		r = encode_bit_field((const u8 *) parm, *len, tmp, &buflen);
+		if (r == 0)
+			r = asn1_out_put(out, tmp, buflen);
 		break;
 	case SC_ASN1_PRINTABLESTRING:
 	case SC_ASN1_OCTET_STRING:
 	case SC_ASN1_UTF8STRING:
 		assert(len != NULL);
-		buf = malloc(*len + 1);
-		if (buf == NULL) {
-			r = SC_ERROR_OUT_OF_MEMORY;
-			break;
-		}
-		buflen = 0;
+		r = asn1_out_put(out, (const u8 *) parm, *len);
 		/* If the integer is supposed to be unsigned, insert
 		 * a padding byte if the MSB is one */
-		if ((entry->flags & SC_ASN1_UNSIGNED)
+		if (r == 0 && (entry->flags & SC_ASN1_UNSIGNED)
 		 && (((u8 *) parm)[0] & 0x80)) {
-			buf[buflen++] = 0x00;
+			tmp[0] = 0x00;
+			r = asn1_out_put(out, tmp, 1);
 		}
-		memcpy(buf + buflen, parm, *len);
-		buflen += *len;
 		break;
 	case SC_ASN1_GENERALIZEDTIME:
 		assert(len != NULL);
-		buf = malloc(*len);
-		if (buf == NULL) {
-			r = SC_ERROR_OUT_OF_MEMORY;
-			break;
-		}
-		memcpy(buf, parm, *len);
-		buflen = *len;
+		r = asn1_out_put(out, (const u8 *) parm, *len);
 		break;
 	case SC_ASN1_OBJECT:
 		r = sc_asn1_encode_object_id(&buf, &buflen, (struct sc_object_id *) parm);
+		if (r == 0)
+			r = asn1_out_put(out, buf, buflen);
 		break;
 	case SC_ASN1_PATH:
-		r = asn1_encode_path(ctx, (const sc_path_t *) parm, &buf, &buflen, depth, entry->flags);
+		r = asn1_encode_path(ctx, (const sc_path_t *) parm, out, depth, entry->flags);
 		break;
 	case SC_ASN1_PKCS15_ID:
 		{
 			const struct sc_pkcs15_id *id = (const struct sc_pkcs15_id *) parm;
 
-			buf = malloc(id->len);
-			if (buf == NULL) {
-				r = SC_ERROR_OUT_OF_MEMORY;
-				break;
-			}
-			memcpy(buf, id->value, id->len);
-			buflen = id->len;
+			r = asn1_out_put(out, id->value, id->len);
 		}
 		break;
 	case SC_ASN1_PKCS15_OBJECT:
-		r = asn1_encode_p15_object(ctx, (const struct sc_asn1_pkcs15_object *) parm, &buf, &buflen, depth);
+		r = asn1_encode_p15_object(ctx, (const struct sc_asn1_pkcs15_object *) parm, out, depth);
 		break;
 	case SC_ASN1_ALGORITHM_ID:
 		r = sc_asn1_encode_algorithm_id(ctx, &buf, &buflen, (const struct sc_algorithm_id *) parm, depth);
+		if (r == 0)
+			r = asn1_out_put(out, buf, buflen);
 		break;
 	case SC_ASN1_SE_INFO:
 		if (!len)
 			return SC_ERROR_INVALID_ASN1_OBJECT;
-		r = asn1_encode_se_info(ctx, (struct sc_pkcs15_sec_env_info **)parm, *len, &buf, &buflen, depth);
+		r = asn1_encode_se_info(ctx, (struct sc_pkcs15_sec_env_info **)parm, *len, out, depth);
 		break;
 	case SC_ASN1_CALLBACK:
 		r = callback_func(ctx, entry->arg, &buf, &buflen, depth);
+		if (r == 0)
+			r = asn1_out_put(out, buf, buflen);
 		break;
 	default:
 		sc_debug(ctx, SC_LOG_DEBUG_ASN1, "invalid ASN.1 type: %d\n", entry->type);
 		return SC_ERROR_INVALID_ASN1_OBJECT;
 	}
+	if (buf)
+		free(buf);
 	if (r) {
 		sc_debug(ctx, SC_LOG_DEBUG_ASN1, "encoding of ASN.1 object '%s' failed: %s\n", entry->name,
 		      sc_strerror(r));
-		if (buf)
-			free(buf);
 		return r;
 	}
 
@@ -1702,20 +1747,17 @@ static int asn1_encode_entry(sc_context_t *ctx, const struct sc_asn1_entry *entr
 	 *  -	any other empty objects are considered bogus
 	 */
 no_object:
+	buflen = out->len - start;
 	if (!buflen && entry->flags & SC_ASN1_OPTIONAL && !(entry->flags & SC_ASN1_PRESENT)) {
 		/* This happens when we try to encode e.g. the
 		 * subClassAttributes, which may be empty */
-		*obj = NULL;
-		*objlen = 0;
 		r = 0;
 	} else if (!buflen && (entry->flags & SC_ASN1_EMPTY_ALLOWED)) {
-		*obj = NULL;
-		*objlen = 0;
-		r = asn1_write_element(ctx, entry->tag, buf, buflen, obj, objlen);
+		r = asn1_out_header(ctx, out, entry->tag, 0);
 		if (r)
 			sc_debug(ctx, SC_LOG_DEBUG_ASN1, "error writing ASN.1 tag and length: %s\n", sc_strerror(r));
 	} else if (buflen || entry->type == SC_ASN1_NULL || entry->tag & SC_ASN1_CONS) {
-		r = asn1_write_element(ctx, entry->tag, buf, buflen, obj, objlen);
+		r = asn1_out_header(ctx, out, entry->tag, buflen);
 		if (r)
 			sc_debug(ctx, SC_LOG_DEBUG_ASN1, "error writing ASN.1 tag and length: %s\n",
 					sc_strerror(r));
@@ -1726,49 +1768,59 @@ no_object:
 		sc_debug(ctx, SC_LOG_DEBUG_ASN1, "cannot encode empty non-optional ASN.1 object\n");
 		r = SC_ERROR_INVALID_ASN1_OBJECT;
 	}
-	if (buf)
-		free(buf);
-	if (r >= 0)
-		sc_debug(ctx, SC_LOG_DEBUG_ASN1, "%*.*slength of encoded item=%u\n", depth, depth, "", *objlen);
+	if (r >= 0 && out->buf != NULL)
+		sc_debug(ctx, SC_LOG_DEBUG_ASN1, "%*.*slength of encoded item=%u\n", depth, depth, "", out->len - start);
 	return r;
 }
 
+static int asn1_encode_list(sc_context_t *ctx, const struct sc_asn1_entry *asn1,
+		      struct asn1_out *out, int depth)
+{
+	int r, idx;
+
+	for (idx = 0; asn1[idx].name != NULL; idx++)
+		;
+	/* last entry first, the output grows backwards */
+	while (idx-- > 0) {
+		r = asn1_encode_entry(ctx, &asn1[idx], out, depth);
+		if (r)
+			return r;
+	}
+	return 0;
+}
+
+/* Sizes the encoding in a first pass, then writes it into one buffer of
+ * exactly that size. */
 static int asn1_encode(sc_context_t *ctx, const struct sc_asn1_entry *asn1,
 		      u8 **ptr, size_t *size, int depth)
 {
-	int r, idx = 0;
-	u8 *obj = NULL, *buf = NULL, *tmp;
-	size_t total = 0, objsize;
+	struct asn1_out out;
+	int r;
 
-	for (idx = 0; asn1[idx].name != NULL; idx++) {
-		r = asn1_encode_entry(ctx, &asn1[idx], &obj, &objsize, depth);
-		if (r) {
-			if (obj)
-				free(obj);
-			if (buf)
-				free(buf);
-			return r;
-		}
-		/* in case of an empty (optional) element continue with
-		 * the next asn1 element */
-		if (!objsize)
-			continue;
-		tmp = (u8 *) realloc(buf, total + objsize);
-		if (!tmp) {
-			if (obj)
-				free(obj);
-			if (buf)
-				free(buf);
-			return SC_ERROR_OUT_OF_MEMORY;
-		}
-		buf = tmp;
-		memcpy(buf + total, obj, objsize);
-		free(obj);
-		obj = NULL;
-		total += objsize;
-	}
-	*ptr = buf;
-	*size = total;
+	memset(&out, 0, sizeof(out));
+	r = asn1_encode_list(ctx, asn1, &out, depth);
+	if (r)
+		return r;
+	if (out.len == 0) {
+		*ptr = NULL;
+		*size = 0;
+		return 0;
+	}
+
+	out.buf = malloc(out.len);
+	if (out.buf == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	out.size = out.len;
+	out.len = 0;
+	r = asn1_encode_list(ctx, asn1, &out, depth);
+	if (r == 0 && out.len != out.size)
+		r = SC_ERROR_INTERNAL;
+	if (r) {
+		free(out.buf);
+		return r;
+	}
+	*ptr = out.buf;
+	*size = out.size;
 	return 0;
 }
 
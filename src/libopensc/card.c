@@ -23,14 +23,20 @@
 #endif
 
 #include <assert.h>
+#include <stdio.h>
 #include <stdlib.h>
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
 #include <string.h>
+#include <limits.h>
+#include <errno.h>
 
 #include "internal.h"
 #include "asn1.h"
+#include "cardctl.h"
+#include "iso7816.h"
+#include "trace.h"
 #include "common/compat_strlcpy.h"
 
 /*
@@ -75,7 +81,10 @@ static sc_card_t * sc_card_new(sc_context_t *ctx)
 	if (card == NULL)
 		return NULL;
 	card->ops = malloc(sizeof(struct sc_card_operations));
-	if (card->ops == NULL) {
+	card->apdu_stats = calloc(1, sizeof(struct sc_apdu_stats));
+	if (card->ops == NULL || card->apdu_stats == NULL) {
+		free(card->ops);
+		free(card->apdu_stats);
 		free(card);
 		return NULL;
 	}
@@ -83,6 +92,7 @@ static sc_card_t * sc_card_new(sc_context_t *ctx)
 	card->ctx = ctx;
 	if (sc_mutex_create(ctx, &card->mutex) != SC_SUCCESS) {
 		free(card->ops);
+		free(card->apdu_stats);
 		free(card);
 		return NULL;
 	}
@@ -102,6 +112,7 @@ static void sc_card_free(sc_card_t *card)
 		sc_file_free(card->ef_dir);
 
 	free(card->ops);
+	free(card->apdu_stats);
 
 	if (card->algorithms != NULL)   {
 		int i;
@@ -126,6 +137,8 @@ static void sc_card_free(sc_card_t *card)
 	if (card->cache.current_df)
 		sc_file_free(card->cache.current_df);
 
+	sc_invalidate_selection(card);
+
 	if (card->mutex != NULL) {
 		int r = sc_mutex_destroy(card->ctx, card->mutex);
 		if (r != SC_SUCCESS)
@@ -135,11 +148,162 @@ static void sc_card_free(sc_card_t *card)
 	free(card);
 }
 
+/* Enable extended length APDUs the driver did not ask for, when the card
+ * announces them in its historical bytes or EF.ATR and the reader tells
+ * how much data it can transfer */
+static void sc_card_detect_apdu_ext(sc_card_t *card)
+{
+	sc_context_t *ctx = card->ctx;
+	sc_reader_t *reader = card->reader;
+	const u8 *hist = reader->atr_info.hist_bytes;
+	size_t hist_len = reader->atr_info.hist_bytes_len, end, i;
+	unsigned char caps = 0;
+
+	if (!ctx->enable_extended_apdu || (card->caps & SC_CARD_CAP_APDU_EXT))
+		return;
+	/* the driver knows better */
+	if ((card->max_send_size && card->max_send_size <= 255)
+			|| (card->max_recv_size && card->max_recv_size <= 256))
+		return;
+	if (reader->active_protocol != SC_PROTO_T1
+			|| reader->max_send_size <= 255 || reader->max_recv_size <= 256)
+		return;
+
+	/* card capabilities in the compact-TLV historical bytes */
+	if (hist != NULL && hist_len > 0 && (hist[0] == ISO7816_II_CATEGORY_TLV
+				|| (hist[0] == ISO7816_II_CATEGORY_NOT_TLV && hist_len > 3))) {
+		end = hist[0] == ISO7816_II_CATEGORY_TLV ? hist_len : hist_len - 3;
+		for (i = 1; i < end; i += 1 + (hist[i] & 0x0F))
+			if (hist[i] == 0x73 && i + 3 < end)
+				caps = hist[i + 3];
+	}
+	if (card->ef_atr)
+		caps |= card->ef_atr->card_capabilities;
+	if (!(caps & ISO7816_CAP_EXTENDED_LENGTH))
+		return;
+
+	card->caps |= SC_CARD_CAP_APDU_EXT;
+	/* EF.ATR counts the whole APDUs */
+	if (card->ef_atr && card->ef_atr->max_command_apdu > 9
+			&& card->ef_atr->max_response_apdu > 2) {
+		card->max_send_size = card->ef_atr->max_command_apdu - 9;
+		card->max_recv_size = card->ef_atr->max_response_apdu - 2;
+	}
+	sc_log(ctx, "extended length APDUs enabled");
+}
+
+/* The driver that last bound a card is remembered per ATR, in
+ * <cache dir>/driver_<ATR>, so that it can be tried first the next time */
+static int driver_cache_filename(sc_card_t *card, char *buf, size_t bufsize)
+{
+	char dir[PATH_MAX];
+	char atr[SC_MAX_ATR_SIZE * 2 + 1];
+	int r;
+
+	r = sc_get_cache_dir(card->ctx, dir, sizeof(dir));
+	if (r != SC_SUCCESS)
+		return r;
+	r = sc_bin_to_hex(card->atr.value, card->atr.len, atr, sizeof(atr), 0);
+	if (r != SC_SUCCESS)
+		return r;
+	r = snprintf(buf, bufsize, "%s/driver_%s", dir, atr);
+	if (r < 0 || (size_t)r >= bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
+static struct sc_card_driver *driver_cache_lookup(sc_card_t *card)
+{
+	sc_context_t *ctx = card->ctx;
+	char fname[PATH_MAX], name[64];
+	FILE *f;
+	size_t len;
+	int i;
+
+	if (driver_cache_filename(card, fname, sizeof(fname)) != SC_SUCCESS)
+		return NULL;
+	f = fopen(fname, "r");
+	if (f == NULL)
+		return NULL;
+	len = fread(name, 1, sizeof(name) - 1, f);
+	fclose(f);
+	name[len] = '\0';
+
+	for (i = 0; ctx->card_drivers[i] != NULL; i++)
+		if (!strcmp(name, ctx->card_drivers[i]->short_name))
+			return ctx->card_drivers[i];
+	return NULL;
+}
+
+/* Remember the driver, or forget the cached one with NULL */
+static void driver_cache_store(sc_card_t *card, const struct sc_card_driver *driver)
+{
+	char fname[PATH_MAX];
+	FILE *f;
+
+	if (driver_cache_filename(card, fname, sizeof(fname)) != SC_SUCCESS)
+		return;
+	if (driver == NULL) {
+		unlink(fname);
+		return;
+	}
+	f = fopen(fname, "w");
+	if (f == NULL && errno == ENOENT) {
+		if (sc_make_cache_dir(card->ctx) != SC_SUCCESS)
+			return;
+		f = fopen(fname, "w");
+	}
+	if (f == NULL)
+		return;
+	if (fputs(driver->short_name, f) < 0) {
+		fclose(f);
+		unlink(fname);
+		return;
+	}
+	fclose(f);
+}
+
+/* Returns 1 when the driver took the card, 0 when it did not */
+static int connect_card_driver(sc_card_t *card, struct sc_card_driver *drv)
+{
+	sc_context_t *ctx = card->ctx;
+	const struct sc_card_operations *ops = drv->ops;
+	int r;
+
+	sc_log(ctx, "trying driver '%s'", drv->short_name);
+	if (ops == NULL || ops->match_card == NULL)   {
+		return 0;
+	}
+	else if (!ctx->enable_default_driver && !strcmp("default", drv->short_name))   {
+		sc_log(ctx , "ignore 'default' card driver");
+		return 0;
+	}
+
+	/* Needed if match_card() needs to talk with the card (e.g. card-muscle) */
+	*card->ops = *ops;
+	if (ops->match_card(card) != 1)
+		return 0;
+	sc_log(ctx, "matched: %s", drv->name);
+	memcpy(card->ops, ops, sizeof(struct sc_card_operations));
+	card->driver = drv;
+	r = ops->init(card);
+	if (r) {
+		sc_log(ctx, "driver '%s' init() failed: %s", drv->name, sc_strerror(r));
+		if (r == SC_ERROR_INVALID_CARD) {
+			card->driver = NULL;
+			return 0;
+		}
+		return r;
+	}
+	return 1;
+}
+
 int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 {
 	sc_card_t *card;
 	sc_context_t *ctx;
 	struct sc_card_driver *driver;
+	unsigned long start;
 	int i, r = 0, idx, connected = 0;
 
 	if (card_out == NULL || reader == NULL)
@@ -152,7 +316,9 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 	card = sc_card_new(ctx);
 	if (card == NULL)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+	start = sc_trace_clock();
 	r = reader->ops->connect(reader);
+	sc_trace_event(ctx, reader, SC_TRACE_CONNECT, r, sc_trace_clock() - start);
 	if (r)
 		goto err;
 
@@ -163,6 +329,25 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 	memcpy(&card->atr, &reader->atr, sizeof(card->atr));
 
 	_sc_parse_atr(reader);
+	sc_log(ctx, "ATR: %s", sc_dump_hex(card->atr.value, card->atr.len));
+	if (ctx->apdu_record != NULL) {
+		char hex[SC_MAX_ATR_SIZE * 2 + 2];
+		const char *proto;
+
+		switch (reader->active_protocol) {
+		case SC_PROTO_T0:
+			proto = "T0";
+			break;
+		case SC_PROTO_RAW:
+			proto = "RAW";
+			break;
+		default:
+			proto = "T1";
+			break;
+		}
+		sc_bin_to_hex(card->atr.value, card->atr.len, hex, sizeof(hex), 0);
+		fprintf(ctx->apdu_record, "atr %s %s\n", hex, proto);
+	}
 
 	/* See if the ATR matches any ATR specified in the config file */
 	if ((driver = ctx->forced_driver) == NULL) {
@@ -209,38 +394,40 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 		}
 	}
 	else {
-		sc_log(ctx, "matching built-in ATRs");
-		for (i = 0; ctx->card_drivers[i] != NULL; i++) {
-			struct sc_card_driver *drv = ctx->card_drivers[i];
-			const struct sc_card_operations *ops = drv->ops;
-
-			sc_log(ctx, "trying driver '%s'", drv->short_name);
-			if (ops == NULL || ops->match_card == NULL)   {
-				continue;
-			}
-			else if (!ctx->enable_default_driver && !strcmp("default", drv->short_name))   {
-				sc_log(ctx , "ignore 'default' card driver");
-				continue;
+		struct sc_card_driver *cached = NULL;
+
+		if (ctx->enable_driver_cache) {
+			cached = driver_cache_lookup(card);
+			if (cached != NULL) {
+				sc_log(ctx, "trying cached driver '%s'", cached->short_name);
+				r = connect_card_driver(card, cached);
+				if (r < 0)
+					goto err;
+				if (r == 0) {
+					driver_cache_store(card, NULL);
+					cached = NULL;
+				}
 			}
+		}
 
-			/* Needed if match_card() needs to talk with the card (e.g. card-muscle) */
-			*card->ops = *ops;
-			if (ops->match_card(card) != 1)
-				continue;
-			sc_log(ctx, "matched: %s", drv->name);
-			memcpy(card->ops, ops, sizeof(struct sc_card_operations));
-			card->driver = drv;
-			r = ops->init(card);
-			if (r) {
-				sc_log(ctx, "driver '%s' init() failed: %s", drv->name, sc_strerror(r));
-				if (r == SC_ERROR_INVALID_CARD) {
-					card->driver = NULL;
-					continue;
-				}
-				goto err;
+		if (card->driver == NULL) {
+			sc_log(ctx, "matching built-in ATRs");
+			for (i = 0; ctx->card_drivers[i] != NULL; i++) {
+				struct sc_card_driver *drv = ctx->card_drivers[i];
+
+				r = connect_card_driver(card, drv);
+				if (r < 0)
+					goto err;
+				if (r == 1)
+					break;
 			}
-			break;
 		}
+
+		/* The default driver takes any card, it would hide
+		 * drivers that later match the same ATR */
+		if (ctx->enable_driver_cache && card->driver != NULL && card->driver != cached
+				&& strcmp("default", card->driver->short_name))
+			driver_cache_store(card, card->driver);
 	}
 	if (card->driver == NULL) {
 		sc_log(ctx, "unable to find driver for inserted card");
@@ -250,6 +437,8 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 	if (card->name == NULL)
 		card->name = card->driver->name;
 
+	sc_card_detect_apdu_ext(card);
+
 	/*  Override card limitations with reader limitations.
 	 *  Note that zero means no limitations at all.
 	 */
@@ -261,6 +450,14 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 			((reader->max_send_size != 0) && (reader->max_send_size < card->max_send_size)))
 		card->max_send_size = reader->max_send_size;
 
+	/* Readers may report more than an APDU can carry */
+	if (card->caps & SC_CARD_CAP_APDU_EXT) {
+		if (card->max_send_size > 65535)
+			card->max_send_size = 65535;
+		if (card->max_recv_size > 65536)
+			card->max_recv_size = 65536;
+	}
+
 	sc_log(ctx, "card info name:'%s', type:%i, flags:0x%X, max_send/recv_size:%i/%i",
 		card->name, card->type, card->flags, card->max_send_size, card->max_recv_size);
 
@@ -301,7 +498,10 @@ int sc_disconnect_card(sc_card_t *card)
 	}
 
 	if (card->reader->ops->disconnect) {
+		unsigned long start = sc_trace_clock();
 		int r = card->reader->ops->disconnect(card->reader);
+
+		sc_trace_event(ctx, card->reader, SC_TRACE_DISCONNECT, r, sc_trace_clock() - start);
 		if (r)
 			sc_log(ctx, "disconnect() failed: %s", sc_strerror(r));
 	}
@@ -317,6 +517,7 @@ int sc_disconnect_card(sc_card_t *card)
 
 int sc_reset(sc_card_t *card, int do_cold_reset)
 {
+	unsigned long start;
 	int r, r2;
 
 	if (card == NULL)
@@ -328,8 +529,11 @@ int sc_reset(sc_card_t *card, int do_cold_reset)
 	if (r != SC_SUCCESS)
 		return r;
 
+	start = sc_trace_clock();
 	r = card->reader->ops->reset(card->reader, do_cold_reset);
+	sc_trace_event(card->ctx, card->reader, SC_TRACE_RESET, r, sc_trace_clock() - start);
 	/* invalidate cache */
+	sc_invalidate_selection(card);
 	memset(&card->cache, 0, sizeof(card->cache));
 	card->cache.valid = 0;
 
@@ -344,6 +548,7 @@ int sc_reset(sc_card_t *card, int do_cold_reset)
 
 int sc_lock(sc_card_t *card)
 {
+	unsigned long start;
 	int r = 0, r2 = 0;
 
 	if (card == NULL)
@@ -356,9 +561,12 @@ int sc_lock(sc_card_t *card)
 		return r;
 	if (card->lock_count == 0) {
 		if (card->reader->ops->lock != NULL) {
+			start = sc_trace_clock();
 			r = card->reader->ops->lock(card->reader);
+			sc_trace_event(card->ctx, card->reader, SC_TRACE_LOCK, r, sc_trace_clock() - start);
 			if (r == SC_ERROR_CARD_RESET || r == SC_ERROR_READER_REATTACHED) {
 				/* invalidate cache */
+				sc_invalidate_selection(card);
 				memset(&card->cache, 0, sizeof(card->cache));
 				card->cache.valid = 0;
 #ifdef ENABLE_SM
@@ -397,6 +605,8 @@ int sc_unlock(sc_card_t *card)
 
 	assert(card->lock_count >= 1);
 	if (--card->lock_count == 0) {
+		/* others may select files once the reader lock is gone */
+		sc_invalidate_selection(card);
 #ifdef INVALIDATE_CARD_CACHE_IN_UNLOCK
 		/* invalidate cache */
 		memset(&card->cache, 0, sizeof(card->cache));
@@ -404,8 +614,13 @@ int sc_unlock(sc_card_t *card)
 		sc_log(card->ctx, "cache invalidated");
 #endif
 		/* release reader lock */
-		if (card->reader->ops->unlock != NULL)
+		if (card->reader->ops->unlock != NULL) {
+			unsigned long start = sc_trace_clock();
+
 			r = card->reader->ops->unlock(card->reader);
+			sc_trace_event(card->ctx, card->reader, SC_TRACE_UNLOCK, r,
+					sc_trace_clock() - start);
+		}
 	}
 	r2 = sc_mutex_unlock(card->ctx, card->mutex);
 	if (r2 != SC_SUCCESS) {
@@ -800,6 +1015,20 @@ sc_card_ctl(sc_card_t *card, unsigned long cmd, void *args)
 	assert(card != NULL);
 	LOG_FUNC_CALLED(card->ctx);
 
+	/* APDU statistics are kept for every card */
+	switch (cmd) {
+	case SC_CARDCTL_GET_APDU_STATS:
+		if (args == NULL)
+			LOG_FUNC_RETURN(card->ctx, SC_ERROR_INVALID_ARGUMENTS);
+		memcpy(args, card->apdu_stats, sizeof(struct sc_apdu_stats));
+		LOG_FUNC_RETURN(card->ctx, SC_SUCCESS);
+	case SC_CARDCTL_RESET_APDU_STATS:
+		memset(card->apdu_stats, 0, sizeof(struct sc_apdu_stats));
+		LOG_FUNC_RETURN(card->ctx, SC_SUCCESS);
+	case SC_CARDCTL_DUMP_TRACE:
+		LOG_FUNC_RETURN(card->ctx, sc_trace_dump(card->ctx, (const char *) args));
+	}
+
 	if (card->ops->card_ctl != NULL)
 		r = card->ops->card_ctl(card, cmd, args);
 
@@ -905,67 +1134,166 @@ sc_algorithm_info_t * sc_card_find_gostr3410_alg(sc_card_t *card,
 	return sc_card_find_alg(card, SC_ALGORITHM_GOSTR3410, key_length, NULL);
 }
 
-static int match_atr_table(sc_context_t *ctx, struct sc_atr_table *table, struct sc_atr *atr)
+/* ATR tables are compiled when they are first matched: every row is
+ * converted to binary once, masked, and sorted by ATR length */
+struct sc_atr_index_entry {
+	size_t len;
+	int row;
+	int masked;
+	u8 value[SC_MAX_ATR_SIZE];
+	u8 mask[SC_MAX_ATR_SIZE];
+};
+
+struct sc_atr_index {
+	const struct sc_atr_table *table;
+	struct sc_atr_index_entry *entries;
+	size_t count;
+	struct sc_atr_index *next;
+};
+
+static int atr_index_entry_cmp(const void *a, const void *b)
 {
-	u8 *card_atr_bin;
-	size_t card_atr_bin_len;
-	char card_atr_hex[3 * SC_MAX_ATR_SIZE];
-	size_t card_atr_hex_len;
-	unsigned int i = 0;
+	const struct sc_atr_index_entry *ea = a, *eb = b;
 
-	if (ctx == NULL || table == NULL || atr == NULL)
-		return -1;
-	card_atr_bin = atr->value;
-	card_atr_bin_len = atr->len;
-	sc_bin_to_hex(card_atr_bin, card_atr_bin_len, card_atr_hex, sizeof(card_atr_hex), ':');
-	card_atr_hex_len = strlen(card_atr_hex);
+	if (ea->len != eb->len)
+		return ea->len < eb->len ? -1 : 1;
+	return ea->row - eb->row;
+}
 
-	sc_log(ctx, "ATR     : %s", card_atr_hex);
+static struct sc_atr_index *atr_index_build(sc_context_t *ctx, const struct sc_atr_table *table)
+{
+	struct sc_atr_index *index;
+	struct sc_atr_index_entry *entry;
+	size_t rows, i, s, mask_len;
+
+	for (rows = 0; table[rows].atr != NULL; rows++)
+		;
+	index = calloc(1, sizeof(*index));
+	if (index == NULL)
+		return NULL;
+	index->table = table;
+	if (rows) {
+		index->entries = calloc(rows, sizeof(*index->entries));
+		if (index->entries == NULL) {
+			free(index);
+			return NULL;
+		}
+	}
 
-	for (i = 0; table[i].atr != NULL; i++) {
+	for (i = 0; i < rows; i++) {
 		const char *tatr = table[i].atr;
 		const char *matr = table[i].atrmask;
-		size_t tatr_len = strlen(tatr);
-		u8 mbin[SC_MAX_ATR_SIZE], tbin[SC_MAX_ATR_SIZE];
-		size_t mbin_len, tbin_len, s, matr_len;
-		size_t fix_hex_len = card_atr_hex_len;
-		size_t fix_bin_len = card_atr_bin_len;
 
-		sc_log(ctx, "ATR try : %s", tatr);
-
-		if (tatr_len != fix_hex_len) {
-			sc_log(ctx, "ignored - wrong length");
+		entry = &index->entries[index->count];
+		entry->len = sizeof(entry->value);
+		/* only ATRs in the 3B:xx:... form are matched */
+		if (sc_hex_to_bin(tatr, entry->value, &entry->len) != SC_SUCCESS
+				|| entry->len == 0 || strlen(tatr) != 3 * entry->len - 1) {
+			sc_log(ctx, "ignored ATR %s", tatr);
 			continue;
 		}
 		if (matr != NULL) {
-			sc_log(ctx, "ATR mask: %s", matr);
-
-			matr_len = strlen(matr);
-			if (tatr_len != matr_len)
-				continue;
-			tbin_len = sizeof(tbin);
-			sc_hex_to_bin(tatr, tbin, &tbin_len);
-			mbin_len = sizeof(mbin);
-			sc_hex_to_bin(matr, mbin, &mbin_len);
-			if (mbin_len != fix_bin_len) {
+			mask_len = sizeof(entry->mask);
+			if (strlen(matr) != strlen(tatr)
+					|| sc_hex_to_bin(matr, entry->mask, &mask_len) != SC_SUCCESS
+					|| mask_len != entry->len) {
 				sc_log(ctx, "length of atr and atr mask do not match - ignored: %s - %s", tatr, matr);
 				continue;
 			}
-			for (s = 0; s < tbin_len; s++) {
-				/* reduce tatr with mask */
-				tbin[s] = (tbin[s] & mbin[s]);
-				/* create copy of card_atr_bin masked) */
-				mbin[s] = (card_atr_bin[s] & mbin[s]);
-			}
-			if (memcmp(tbin, mbin, tbin_len) != 0)
-				continue;
-		} else {
-			if (strncasecmp(tatr, card_atr_hex, tatr_len) != 0)
-				continue;
+			for (s = 0; s < entry->len; s++)
+				entry->value[s] &= entry->mask[s];
+			entry->masked = 1;
+		}
+		entry->row = (int)i;
+		index->count++;
+	}
+	if (index->count)
+		qsort(index->entries, index->count, sizeof(*index->entries), atr_index_entry_cmp);
+	return index;
+}
+
+static void atr_index_free(struct sc_atr_index *index)
+{
+	if (index->entries)
+		free(index->entries);
+	free(index);
+}
+
+/* Forget the compiled form of a table that is about to change */
+static void atr_index_drop(sc_context_t *ctx, const struct sc_atr_table *table)
+{
+	struct sc_atr_index **pp, *index;
+
+	if (table == NULL)
+		return;
+	sc_mutex_lock(ctx, ctx->mutex);
+	for (pp = &ctx->atr_index; *pp != NULL; pp = &(*pp)->next) {
+		if ((*pp)->table == table) {
+			index = *pp;
+			*pp = index->next;
+			atr_index_free(index);
+			break;
+		}
+	}
+	sc_mutex_unlock(ctx, ctx->mutex);
+}
+
+void _sc_free_atr_index(sc_context_t *ctx)
+{
+	struct sc_atr_index *index;
+
+	while ((index = ctx->atr_index) != NULL) {
+		ctx->atr_index = index->next;
+		atr_index_free(index);
+	}
+}
+
+static int match_atr_table(sc_context_t *ctx, struct sc_atr_table *table, struct sc_atr *atr)
+{
+	struct sc_atr_index *index;
+	const struct sc_atr_index_entry *entry;
+	size_t i, s;
+	int row = -1;
+
+	if (ctx == NULL || table == NULL || atr == NULL)
+		return -1;
+
+	sc_mutex_lock(ctx, ctx->mutex);
+	for (index = ctx->atr_index; index != NULL; index = index->next)
+		if (index->table == table)
+			break;
+	if (index == NULL) {
+		index = atr_index_build(ctx, table);
+		if (index == NULL) {
+			sc_mutex_unlock(ctx, ctx->mutex);
+			return -1;
 		}
-		return i;
+		index->next = ctx->atr_index;
+		ctx->atr_index = index;
+	}
+
+	for (i = 0; i < index->count && row < 0; i++) {
+		entry = &index->entries[i];
+		if (entry->len < atr->len)
+			continue;
+		if (entry->len > atr->len)
+			break;
+		if (!entry->masked) {
+			if (memcmp(entry->value, atr->value, atr->len) == 0)
+				row = entry->row;
+			continue;
+		}
+		for (s = 0; s < atr->len; s++)
+			if ((atr->value[s] & entry->mask[s]) != entry->value[s])
+				break;
+		if (s == atr->len)
+			row = entry->row;
 	}
-	return -1;
+	sc_mutex_unlock(ctx, ctx->mutex);
+
+	if (row >= 0)
+		sc_log(ctx, "ATR matched: %s", table[row].atr);
+	return row;
 }
 
 int _sc_match_atr(sc_card_t *card, struct sc_atr_table *table, int *type_out)
@@ -1016,6 +1344,7 @@ int _sc_add_atr(sc_context_t *ctx, struct sc_card_driver *driver, struct sc_atr_
 {
 	struct sc_atr_table *map, *dst;
 
+	atr_index_drop(ctx, driver->atr_map);
 	map = (struct sc_atr_table *) realloc(driver->atr_map,
 			(driver->natrs + 2) * sizeof(struct sc_atr_table));
 	if (!map)
@@ -1059,6 +1388,7 @@ int _sc_free_atr(sc_context_t *ctx, struct sc_card_driver *driver)
 {
 	unsigned int i;
 
+	atr_index_drop(ctx, driver->atr_map);
 	for (i = 0; i < driver->natrs; i++) {
 		struct sc_atr_table *src = &driver->atr_map[i];
 
@@ -1099,6 +1429,29 @@ scconf_block *sc_get_conf_block(sc_context_t *ctx, const char *name1, const char
 	return conf_block;
 }
 
+void sc_invalidate_selection(struct sc_card *card)
+{
+	if (card->cache.selected_file)
+		sc_file_free(card->cache.selected_file);
+	card->cache.selected_file = NULL;
+	memset(&card->cache.selected_path, 0, sizeof(card->cache.selected_path));
+	card->cache.sec_env_valid = 0;
+}
+
+void sc_remember_selection(struct sc_card *card, const struct sc_path *path,
+		const struct sc_file *file)
+{
+	sc_invalidate_selection(card);
+	if (!card->ctx->enable_select_cache || card->lock_count == 0)
+		return;
+	if (path->type != SC_PATH_TYPE_PATH || path->aid.len || path->len < 2
+			|| memcmp(path->value, "\x3F\x00", 2))
+		return;
+	card->cache.selected_path = *path;
+	if (file)
+		sc_file_dup(&card->cache.selected_file, file);
+}
+
 void sc_print_cache(struct sc_card *card)   {
 	struct sc_context *ctx = NULL;
 
@@ -44,6 +44,9 @@ enum {
 	SC_CARDCTL_GET_CHV_REFERENCE_IN_SE,
 	SC_CARDCTL_PKCS11_INIT_TOKEN,
 	SC_CARDCTL_PKCS11_INIT_PIN,
+	SC_CARDCTL_GET_APDU_STATS,
+	SC_CARDCTL_RESET_APDU_STATS,
+	SC_CARDCTL_DUMP_TRACE,		/* args: file name or NULL for trace_file */
 
 	/*
 	 * GPK specific calls
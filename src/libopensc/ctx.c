@@ -27,12 +27,16 @@
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <limits.h>
 
 #ifdef _WIN32
 #include <windows.h>
 #include <winreg.h>
+#include <io.h>
+#else
+#include <unistd.h>
 #endif
 
 #include "common/libscdl.h"
@@ -122,6 +126,11 @@ struct _sc_ctx_options {
 	struct _sc_driver_entry cdrv[SC_MAX_CARD_DRIVERS];
 	int ccount;
 	char *forced_card_driver;
+	int trace_size;
+	char *trace_file;
+	int trace_signal;
+	int debug_queue_size;
+	int debug_flush_interval;
 };
 
 
@@ -188,6 +197,10 @@ static void set_defaults(sc_context_t *ctx, struct _sc_ctx_options *opts)
 	ctx->debug_file = stderr;
 	ctx->paranoid_memory = 0;
 	ctx->enable_default_driver = 0;
+	ctx->enable_select_cache = 1;
+	ctx->enable_sec_env_cache = 0;
+	ctx->enable_extended_apdu = 1;
+	ctx->enable_driver_cache = 0;
 
 #ifdef __APPLE__
 	/* Override the default debug log for OpenSC.tokend to be different from PKCS#11.
@@ -196,15 +209,37 @@ static void set_defaults(sc_context_t *ctx, struct _sc_ctx_options *opts)
 		ctx->debug_file = fopen("/tmp/opensc-tokend.log", "a");
 #endif
 	ctx->forced_driver = NULL;
+	opts->trace_size = 1024;
+	opts->trace_signal = 0;
+	opts->debug_queue_size = 0;
+	opts->debug_flush_interval = 100;
 	add_internal_drvs(opts);
 }
 
+/* The transcript holds PINs and keys, so only the user may read it */
+static FILE *open_apdu_record(const char *filename)
+{
+	FILE *f;
+	int fd;
+
+	fd = open(filename, O_WRONLY | O_CREAT | O_APPEND, 0600);
+	if (fd < 0)
+		return NULL;
+	f = fdopen(fd, "a");
+	if (f == NULL)
+		close(fd);
+	return f;
+}
+
 /* In Windows, file handles can not be shared between DLL-s,
  * each DLL has a separate file handle table. Thus tools and utilities
  * can not set the file handle themselves when -v is specified on command line.
  */
 int sc_ctx_log_to_file(sc_context_t *ctx, const char* filename)
 {
+	int r = SC_SUCCESS;
+
+	sc_log_queue_hold(ctx);
 	/* Close any existing handles */
 	if (ctx->debug_file && (ctx->debug_file != stderr && ctx->debug_file != stdout))   {
 		fclose(ctx->debug_file);
@@ -219,9 +254,10 @@ int sc_ctx_log_to_file(sc_context_t *ctx, const char* filename)
 	else {
 		ctx->debug_file = fopen(filename, "a");
 		if (ctx->debug_file == NULL)
-			return SC_ERROR_INTERNAL;
+			r = SC_ERROR_INTERNAL;
 	}
-	return SC_SUCCESS;
+	sc_log_queue_release(ctx);
+	return r;
 }
 
 
@@ -239,6 +275,9 @@ load_parameters(sc_context_t *ctx, scconf_block *block, struct _sc_ctx_options *
 #endif
 
 	reopen = scconf_get_bool(block, "reopen_debug_file", 1);
+	opts->debug_queue_size = scconf_get_int(block, "debug_queue_size", opts->debug_queue_size);
+	opts->debug_flush_interval = scconf_get_int(block, "debug_flush_interval",
+			opts->debug_flush_interval);
 
 	debug = scconf_get_int(block, "debug", ctx->debug);
 	if (debug > ctx->debug)
@@ -258,12 +297,39 @@ load_parameters(sc_context_t *ctx, scconf_block *block, struct _sc_ctx_options *
 		sc_ctx_log_to_file(ctx, val);
 	}
 
+	val = scconf_get_str(block, "apdu_record", NULL);
+	if (val)   {
+		if (ctx->apdu_record != NULL)
+			fclose(ctx->apdu_record);
+		ctx->apdu_record = open_apdu_record(val);
+	}
+
+	opts->trace_size = scconf_get_int(block, "trace_size", opts->trace_size);
+	val = scconf_get_str(block, "trace_file", NULL);
+	if (val) {
+		free(opts->trace_file);
+		opts->trace_file = strdup(val);
+	}
+	opts->trace_signal = scconf_get_bool(block, "trace_signal", opts->trace_signal);
+
 	ctx->paranoid_memory = scconf_get_bool (block, "paranoid-memory",
 		ctx->paranoid_memory);
 
 	ctx->enable_default_driver = scconf_get_bool (block, "enable_default_driver",
 			ctx->enable_default_driver);
 
+	ctx->enable_select_cache = scconf_get_bool (block, "enable_select_cache",
+			ctx->enable_select_cache);
+
+	ctx->enable_sec_env_cache = scconf_get_bool (block, "enable_sec_env_cache",
+			ctx->enable_sec_env_cache);
+
+	ctx->enable_extended_apdu = scconf_get_bool (block, "enable_extended_apdu",
+			ctx->enable_extended_apdu);
+
+	ctx->enable_driver_cache = scconf_get_bool (block, "enable_driver_cache",
+			ctx->enable_driver_cache);
+
 	val = scconf_get_str(block, "force_card_driver", NULL);
 	if (val) {
 		if (opts->forced_card_driver)
@@ -704,6 +770,9 @@ int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 	sc_context_t		*ctx;
 	struct _sc_ctx_options	opts;
 	int			r;
+#ifndef _WIN32
+	scconf_block		*conf_block;
+#endif
 
 	if (ctx_out == NULL || parm == NULL)
 		return SC_ERROR_INVALID_ARGUMENTS;
@@ -736,6 +805,13 @@ int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 	}
 
 	process_config_file(ctx, &opts);
+	if (opts.trace_size > 0
+			&& sc_trace_create(ctx, opts.trace_size, opts.trace_file, opts.trace_signal) != SC_SUCCESS)
+		sc_log(ctx, "cannot allocate the APDU trace");
+	free(opts.trace_file);
+	if (opts.debug_queue_size > 0
+			&& sc_log_queue_start(ctx, opts.debug_queue_size, opts.debug_flush_interval) != SC_SUCCESS)
+		sc_log(ctx, "cannot start the debug log writer, logging synchronously");
 	sc_log(ctx, "==================================="); /* first thing in the log */
 	sc_log(ctx, "opensc version: %s", sc_get_version());
 
@@ -751,6 +827,15 @@ int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 #elif defined(ENABLE_OPENCT)
 	ctx->reader_driver = sc_get_openct_driver();
 #endif
+#ifndef _WIN32
+	/* a configured card image or APDU transcript replaces the hardware readers */
+	conf_block = sc_get_conf_block(ctx, "reader_driver", "virtual", 1);
+	if (conf_block != NULL && scconf_get_str(conf_block, "image", NULL) != NULL)
+		ctx->reader_driver = sc_get_virtual_driver();
+	conf_block = sc_get_conf_block(ctx, "reader_driver", "replay", 1);
+	if (conf_block != NULL && scconf_get_str(conf_block, "transcript", NULL) != NULL)
+		ctx->reader_driver = sc_get_replay_driver();
+#endif
 
 	r = ctx->reader_driver->ops->init(ctx);
 	if (r != SC_SUCCESS)   {
@@ -814,6 +899,7 @@ int sc_release_context(sc_context_t *ctx)
 		sc_reader_t *rdr = (sc_reader_t *) list_get_at(&ctx->readers, 0);
 		_sc_delete_reader(ctx, rdr);
 	}
+	sc_trace_free(ctx);
 
 	if (ctx->reader_driver->ops->finish != NULL)
 		ctx->reader_driver->ops->finish(ctx);
@@ -826,8 +912,11 @@ int sc_release_context(sc_context_t *ctx)
 		if (drv->dll)
 			sc_dlclose(drv->dll);
 	}
+	_sc_free_atr_index(ctx);
 	if (ctx->preferred_language != NULL)
 		free(ctx->preferred_language);
+	/* write out the remaining debug messages */
+	sc_log_queue_stop(ctx);
 	if (ctx->mutex != NULL) {
 		int r = sc_mutex_destroy(ctx, ctx->mutex);
 		if (r != SC_SUCCESS) {
@@ -841,6 +930,8 @@ int sc_release_context(sc_context_t *ctx)
 		fclose(ctx->debug_file);
 	if (ctx->debug_filename != NULL)
 		free(ctx->debug_filename);
+	if (ctx->apdu_record != NULL)
+		fclose(ctx->apdu_record);
 	if (ctx->app_name != NULL)
 		free(ctx->app_name);
 	list_destroy(&ctx->readers);
@@ -105,6 +105,24 @@ sc_parse_ef_atr_content(struct sc_card *card, unsigned char *buf, size_t buflen)
 		}
 	}
 
+	tag = sc_asn1_find_tag(ctx, buf, buflen, ISO7816_TAG_II_EXTENDED_LENGTH, &taglen);
+	if (tag)   {
+		const unsigned char *num;
+		size_t numlen;
+		int max_command = 0, max_response = 0;
+
+		num = sc_asn1_skip_tag(ctx, &tag, &taglen, SC_ASN1_TAG_INTEGER, &numlen);
+		if (num && !sc_asn1_decode_integer(num, numlen, &max_command))   {
+			num = sc_asn1_skip_tag(ctx, &tag, &taglen, SC_ASN1_TAG_INTEGER, &numlen);
+			if (num && !sc_asn1_decode_integer(num, numlen, &max_response)
+					&& max_command > 0 && max_response > 0)   {
+				ef_atr.max_command_apdu = max_command;
+				ef_atr.max_response_apdu = max_response;
+				sc_log(ctx, "EF.ATR: max APDU command %i, response %i", max_command, max_response);
+			}
+		}
+	}
+
 	if (category == ISO7816_II_CATEGORY_TLV)   {
 		tag = sc_asn1_find_tag(ctx, buf, buflen, ISO7816_TAG_II_STATUS_SW, &taglen);
 		if (tag && taglen == 2)   {
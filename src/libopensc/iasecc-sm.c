@@ -95,14 +95,11 @@ iasecc_sm_transmit_apdus(struct sc_card *card, struct sc_remote_data *rdata,
 	LOG_FUNC_CALLED(ctx);
 	sc_log(ctx, "iasecc_sm_transmit_apdus() rdata-length %i", rdata->length);
 
-	while (rapdu)   {
-		sc_log(ctx, "iasecc_sm_transmit_apdus() rAPDU flags 0x%X", rapdu->apdu.flags);
-		rv = sc_transmit_apdu(card, &rapdu->apdu);
-		LOG_TEST_RET(ctx, rv, "iasecc_sm_transmit_apdus() failed to execute r-APDU");
-		rv = sc_check_sw(card, rapdu->apdu.sw1, rapdu->apdu.sw2);
-		if (rv < 0 && !(rapdu->flags & SC_REMOTE_APDU_FLAG_NOT_FATAL))
-			LOG_TEST_RET(ctx, rv, "iasecc_sm_transmit_apdus() fatal error %i");
+	rv = sc_transmit_apdus(card, rdata);
+	LOG_TEST_RET(ctx, rv, "iasecc_sm_transmit_apdus() failed to execute r-APDU");
 
+	while (rapdu)   {
+		rv = rapdu->status;
 		if (out && out_len && (rapdu->flags & SC_REMOTE_APDU_FLAG_RETURN_ANSWER))   {
 			int len = rapdu->apdu.resplen > (*out_len - offs) ? (*out_len - offs) : rapdu->apdu.resplen;
 
@@ -79,6 +79,7 @@ int _sc_parse_atr(struct sc_reader *reader);
 /* Add an ATR to the card driver's struct sc_atr_table */
 int _sc_add_atr(struct sc_context *ctx, struct sc_card_driver *driver, struct sc_atr_table *src);
 int _sc_free_atr(struct sc_context *ctx, struct sc_card_driver *driver);
+void _sc_free_atr_index(struct sc_context *ctx);
 
 /**
  * Convert an unsigned long into 4 bytes in big endian order
@@ -242,9 +243,46 @@ int sc_apdu_set_resp(sc_context_t *ctx, sc_apdu_t *apdu, const u8 *buf,
 void sc_apdu_log(sc_context_t *ctx, int level, const u8 *data, size_t len,
 	int is_outgoing);
 
+/**
+ * Forgets the file selected on the card and the security environment
+ * set in it
+ * @param  card  sc_card_t object
+ */
+void sc_invalidate_selection(struct sc_card *card);
+/**
+ * Remembers a successfully selected absolute path, so that selecting it
+ * again can be skipped while the card stays locked
+ * @param  card  sc_card_t object
+ * @param  path  the selected path
+ * @param  file  the FCI returned for it, or NULL
+ */
+void sc_remember_selection(struct sc_card *card, const struct sc_path *path,
+	const struct sc_file *file);
+
+/* Debug messages written by a background thread */
+int sc_log_queue_start(sc_context_t *ctx, size_t size, long flush_interval);
+void sc_log_queue_stop(sc_context_t *ctx);
+/** Writes out the queue and keeps the writer away from debug_file until released */
+void sc_log_queue_hold(sc_context_t *ctx);
+void sc_log_queue_release(sc_context_t *ctx);
+
+/* Binary APDU trace, see trace.h */
+int sc_trace_create(sc_context_t *ctx, size_t size, const char *file, int on_signal);
+void sc_trace_free(sc_context_t *ctx);
+/** Appends the file with the trace, the configured trace_file if @a file is NULL */
+int sc_trace_dump(sc_context_t *ctx, const char *file);
+void sc_trace_event(sc_context_t *ctx, sc_reader_t *reader, unsigned int event,
+	int result, unsigned long usec);
+void sc_trace_apdu(sc_context_t *ctx, sc_reader_t *reader, const sc_apdu_t *apdu,
+	int result, unsigned long usec);
+/** Monotonic clock in microseconds, for measuring durations */
+unsigned long sc_trace_clock(void);
+
 extern struct sc_reader_driver *sc_get_pcsc_driver(void);
 extern struct sc_reader_driver *sc_get_ctapi_driver(void);
 extern struct sc_reader_driver *sc_get_openct_driver(void);
+extern struct sc_reader_driver *sc_get_virtual_driver(void);
+extern struct sc_reader_driver *sc_get_replay_driver(void);
 extern struct sc_reader_driver *sc_get_cardmod_driver(void);
 
 #ifdef __cplusplus
@@ -478,6 +478,34 @@ iso7816_select_file(struct sc_card *card, const struct sc_path *in_path, struct
 	if (file_out != NULL) {
 		*file_out = NULL;
 	}
+	if (card->cache.selected_path.len && pathtype == SC_PATH_TYPE_PATH && !in_path->aid.len) {
+		const struct sc_path *cur = &card->cache.selected_path;
+		const struct sc_file *cur_file = card->cache.selected_file;
+
+		if (sc_compare_path(cur, in_path)) {
+			if (file_out == NULL) {
+				sc_log(ctx, "%s is already selected", sc_print_path(in_path));
+				card->apdu_stats->selects_skipped++;
+				LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+			}
+			if (cur_file != NULL) {
+				sc_log(ctx, "%s is already selected", sc_print_path(in_path));
+				sc_file_dup(file_out, cur_file);
+				if (*file_out == NULL)
+					LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+				(*file_out)->path = *in_path;
+				card->apdu_stats->selects_skipped++;
+				LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+			}
+		}
+		else if (cur_file != NULL && cur_file->type == SC_FILE_TYPE_DF
+				&& in_path->len == cur->len + 2 && sc_compare_path_prefix(cur, in_path)) {
+			/* a child of the current DF, select it by its file ID */
+			memcpy(path, in_path->value + cur->len, 2);
+			pathlen = 2;
+			pathtype = SC_PATH_TYPE_FILE_ID;
+		}
+	}
 	if (in_path->aid.len) {
 		if (!pathlen) {
 			memcpy(path, in_path->aid.value, in_path->aid.len);
@@ -562,7 +590,9 @@ iso7816_select_file(struct sc_card *card, const struct sc_path *in_path, struct
 				r = sc_check_sw(card, apdu.sw1, apdu.sw2);
 		}
 		if (apdu.sw1 == 0x61)
-			LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+			r = SC_SUCCESS;
+		if (r == SC_SUCCESS)
+			sc_remember_selection(card, in_path, NULL);
 		LOG_FUNC_RETURN(ctx, r);
 	}
 
@@ -578,6 +608,7 @@ iso7816_select_file(struct sc_card *card, const struct sc_path *in_path, struct
 				LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
 			file->path = *in_path;
 
+			sc_remember_selection(card, in_path, file);
 			*file_out = file;
 			LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 		}
@@ -598,6 +629,7 @@ iso7816_select_file(struct sc_card *card, const struct sc_path *in_path, struct
 		}
 		if ((size_t)apdu.resp[1] + 2 <= apdu.resplen)
 			card->ops->process_fci(card, file, apdu.resp+2, apdu.resp[1]);
+		sc_remember_selection(card, in_path, file);
 		*file_out = file;
 		break;
 	case 0x00: /* proprietary coding */
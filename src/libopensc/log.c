@@ -44,6 +44,219 @@
 
 #include "internal.h"
 
+#ifdef HAVE_PTHREAD
+/* Messages waiting for the writer thread */
+struct sc_log_queue {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t thread;
+	char *buf;
+	size_t size, start, len;
+	int writing;		/* the writer thread is outside the mutex */
+	int held;		/* debug_file is being replaced */
+	int stop;
+	long flush_interval;	/* ms, 0 flushes after every write */
+	unsigned long dropped, dropped_reported;
+};
+
+static void log_queue_deadline(struct timespec *ts, long ms)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	ts->tv_sec = tv.tv_sec + ms / 1000;
+	ts->tv_nsec = tv.tv_usec * 1000 + (ms % 1000) * 1000000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+static void *log_queue_writer(void *arg)
+{
+	sc_context_t *ctx = (sc_context_t *) arg;
+	struct sc_log_queue *q = ctx->log_queue;
+	struct timespec deadline;
+	int unflushed = 0;
+
+	pthread_mutex_lock(&q->mutex);
+	while (!q->stop || q->len > 0) {
+		FILE *outf = ctx->debug_file;
+		size_t len;
+		unsigned long dropped;
+
+		if (q->len == 0 || q->held) {
+			if (!unflushed || q->held) {
+				pthread_cond_wait(&q->cond, &q->mutex);
+				continue;
+			}
+			/* flush once no message arrived for flush_interval ms */
+			log_queue_deadline(&deadline, q->flush_interval);
+			if (pthread_cond_timedwait(&q->cond, &q->mutex, &deadline) == 0)
+				continue;
+			/* debug_file may have been replaced while waiting */
+			if (q->held)
+				continue;
+			if (ctx->debug_file != NULL)
+				fflush(ctx->debug_file);
+			unflushed = 0;
+			continue;
+		}
+
+		/* write the oldest contiguous piece without holding the mutex */
+		len = q->len;
+		if (len > q->size - q->start)
+			len = q->size - q->start;
+		dropped = q->dropped - q->dropped_reported;
+		q->dropped_reported = q->dropped;
+		q->writing = 1;
+		pthread_mutex_unlock(&q->mutex);
+
+		if (outf != NULL) {
+			if (dropped)
+				fprintf(outf, "[%lu debug messages dropped, debug_queue_size is too small]\n", dropped);
+			fwrite(q->buf + q->start, 1, len, outf);
+			if (q->flush_interval == 0)
+				fflush(outf);
+			else
+				unflushed = 1;
+		}
+
+		pthread_mutex_lock(&q->mutex);
+		q->start = (q->start + len) % q->size;
+		q->len -= len;
+		q->writing = 0;
+		pthread_cond_broadcast(&q->cond);
+	}
+	if (ctx->debug_file != NULL)
+		fflush(ctx->debug_file);
+	pthread_mutex_unlock(&q->mutex);
+	return NULL;
+}
+
+/* Copies a message into the queue, or counts it as dropped */
+static void log_queue_put(struct sc_log_queue *q, const char *msg, size_t len)
+{
+	size_t end, first;
+
+	pthread_mutex_lock(&q->mutex);
+	if (q->len + len > q->size) {
+		q->dropped++;
+	} else {
+		end = (q->start + q->len) % q->size;
+		first = len < q->size - end ? len : q->size - end;
+		memcpy(q->buf + end, msg, first);
+		memcpy(q->buf, msg + first, len - first);
+		q->len += len;
+		if (q->len == len)
+			pthread_cond_broadcast(&q->cond);
+	}
+	pthread_mutex_unlock(&q->mutex);
+}
+
+int sc_log_queue_start(sc_context_t *ctx, size_t size, long flush_interval)
+{
+	struct sc_log_queue *q;
+
+	if (ctx->log_queue != NULL || size == 0)
+		return SC_SUCCESS;
+	q = calloc(1, sizeof(*q));
+	if (q == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	q->buf = malloc(size);
+	if (q->buf == NULL) {
+		free(q);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	q->size = size;
+	q->flush_interval = flush_interval > 0 ? flush_interval : 0;
+	if (pthread_mutex_init(&q->mutex, NULL) != 0)
+		goto err;
+	if (pthread_cond_init(&q->cond, NULL) != 0) {
+		pthread_mutex_destroy(&q->mutex);
+		goto err;
+	}
+	ctx->log_queue = q;
+	if (pthread_create(&q->thread, NULL, log_queue_writer, ctx) != 0) {
+		ctx->log_queue = NULL;
+		pthread_cond_destroy(&q->cond);
+		pthread_mutex_destroy(&q->mutex);
+		goto err;
+	}
+	return SC_SUCCESS;
+err:
+	free(q->buf);
+	free(q);
+	return SC_ERROR_INTERNAL;
+}
+
+void sc_log_queue_hold(sc_context_t *ctx)
+{
+	struct sc_log_queue *q = ctx->log_queue;
+
+	if (q == NULL)
+		return;
+	pthread_mutex_lock(&q->mutex);
+	while (q->len > 0 || q->writing)
+		pthread_cond_wait(&q->cond, &q->mutex);
+	if (ctx->debug_file != NULL)
+		fflush(ctx->debug_file);
+	q->held = 1;
+	pthread_mutex_unlock(&q->mutex);
+}
+
+void sc_log_queue_release(sc_context_t *ctx)
+{
+	struct sc_log_queue *q = ctx->log_queue;
+
+	if (q == NULL)
+		return;
+	pthread_mutex_lock(&q->mutex);
+	q->held = 0;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->mutex);
+}
+
+void sc_log_queue_stop(sc_context_t *ctx)
+{
+	struct sc_log_queue *q = ctx->log_queue;
+
+	if (q == NULL)
+		return;
+	pthread_mutex_lock(&q->mutex);
+	q->stop = 1;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->mutex);
+	pthread_join(q->thread, NULL);
+	ctx->log_queue = NULL;
+
+	if (q->dropped > q->dropped_reported && ctx->debug_file != NULL)
+		fprintf(ctx->debug_file, "[%lu debug messages dropped, debug_queue_size is too small]\n",
+				q->dropped - q->dropped_reported);
+	pthread_cond_destroy(&q->cond);
+	pthread_mutex_destroy(&q->mutex);
+	free(q->buf);
+	free(q);
+}
+#else
+int sc_log_queue_start(sc_context_t *ctx, size_t size, long flush_interval)
+{
+	return size ? SC_ERROR_NOT_SUPPORTED : SC_SUCCESS;
+}
+
+void sc_log_queue_hold(sc_context_t *ctx)
+{
+}
+
+void sc_log_queue_release(sc_context_t *ctx)
+{
+}
+
+void sc_log_queue_stop(sc_context_t *ctx)
+{
+}
+#endif
+
 static void sc_do_log_va(sc_context_t *ctx, int level, const char *file, int line, const char *func, const char *format, va_list args);
 
 void sc_do_log(sc_context_t *ctx, int level, const char *file, int line, const char *func, const char *format, ...)
@@ -112,6 +325,20 @@ static void sc_do_log_va(sc_context_t *ctx, int level, const char *file, int lin
 	if (r < 0)
 		return;
 
+#ifdef HAVE_PTHREAD
+	if (ctx->log_queue != NULL) {
+		n = strlen(buf);
+		if (n == 0 || buf[n-1] != '\n') {
+			if (n == sizeof(buf) - 1)
+				n--;
+			buf[n++] = '\n';
+			buf[n] = '\0';
+		}
+		log_queue_put(ctx->log_queue, buf, n);
+		return;
+	}
+#endif
+
 #ifdef _WIN32
 	if (ctx->debug_filename)   {
 		r = sc_ctx_log_to_file(ctx, ctx->debug_filename);
@@ -44,9 +44,19 @@ enum {
 #define __FUNCTION__ NULL
 #endif
 
+/* Whether a message of this level is logged; the macros below check it
+ * before evaluating their arguments */
+#define SC_LOG_ENABLED(ctx, level) ((ctx) != NULL && (ctx)->debug >= (level))
+
 #if defined(__GNUC__)
-#define sc_debug(ctx, level, format, args...)	sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, format , ## args)
-#define sc_log(ctx, format, args...)   sc_do_log(ctx, SC_LOG_DEBUG_NORMAL, __FILE__, __LINE__, __FUNCTION__, format , ## args)
+#define sc_debug(ctx, level, format, args...) do { \
+	if (SC_LOG_ENABLED(ctx, level)) \
+		sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, format , ## args); \
+} while (0)
+#define sc_log(ctx, format, args...) do { \
+	if (SC_LOG_ENABLED(ctx, SC_LOG_DEBUG_NORMAL)) \
+		sc_do_log(ctx, SC_LOG_DEBUG_NORMAL, __FILE__, __LINE__, __FUNCTION__, format , ## args); \
+} while (0)
 #else
 #define sc_debug _sc_debug
 #define sc_log _sc_log
@@ -61,29 +71,47 @@ void _sc_log(struct sc_context *ctx, const char *format, ...);
 void sc_hex_dump(struct sc_context *ctx, int level, const u8 * buf, size_t len, char *out, size_t outlen);
 char * sc_dump_hex(const u8 * in, size_t count);
 char * sc_dump_oid(const struct sc_object_id *oid);
+
+/* "called" and "returning with" messages; configure --disable-function-trace
+ * defines DISABLE_FUNCTION_TRACE to compile them out */
+#ifdef DISABLE_FUNCTION_TRACE
 #define SC_FUNC_CALLED(ctx, level) do { \
-	 sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, "called\n"); \
+	(void) (ctx); \
 } while (0)
-#define LOG_FUNC_CALLED(ctx) SC_FUNC_CALLED((ctx), SC_LOG_DEBUG_NORMAL)
 
 #define SC_FUNC_RETURN(ctx, level, r) do { \
 	int _ret = r; \
-	if (_ret <= 0) { \
-		sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, \
-			"returning with: %d (%s)\n", _ret, sc_strerror(_ret)); \
-	} else { \
-		sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, \
-			"returning with: %d\n", _ret); \
+	(void) (ctx); \
+	return _ret; \
+} while(0)
+#else
+#define SC_FUNC_CALLED(ctx, level) do { \
+	if (SC_LOG_ENABLED(ctx, level)) \
+		sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, "called\n"); \
+} while (0)
+
+#define SC_FUNC_RETURN(ctx, level, r) do { \
+	int _ret = r; \
+	if (SC_LOG_ENABLED(ctx, level)) { \
+		if (_ret <= 0) \
+			sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, \
+				"returning with: %d (%s)\n", _ret, sc_strerror(_ret)); \
+		else \
+			sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, \
+				"returning with: %d\n", _ret); \
 	} \
 	return _ret; \
 } while(0)
+#endif
+#define LOG_FUNC_CALLED(ctx) SC_FUNC_CALLED((ctx), SC_LOG_DEBUG_NORMAL)
 #define LOG_FUNC_RETURN(ctx, r) SC_FUNC_RETURN((ctx), SC_LOG_DEBUG_NORMAL, (r))
 
 #define SC_TEST_RET(ctx, level, r, text) do { \
 	int _ret = (r); \
 	if (_ret < 0) { \
-		sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, \
-			"%s: %d (%s)\n", (text), _ret, sc_strerror(_ret)); \
+		if (SC_LOG_ENABLED(ctx, level)) \
+			sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, \
+				"%s: %d (%s)\n", (text), _ret, sc_strerror(_ret)); \
 		return _ret; \
 	} \
 } while(0)
@@ -92,8 +120,9 @@ char * sc_dump_oid(const struct sc_object_id *oid);
 #define SC_TEST_GOTO_ERR(ctx, level, r, text) do { \
 	int _ret = (r); \
 	if (_ret < 0) { \
-		sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, \
-			"%s: %d (%s)\n", (text), _ret, sc_strerror(_ret)); \
+		if (SC_LOG_ENABLED(ctx, level)) \
+			sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, \
+				"%s: %d (%s)\n", (text), _ret, sc_strerror(_ret)); \
 		goto err; \
 	} \
 } while(0)
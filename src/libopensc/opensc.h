@@ -254,6 +254,10 @@ struct sc_ef_atr {
 	struct sc_object_id allocation_oid;
 
 	unsigned status;
+
+	/* Extended length information, zero if absent */
+	size_t max_command_apdu;
+	size_t max_response_apdu;
 };
 
 struct sc_card_cache {
@@ -263,6 +267,39 @@ struct sc_card_cache {
         struct sc_file *current_df;
 
 	int valid;
+
+	/* Last path selected with iso7816_select_file() while the card is
+	 * locked, and its FCI if it was asked for */
+	struct sc_path selected_path;
+	struct sc_file *selected_file;
+
+	/* Security environment last set with sc_set_security_env() while the
+	 * card is locked, forgotten with the selection and after any MSE */
+	struct sc_security_env sec_env;
+	int sec_env_num;
+	int sec_env_valid;
+	int sec_env_skipped;	/* the last sc_set_security_env() was skipped */
+	int sec_env_not_kept;	/* the card loses it after an operation */
+};
+
+/* Round trips below 1, 2, 4, ... 1024 ms, and longer */
+#define SC_APDU_STATS_BUCKETS	12
+
+struct sc_apdu_counter {
+	unsigned long count;
+	unsigned long bytes_sent, bytes_received;
+	unsigned long usec;		/* time spent in the reader driver */
+	unsigned long histogram[SC_APDU_STATS_BUCKETS];
+};
+
+/* APDUs sent to a card, read with SC_CARDCTL_GET_APDU_STATS */
+struct sc_apdu_stats {
+	struct sc_apdu_counter total;
+	struct sc_apdu_counter ins[256];
+	unsigned long get_responses;	/* GET RESPONSE after 61xx */
+	unsigned long retransmits;	/* APDUs resent with the Le from 6Cxx */
+	unsigned long selects_skipped;	/* SELECT FILE saved by the selection cache */
+	unsigned long sec_envs_skipped;	/* MSE saved by the security environment cache */
 };
 
 #define SC_PROTO_T0		0x00000001
@@ -477,6 +514,7 @@ typedef struct sc_card {
 	int max_pin_len;
 
 	struct sc_card_cache cache;
+	struct sc_apdu_stats *apdu_stats;
 
 	struct sc_serial_number serialnr;
 	struct sc_version version;
@@ -646,9 +684,15 @@ typedef struct sc_context {
 	int debug;
 	int paranoid_memory;
 	int enable_default_driver;
+	int enable_select_cache;
+	int enable_sec_env_cache;
+	int enable_extended_apdu;
+	int enable_driver_cache;
 
 	FILE *debug_file;
 	char *debug_filename;
+	struct sc_log_queue *log_queue;	/* asynchronous debug_file writer */
+	FILE *apdu_record;
 	char *preferred_language;
 
 	list_t readers;
@@ -662,6 +706,9 @@ typedef struct sc_context {
 	sc_thread_context_t	*thread_ctx;
 	void *mutex;
 
+	struct sc_atr_index *atr_index;	/* compiled ATR tables */
+	struct sc_trace *trace;		/* binary APDU trace */
+
 	unsigned int magic;
 } sc_context_t;
 
@@ -674,6 +721,19 @@ typedef struct sc_context {
  */
 int sc_transmit_apdu(struct sc_card *, struct sc_apdu *);
 
+/** Sends a list of APDUs to the card while holding the card lock once.
+ *  All APDUs are checked before the first one is sent; a short APDU with
+ *  more data than the card accepts is sent with command chaining.  Each
+ *  APDU's status is set to the transmit or status word result, the
+ *  transmission stops at the first error unless the APDU has the
+ *  SC_REMOTE_APDU_FLAG_NOT_FATAL flag.  The APDUs that were not sent have
+ *  the status SC_REMOTE_APDU_NOT_SENT.
+ *  @param  card   struct sc_card object to which the APDUs should be send
+ *  @param  rdata  list of APDUs, see sc_remote_data_init()
+ *  @return SC_SUCCESS on success and the first fatal error otherwise
+ */
+int sc_transmit_apdus(struct sc_card *, struct sc_remote_data *);
+
 void sc_format_apdu(struct sc_card *, struct sc_apdu *, int, int, int, int);
 
 int sc_check_apdu(struct sc_card *, const struct sc_apdu *);
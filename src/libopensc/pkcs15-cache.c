@@ -29,6 +29,12 @@
 #include <unistd.h>
 #endif
 #include <sys/stat.h>
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 #include <limits.h>
 #include <errno.h>
 #include <assert.h>
@@ -36,43 +42,594 @@
 #include "internal.h"
 #include "pkcs15.h"
 
-static int generate_cache_filename(struct sc_pkcs15_card *p15card,
-				   const sc_path_t *path,
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+/* Single file cache store: a header, an index of fixed size entries and
+ * the cached files. Numbers are big endian, offsets are from the start.
+ *   header:  magic[8] | number of entries[4]
+ *   entry:   path length[1] | path[16] | zero[3] | offset[4] | length[4] | hash[4]
+ */
+#define CACHE_STORE_MAGIC	"OSCP15C1"
+#define CACHE_STORE_HEADER_SIZE	12
+#define CACHE_STORE_ENTRY_SIZE	32
+/* Every write rewrites the whole store, so files cached while binding are
+ * kept in memory and written together, at the latest with this much data */
+#define CACHE_STORE_MAX_PENDING	(64 * 1024)
+
+/* A file not yet written to the store */
+struct cache_store_pending {
+	u8 key[SC_MAX_PATH_SIZE];
+	size_t keylen;
+	u8 *data;		/* NULL if the entry is to be removed */
+	size_t len;
+	struct cache_store_pending *next;
+};
+
+struct sc_pkcs15_cache_store {
+	char fname[PATH_MAX];
+	u8 *data;
+	size_t size;
+	int mapped;
+	struct cache_store_pending *pending;
+	size_t pending_size;
+};
+
+static int cache_store_flush(struct sc_context *ctx,
+			     struct sc_pkcs15_cache_store *store);
+
+/* <cache dir>/<serial>_<last update>, shared by both cache backends.
+ * When the cache is validated, the digest of the card content taken at bind
+ * time replaces the last update time, so that any change of the card
+ * switches to fresh entries.  Emulated cards have no such digest and keep
+ * the last update name. */
+static int generate_cache_basename(struct sc_pkcs15_card *p15card,
 				   char *buf, size_t bufsize)
 {
 	char dir[PATH_MAX];
-        char pathname[SC_MAX_PATH_SIZE*2+1];
-	int  r;
-        const u8 *pathptr;
-        size_t i, pathlen;
+	char digest[sizeof(p15card->cache_digest) * 2 + 2];
+	char *last_update;
+	int r;
 
-	if (path->type != SC_PATH_TYPE_PATH)
-                return SC_ERROR_INVALID_ARGUMENTS;
-	assert(path->len <= SC_MAX_PATH_SIZE);
+	if (p15card->tokeninfo->serial_number == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
 	r = sc_get_cache_dir(p15card->card->ctx, dir, sizeof(dir));
 	if (r)
 		return r;
-	pathptr = path->value;
-	pathlen = path->len;
-	if (pathlen > 2 && memcmp(pathptr, "\x3F\x00", 2) == 0) {
-                pathptr += 2;
-		pathlen -= 2;
+	if (p15card->opts.validate_file_cache && p15card->cache_digest_set) {
+		r = sc_bin_to_hex(p15card->cache_digest, sizeof(p15card->cache_digest),
+				digest, sizeof(digest), 0);
+		if (r)
+			return r;
+		r = snprintf(buf, bufsize, "%s/%s_V%s", dir, p15card->tokeninfo->serial_number, digest);
+		if (r < 0 || (size_t)r >= bufsize)
+			return SC_ERROR_BUFFER_TOO_SMALL;
+		return SC_SUCCESS;
+	}
+	last_update = sc_pkcs15_get_lastupdate(p15card);
+	r = snprintf(buf, bufsize, "%s/%s_%s", dir, p15card->tokeninfo->serial_number,
+			last_update != NULL ? last_update : "DATE");
+	if (r < 0 || (size_t)r >= bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
+/* Cached files are keyed by their path, without the leading MF */
+static int cache_path_key(const sc_path_t *path, const u8 **key, size_t *keylen)
+{
+	if (path->type != SC_PATH_TYPE_PATH)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	assert(path->len <= SC_MAX_PATH_SIZE);
+	*key = path->value;
+	*keylen = path->len;
+	if (*keylen > 2 && memcmp(*key, "\x3F\x00", 2) == 0) {
+		*key += 2;
+		*keylen -= 2;
 	}
+	return SC_SUCCESS;
+}
+
+static int generate_cache_filename(struct sc_pkcs15_card *p15card,
+				   const sc_path_t *path,
+				   char *buf, size_t bufsize)
+{
+	char basename[PATH_MAX];
+	char pathname[SC_MAX_PATH_SIZE*2+1];
+	const u8 *pathptr;
+	size_t i, pathlen;
+	int r;
+
+	r = cache_path_key(path, &pathptr, &pathlen);
+	if (r)
+		return r;
 	for (i = 0; i < pathlen; i++)
 		sprintf(pathname + 2*i, "%02X", pathptr[i]);
-	if (p15card->tokeninfo->serial_number != NULL) {
-		char *last_update = sc_pkcs15_get_lastupdate(p15card);
-		if (last_update != NULL)
-			r = snprintf(buf, bufsize, "%s/%s_%s_%s", dir, p15card->tokeninfo->serial_number,
-					last_update, pathname);
+	pathname[2*pathlen] = '\0';
+	r = generate_cache_basename(p15card, basename, sizeof(basename));
+	if (r)
+		return r;
+	r = snprintf(buf, bufsize, "%s_%s", basename, pathname);
+	if (r < 0 || (size_t)r >= bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
+/* FNV-1a, to detect damaged entries */
+static unsigned long cache_store_hash(const u8 *buf, size_t len)
+{
+	unsigned long h = 2166136261UL;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= buf[i];
+		h = (h * 16777619UL) & 0xFFFFFFFFUL;
+	}
+	return h;
+}
+
+static void cache_store_unmap(struct sc_pkcs15_cache_store *store)
+{
+	if (store->data != NULL) {
+#ifdef HAVE_SYS_MMAN_H
+		if (store->mapped)
+			munmap(store->data, store->size);
 		else
-			r = snprintf(buf, bufsize, "%s/%s_DATE_%s", dir,
-					p15card->tokeninfo->serial_number, pathname);
-		if (r < 0)
-			return SC_ERROR_BUFFER_TOO_SMALL;
-	} else
+#endif
+			free(store->data);
+	}
+	store->data = NULL;
+	store->size = 0;
+	store->mapped = 0;
+}
+
+static int cache_store_map(struct sc_pkcs15_cache_store *store)
+{
+	struct stat stbuf;
+	unsigned long count;
+	int fd, r = SC_SUCCESS;
+
+	cache_store_unmap(store);
+
+	fd = open(store->fname, O_RDONLY | O_BINARY);
+	if (fd < 0)
+		return SC_ERROR_FILE_NOT_FOUND;
+	if (fstat(fd, &stbuf) != 0 || stbuf.st_size < CACHE_STORE_HEADER_SIZE) {
+		r = SC_ERROR_FILE_NOT_FOUND;
+		goto out;
+	}
+	store->size = (size_t)stbuf.st_size;
+
+#ifdef HAVE_SYS_MMAN_H
+	store->data = mmap(NULL, store->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (store->data == MAP_FAILED) {
+		store->data = NULL;
+		r = SC_ERROR_FILE_NOT_FOUND;
+		goto out;
+	}
+	store->mapped = 1;
+#else
+	store->data = malloc(store->size);
+	if (store->data == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto out;
+	}
+	if (read(fd, store->data, store->size) != (int)store->size) {
+		r = SC_ERROR_FILE_NOT_FOUND;
+		goto out;
+	}
+#endif
+
+	count = bebytes2ulong(store->data + 8);
+	if (memcmp(store->data, CACHE_STORE_MAGIC, 8) != 0
+			|| count > (store->size - CACHE_STORE_HEADER_SIZE) / CACHE_STORE_ENTRY_SIZE)
+		r = SC_ERROR_CORRUPTED_DATA;
+out:
+	close(fd);
+	if (r != SC_SUCCESS)
+		cache_store_unmap(store);
+	return r;
+}
+
+/* Map the store of the card, unless it is already mapped */
+static int cache_store_open(struct sc_pkcs15_card *p15card, int reload,
+			    struct sc_pkcs15_cache_store **out)
+{
+	struct sc_pkcs15_cache_store *store = p15card->cache_store;
+	char fname[PATH_MAX];
+	int r;
+
+	r = generate_cache_basename(p15card, fname, sizeof(fname));
+	if (r)
+		return r;
+	if (strlen(fname) + sizeof(".p15") > sizeof(fname))
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	strcat(fname, ".p15");
+
+	if (store == NULL) {
+		store = calloc(1, sizeof(struct sc_pkcs15_cache_store));
+		if (store == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		p15card->cache_store = store;
+	}
+	if (strcmp(store->fname, fname) != 0) {
+		/* the pending files belong to the previous name */
+		cache_store_flush(p15card->card->ctx, store);
+		cache_store_unmap(store);
+		strcpy(store->fname, fname);
+		reload = 1;
+	}
+	if (reload || store->data == NULL) {
+		r = cache_store_map(store);
+		if (r != SC_SUCCESS && r != SC_ERROR_FILE_NOT_FOUND)
+			sc_debug(p15card->card->ctx, SC_LOG_DEBUG_NORMAL, "Ignoring cache store '%s': %s",
+					fname, sc_strerror(r));
+	}
+	*out = store;
+	return SC_SUCCESS;
+}
+
+/* Returns the index entry of a path, or NULL */
+static const u8 *cache_store_find(struct sc_pkcs15_cache_store *store,
+				  const u8 *key, size_t keylen)
+{
+	unsigned long i, count;
+	const u8 *entry;
+
+	if (store->data == NULL)
+		return NULL;
+	count = bebytes2ulong(store->data + 8);
+	entry = store->data + CACHE_STORE_HEADER_SIZE;
+	for (i = 0; i < count; i++, entry += CACHE_STORE_ENTRY_SIZE) {
+		if (entry[0] == keylen && memcmp(entry + 1, key, keylen) == 0)
+			return entry;
+	}
+	return NULL;
+}
+
+static struct cache_store_pending *cache_store_find_pending(struct sc_pkcs15_cache_store *store,
+							   const u8 *key, size_t keylen)
+{
+	struct cache_store_pending *pending;
+
+	for (pending = store->pending; pending != NULL; pending = pending->next)
+		if (pending->keylen == keylen && memcmp(pending->key, key, keylen) == 0)
+			return pending;
+	return NULL;
+}
+
+static int cache_store_read(struct sc_pkcs15_card *p15card,
+			    const sc_path_t *path,
+			    u8 **buf, size_t *bufsize)
+{
+	struct sc_pkcs15_cache_store *store;
+	struct cache_store_pending *pending;
+	const u8 *key, *entry, *blob;
+	size_t keylen, offset, len, count, start;
+	int r;
+
+	r = cache_path_key(path, &key, &keylen);
+	if (r)
+		return r;
+	r = cache_store_open(p15card, 0, &store);
+	if (r)
+		return r;
+	pending = cache_store_find_pending(store, key, keylen);
+	if (pending != NULL) {
+		if (pending->data == NULL)
+			return SC_ERROR_FILE_NOT_FOUND;
+		blob = pending->data;
+		len = pending->len;
+	} else {
+		entry = cache_store_find(store, key, keylen);
+		if (entry == NULL)
+			return SC_ERROR_FILE_NOT_FOUND;
+
+		offset = bebytes2ulong(entry + 20);
+		len = bebytes2ulong(entry + 24);
+		if (offset > store->size || len > store->size - offset)
+			return SC_ERROR_FILE_NOT_FOUND;
+		blob = store->data + offset;
+		if (cache_store_hash(blob, len) != bebytes2ulong(entry + 28))
+			return SC_ERROR_FILE_NOT_FOUND;
+	}
+
+	if (path->count < 0) {
+		count = len;
+		start = 0;
+	} else {
+		count = path->count;
+		start = path->index;
+		if (start + count > len)
+			return SC_ERROR_FILE_NOT_FOUND; /* cache file bad? */
+	}
+	if (*buf == NULL) {
+		*buf = malloc(count ? count : 1);
+		if (*buf == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+	} else if (count > *bufsize) {
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	}
+	memcpy(*buf, blob + start, count);
+	*bufsize = count;
+	return SC_SUCCESS;
+}
+
+static void cache_store_free_pending(struct sc_pkcs15_cache_store *store)
+{
+	struct cache_store_pending *pending;
+
+	while ((pending = store->pending) != NULL) {
+		store->pending = pending->next;
+		free(pending->data);
+		free(pending);
+	}
+	store->pending_size = 0;
+}
+
+/* Write a new store with the pending files merged in, and atomically move
+ * it over the old one, so readers always see a complete store */
+static int cache_store_flush(struct sc_context *ctx,
+			     struct sc_pkcs15_cache_store *store)
+{
+	struct cache_store_pending *pending;
+	char tmpname[PATH_MAX];
+	const u8 *entry, **src = NULL;
+	u8 header[CACHE_STORE_HEADER_SIZE], *index = NULL, *p;
+	unsigned long i, count = 0, kept = 0, added = 0;
+	size_t offset, len;
+	FILE *f = NULL;
+	int r;
+
+	if (store->pending == NULL)
+		return SC_SUCCESS;
+
+	/* Merge with what other processes may have stored meanwhile */
+	r = cache_store_map(store);
+	if (r != SC_SUCCESS && r != SC_ERROR_FILE_NOT_FOUND)
+		sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "Ignoring cache store '%s': %s",
+				store->fname, sc_strerror(r));
+	r = SC_SUCCESS;
+	if (store->data != NULL)
+		count = bebytes2ulong(store->data + 8);
+	for (pending = store->pending; pending != NULL; pending = pending->next)
+		added++;
+
+	index = calloc(count + added, CACHE_STORE_ENTRY_SIZE);
+	src = calloc(count + added, sizeof(*src));
+	if (index == NULL || src == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto out;
+	}
+
+	/* Keep the sound entries of other paths */
+	entry = store->data + CACHE_STORE_HEADER_SIZE;
+	for (i = 0; i < count; i++, entry += CACHE_STORE_ENTRY_SIZE) {
+		offset = bebytes2ulong(entry + 20);
+		len = bebytes2ulong(entry + 24);
+		if (entry[0] > SC_MAX_PATH_SIZE || offset > store->size || len > store->size - offset)
+			continue;
+		if (cache_store_find_pending(store, entry + 1, entry[0]) != NULL)
+			continue;
+		memcpy(index + kept * CACHE_STORE_ENTRY_SIZE, entry, CACHE_STORE_ENTRY_SIZE);
+		src[kept++] = store->data + offset;
+	}
+	for (pending = store->pending; pending != NULL; pending = pending->next) {
+		if (pending->data == NULL)
+			continue;
+		p = index + kept * CACHE_STORE_ENTRY_SIZE;
+		p[0] = (u8)pending->keylen;
+		memcpy(p + 1, pending->key, pending->keylen);
+		ulong2bebytes(p + 24, pending->len);
+		ulong2bebytes(p + 28, cache_store_hash(pending->data, pending->len));
+		src[kept++] = pending->data;
+	}
+
+	/* The data follows the index */
+	offset = CACHE_STORE_HEADER_SIZE + kept * CACHE_STORE_ENTRY_SIZE;
+	for (i = 0; i < kept; i++) {
+		p = index + i * CACHE_STORE_ENTRY_SIZE;
+		ulong2bebytes(p + 20, offset);
+		offset += bebytes2ulong(p + 24);
+	}
+	memcpy(header, CACHE_STORE_MAGIC, 8);
+	ulong2bebytes(header + 8, kept);
+
+#ifndef _WIN32
+	{
+		int fd;
+
+		if (strlen(store->fname) + sizeof(".XXXXXX") > sizeof(tmpname)) {
+			r = SC_ERROR_BUFFER_TOO_SMALL;
+			goto out;
+		}
+		strcpy(tmpname, store->fname);
+		strcat(tmpname, ".XXXXXX");
+		fd = mkstemp(tmpname);
+		if (fd < 0 && errno == ENOENT) {
+			if ((r = sc_make_cache_dir(ctx)) < 0)
+				goto out;
+			strcpy(tmpname + strlen(store->fname), ".XXXXXX");
+			fd = mkstemp(tmpname);
+		}
+		if (fd < 0) {
+			sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "Cannot create '%s': %s", tmpname, strerror(errno));
+			r = SC_ERROR_INTERNAL;
+			goto out;
+		}
+		f = fdopen(fd, "wb");
+		if (f == NULL) {
+			close(fd);
+			unlink(tmpname);
+			r = SC_ERROR_INTERNAL;
+			goto out;
+		}
+	}
+#else
+	if (strlen(store->fname) + sizeof(".tmp") > sizeof(tmpname)) {
+		r = SC_ERROR_BUFFER_TOO_SMALL;
+		goto out;
+	}
+	strcpy(tmpname, store->fname);
+	strcat(tmpname, ".tmp");
+	f = fopen(tmpname, "wb");
+	if (f == NULL && errno == ENOENT) {
+		if ((r = sc_make_cache_dir(ctx)) < 0)
+			goto out;
+		f = fopen(tmpname, "wb");
+	}
+	if (f == NULL) {
+		sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "Cannot create '%s': %s", tmpname, strerror(errno));
+		r = SC_ERROR_INTERNAL;
+		goto out;
+	}
+#endif
+
+	if (fwrite(header, 1, sizeof(header), f) != sizeof(header)
+			|| fwrite(index, CACHE_STORE_ENTRY_SIZE, kept, f) != kept)
+		r = SC_ERROR_INTERNAL;
+	for (i = 0; r == SC_SUCCESS && i < kept; i++) {
+		len = bebytes2ulong(index + i * CACHE_STORE_ENTRY_SIZE + 24);
+		if (fwrite(src[i], 1, len, f) != len)
+			r = SC_ERROR_INTERNAL;
+	}
+	if (fclose(f) != 0 && r == SC_SUCCESS)
+		r = SC_ERROR_INTERNAL;
+	if (r != SC_SUCCESS) {
+		sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "Cannot write cache store '%s'", tmpname);
+		unlink(tmpname);
+		goto out;
+	}
+
+#ifdef _WIN32
+	remove(store->fname);
+#endif
+	if (rename(tmpname, store->fname) != 0) {
+		unlink(tmpname);
+		r = SC_ERROR_INTERNAL;
+		goto out;
+	}
+	cache_store_map(store);
+out:
+	/* a file that could not be written is simply read from the card again */
+	cache_store_free_pending(store);
+	free(src);
+	free(index);
+	return r;
+}
+
+/* Queue the file at path, or its removal if buf is NULL. A removal is
+ * written at once, as the cached copy is stale. */
+static int cache_store_add(struct sc_pkcs15_card *p15card,
+			   const sc_path_t *path,
+			   const u8 *buf, size_t bufsize)
+{
+	struct sc_pkcs15_cache_store *store;
+	struct cache_store_pending *pending;
+	const u8 *key;
+	u8 *data = NULL;
+	size_t keylen;
+	int r;
+
+	r = cache_path_key(path, &key, &keylen);
+	if (r)
+		return r;
+	r = cache_store_open(p15card, buf == NULL, &store);
+	if (r)
+		return r;
+	pending = cache_store_find_pending(store, key, keylen);
+	if (buf == NULL && pending == NULL && cache_store_find(store, key, keylen) == NULL)
+		return SC_SUCCESS;
+
+	if (buf != NULL) {
+		data = malloc(bufsize ? bufsize : 1);
+		if (data == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		memcpy(data, buf, bufsize);
+	}
+	if (pending == NULL) {
+		pending = calloc(1, sizeof(*pending));
+		if (pending == NULL) {
+			free(data);
+			return SC_ERROR_OUT_OF_MEMORY;
+		}
+		memcpy(pending->key, key, keylen);
+		pending->keylen = keylen;
+		pending->next = store->pending;
+		store->pending = pending;
+	} else {
+		store->pending_size -= pending->len;
+		free(pending->data);
+	}
+	pending->data = data;
+	pending->len = data != NULL ? bufsize : 0;
+	store->pending_size += pending->len;
+
+	if (buf == NULL || store->pending_size > CACHE_STORE_MAX_PENDING)
+		return cache_store_flush(p15card->card->ctx, store);
+	return SC_SUCCESS;
+}
+
+int sc_pkcs15_flush_cache(struct sc_pkcs15_card *p15card)
+{
+	if (p15card->cache_store == NULL)
+		return SC_SUCCESS;
+	return cache_store_flush(p15card->card->ctx, p15card->cache_store);
+}
+
+/* The snapshot of the object directories is cached under the file ID
+ * FFFF of the application, which ISO 7816-4 reserves */
+int sc_pkcs15_get_snapshot_path(struct sc_pkcs15_card *p15card,
+				sc_path_t *path)
+{
+	if (p15card->file_app == NULL)
 		return SC_ERROR_INVALID_ARGUMENTS;
-        return SC_SUCCESS;
+	sc_format_path("FFFF", path);
+	return sc_pkcs15_make_absolute_path(&p15card->file_app->path, path);
+}
+
+static int cache_remove(struct sc_pkcs15_card *p15card,
+			const sc_path_t *path)
+{
+	char fname[PATH_MAX];
+	int r;
+
+	if (p15card->opts.file_cache_backend == SC_PKCS15_FILE_CACHE_MMAP)
+		return cache_store_add(p15card, path, NULL, 0);
+
+	r = generate_cache_filename(p15card, path, fname, sizeof(fname));
+	if (r != 0)
+		return r;
+	if (unlink(fname) != 0 && errno != ENOENT)
+		return SC_ERROR_INTERNAL;
+	return SC_SUCCESS;
+}
+
+/* Drop the cached copy of a file, after it was changed on the card.
+ * The objects may have changed with it, so the snapshot goes too. */
+int sc_pkcs15_uncache_file(struct sc_pkcs15_card *p15card,
+			   const sc_path_t *path)
+{
+	sc_path_t snapshot;
+	int r;
+
+	r = cache_remove(p15card, path);
+	if (r != SC_SUCCESS)
+		return r;
+	if (sc_pkcs15_get_snapshot_path(p15card, &snapshot) == SC_SUCCESS
+			&& !sc_compare_path(path, &snapshot))
+		r = cache_remove(p15card, &snapshot);
+	return r;
+}
+
+void sc_pkcs15_free_cache_store(struct sc_pkcs15_card *p15card)
+{
+	if (p15card->cache_store != NULL) {
+		sc_pkcs15_flush_cache(p15card);
+		cache_store_unmap(p15card->cache_store);
+		free(p15card->cache_store);
+		p15card->cache_store = NULL;
+	}
 }
 
 int sc_pkcs15_read_cached_file(struct sc_pkcs15_card *p15card,
@@ -86,6 +643,9 @@ int sc_pkcs15_read_cached_file(struct sc_pkcs15_card *p15card,
 	struct stat stbuf;
 	u8 *data = NULL;
 
+	if (p15card->opts.file_cache_backend == SC_PKCS15_FILE_CACHE_MMAP)
+		return cache_store_read(p15card, path, buf, bufsize);
+
 	r = generate_cache_filename(p15card, path, fname, sizeof(fname));
 	if (r != 0)
 		return r;
@@ -145,6 +705,9 @@ int sc_pkcs15_cache_file(struct sc_pkcs15_card *p15card,
         FILE *f;
         size_t c;
 
+	if (p15card->opts.file_cache_backend == SC_PKCS15_FILE_CACHE_MMAP)
+		return cache_store_add(p15card, path, buf, bufsize);
+
 	r = generate_cache_filename(p15card, path, fname, sizeof(fname));
 	if (r != 0)
 		return r;
@@ -36,105 +36,110 @@
 #include "pkcs15.h"
 
 static int
-parse_x509_cert(sc_context_t *ctx, struct sc_pkcs15_der *der, struct sc_pkcs15_cert *cert)
+copy_tlv(const u8 *start, const u8 *end, u8 **out, size_t *outlen)
 {
-	int r;
-	struct sc_algorithm_id sig_alg;
-	struct sc_pkcs15_pubkey *pubkey = NULL;
-	unsigned char *serial = NULL, *issuer = NULL, *subject = NULL, *buf =  der->value;
-	size_t serial_len = 0, issuer_len = 0, subject_len = 0, data_len = 0, buflen = der->len;
-	struct sc_asn1_entry asn1_version[] = {
-		{ "version", SC_ASN1_INTEGER, SC_ASN1_TAG_INTEGER, 0, &cert->version, NULL },
-		{ NULL, 0, 0, 0, NULL, NULL }
-	};
-	struct sc_asn1_entry asn1_x509v3[] = {
-		{ "certificatePolicies",	SC_ASN1_OCTET_STRING, SC_ASN1_SEQUENCE | SC_ASN1_CONS, SC_ASN1_OPTIONAL, NULL, NULL },
-		{ "subjectKeyIdentifier",	SC_ASN1_OCTET_STRING, SC_ASN1_SEQUENCE | SC_ASN1_CONS, SC_ASN1_OPTIONAL, NULL, NULL },
-		{ "crlDistributionPoints",	SC_ASN1_OCTET_STRING, SC_ASN1_SEQUENCE | SC_ASN1_CONS, SC_ASN1_OPTIONAL | SC_ASN1_ALLOC, &cert->crl, &cert->crl_len },
-		{ "authorityKeyIdentifier",	SC_ASN1_OCTET_STRING, SC_ASN1_SEQUENCE | SC_ASN1_CONS, SC_ASN1_OPTIONAL, NULL, NULL },
-		{ "keyUsage",			SC_ASN1_BOOLEAN, SC_ASN1_SEQUENCE | SC_ASN1_CONS, SC_ASN1_OPTIONAL, NULL, NULL },
-		{ NULL, 0, 0, 0, NULL, NULL }
-	};
-	struct sc_asn1_entry asn1_extensions[] = {
-		{ "x509v3",		SC_ASN1_STRUCT,    SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, SC_ASN1_OPTIONAL, asn1_x509v3, NULL },
-		{ NULL, 0, 0, 0, NULL, NULL }
-	};
-	struct sc_asn1_entry asn1_tbscert[] = {
-		{ "version",		SC_ASN1_STRUCT,    SC_ASN1_CTX | 0 | SC_ASN1_CONS, SC_ASN1_OPTIONAL, asn1_version, NULL },
-		{ "serialNumber",	SC_ASN1_OCTET_STRING, SC_ASN1_TAG_INTEGER, SC_ASN1_ALLOC, &serial, &serial_len },
-		{ "signature",		SC_ASN1_STRUCT,    SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, 0, NULL, NULL },
-		{ "issuer",		SC_ASN1_OCTET_STRING, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, SC_ASN1_ALLOC, &issuer, &issuer_len },
-		{ "validity",		SC_ASN1_STRUCT,    SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, 0, NULL, NULL },
-		{ "subject",		SC_ASN1_OCTET_STRING, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, SC_ASN1_ALLOC, &subject, &subject_len },
-		/* Use a callback to get the algorithm, parameters and pubkey into sc_pkcs15_pubkey */
-		{ "subjectPublicKeyInfo",SC_ASN1_CALLBACK, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, 0, sc_pkcs15_pubkey_from_spki_fields,  &pubkey },
-		{ "extensions",		SC_ASN1_STRUCT,    SC_ASN1_CTX | 3 | SC_ASN1_CONS, SC_ASN1_OPTIONAL, asn1_extensions, NULL },
-		{ NULL, 0, 0, 0, NULL, NULL }
-	};
-	struct sc_asn1_entry asn1_cert[] = {
-		{ "tbsCertificate",	SC_ASN1_STRUCT,    SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, 0, asn1_tbscert, NULL },
-		{ "signatureAlgorithm",	SC_ASN1_ALGORITHM_ID, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, 0, &sig_alg, NULL },
-		{ "signatureValue",	SC_ASN1_BIT_STRING, SC_ASN1_TAG_BIT_STRING, 0, NULL, NULL },
-		{ NULL, 0, 0, 0, NULL, NULL }
-	};
-	struct sc_asn1_entry asn1_serial_number[] = {
-		{ "serialNumber", SC_ASN1_OCTET_STRING, SC_ASN1_TAG_INTEGER, SC_ASN1_ALLOC, NULL, NULL },
-		{ NULL, 0, 0, 0, NULL, NULL }
-	};
-	struct sc_asn1_entry asn1_subject[] = {
-		{ "subject", SC_ASN1_OCTET_STRING, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, SC_ASN1_ALLOC, NULL, NULL },
-		{ NULL, 0, 0, 0, NULL, NULL }
-	};
-	struct sc_asn1_entry asn1_issuer[] = {
-		{ "issuer", SC_ASN1_OCTET_STRING, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, SC_ASN1_ALLOC, NULL, NULL },
-		{ NULL, 0, 0, 0, NULL, NULL }
-	};
-
-	const u8 *obj;
-	size_t objlen;
+	*out = malloc(end - start);
+	if (*out == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	memcpy(*out, start, end - start);
+	*outlen = end - start;
+	return SC_SUCCESS;
+}
+
+
+/* Walks the certificate in place and only fills in the SC_PKCS15_CERT_*
+ * <fields>.  cert->data.len is set to the length of the certificate,
+ * cert->data.value is left to the caller. */
+static int
+parse_x509_cert(sc_context_t *ctx, struct sc_pkcs15_der *der, struct sc_pkcs15_cert *cert,
+		unsigned int fields)
+{
+	const u8 *buf = der->value, *obj, *tbs, *tlv, *p, *q;
+	size_t buflen = der->len, objlen, tbslen, left, len;
+	int r, i;
 
 	memset(cert, 0, sizeof(*cert));
 	obj = sc_asn1_verify_tag(ctx, buf, buflen, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, &objlen);
 	if (obj == NULL)
 		LOG_TEST_RET(ctx, SC_ERROR_INVALID_ASN1_OBJECT, "X.509 certificate not found");
+	cert->data.len = objlen + (obj - buf);
+
+	/* tbsCertificate, signatureAlgorithm, signatureValue */
+	p = obj;
+	left = objlen;
+	tbs = sc_asn1_skip_tag(ctx, &p, &left, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, &tbslen);
+	if (tbs == NULL
+			|| sc_asn1_skip_tag(ctx, &p, &left, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, &len) == NULL
+			|| sc_asn1_skip_tag(ctx, &p, &left, SC_ASN1_TAG_BIT_STRING, &len) == NULL)
+		LOG_TEST_RET(ctx, SC_ERROR_INVALID_ASN1_OBJECT, "ASN.1 parsing of certificate failed");
+
+	p = tbs;
+	left = tbslen;
+	obj = sc_asn1_skip_tag(ctx, &p, &left, SC_ASN1_CTX | 0 | SC_ASN1_CONS, &objlen);
+	if (obj != NULL) {
+		q = sc_asn1_skip_tag(ctx, &obj, &objlen, SC_ASN1_TAG_INTEGER, &len);
+		if (q == NULL || sc_asn1_decode_integer(q, len, &cert->version))
+			LOG_TEST_RET(ctx, SC_ERROR_INVALID_ASN1_OBJECT, "Invalid certificate version");
+	}
+	cert->version++;
 
-	data_len = objlen + (obj - buf);
-	cert->data.value = malloc(data_len);
-	if (!cert->data.value)
-		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
-	memcpy(cert->data.value, buf, data_len);
-	cert->data.len = data_len;
-
-	r = sc_asn1_decode(ctx, asn1_cert, obj, objlen, NULL, NULL);
-	LOG_TEST_RET(ctx, r, "ASN.1 parsing of certificate failed");
+	/* serial, issuer and subject are kept with their tag and length */
+	tlv = p;
+	obj = sc_asn1_skip_tag(ctx, &p, &left, SC_ASN1_TAG_INTEGER, &objlen);
+	if (obj == NULL)
+		LOG_TEST_RET(ctx, SC_ERROR_INVALID_ASN1_OBJECT, "Certificate serial number not found");
+	if ((fields & SC_PKCS15_CERT_SERIAL) && objlen) {
+		r = copy_tlv(tlv, p, &cert->serial, &cert->serial_len);
+		LOG_TEST_RET(ctx, r, "Cannot copy serial number");
+	}
 
-	cert->version++;
+	if (sc_asn1_skip_tag(ctx, &p, &left, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, &len) == NULL)
+		LOG_TEST_RET(ctx, SC_ERROR_INVALID_ASN1_OBJECT, "Certificate signature algorithm not found");
 
-	if (!pubkey)
-		LOG_TEST_RET(ctx, SC_ERROR_INVALID_ASN1_OBJECT, "Unable to decode subjectPublicKeyInfo from cert");
-	cert->key = pubkey;
+	tlv = p;
+	obj = sc_asn1_skip_tag(ctx, &p, &left, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, &objlen);
+	if (obj == NULL)
+		LOG_TEST_RET(ctx, SC_ERROR_INVALID_ASN1_OBJECT, "Certificate issuer not found");
+	if ((fields & SC_PKCS15_CERT_ISSUER) && objlen) {
+		r = copy_tlv(tlv, p, &cert->issuer, &cert->issuer_len);
+		LOG_TEST_RET(ctx, r, "Cannot copy issuer");
+	}
 
-	sc_asn1_clear_algorithm_id(&sig_alg);
+	if (sc_asn1_skip_tag(ctx, &p, &left, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, &len) == NULL)
+		LOG_TEST_RET(ctx, SC_ERROR_INVALID_ASN1_OBJECT, "Certificate validity not found");
 
-	if (serial && serial_len)   {
-		sc_format_asn1_entry(asn1_serial_number + 0, serial, &serial_len, 1);
-		r = sc_asn1_encode(ctx, asn1_serial_number, &cert->serial, &cert->serial_len);
-		free(serial);
-		LOG_TEST_RET(ctx, r, "ASN.1 encoding of serial failed");
+	tlv = p;
+	obj = sc_asn1_skip_tag(ctx, &p, &left, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, &objlen);
+	if (obj == NULL)
+		LOG_TEST_RET(ctx, SC_ERROR_INVALID_ASN1_OBJECT, "Certificate subject not found");
+	if ((fields & SC_PKCS15_CERT_SUBJECT) && objlen) {
+		r = copy_tlv(tlv, p, &cert->subject, &cert->subject_len);
+		LOG_TEST_RET(ctx, r, "Cannot copy subject");
 	}
 
-	if (subject && subject_len)   {
-		sc_format_asn1_entry(asn1_subject + 0, subject, &subject_len, 1);
-		r = sc_asn1_encode(ctx, asn1_subject, &cert->subject, &cert->subject_len);
-		free(subject);
-		LOG_TEST_RET(ctx, r, "ASN.1 encoding of subject");
+	obj = sc_asn1_skip_tag(ctx, &p, &left, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, &objlen);
+	if (obj == NULL)
+		LOG_TEST_RET(ctx, SC_ERROR_INVALID_ASN1_OBJECT, "Unable to decode subjectPublicKeyInfo from cert");
+	if (fields & SC_PKCS15_CERT_KEY) {
+		r = sc_pkcs15_pubkey_from_spki_fields(ctx, &cert->key, (u8 *) obj, objlen, 0);
+		LOG_TEST_RET(ctx, r, "Unable to decode subjectPublicKeyInfo from cert");
 	}
 
-	if (issuer && issuer_len)   {
-		sc_format_asn1_entry(asn1_issuer + 0, issuer, &issuer_len, 1);
-		r = sc_asn1_encode(ctx, asn1_issuer, &cert->issuer, &cert->issuer_len);
-		free(issuer);
-		LOG_TEST_RET(ctx, r, "ASN.1 encoding of issuer");
+	if (fields & SC_PKCS15_CERT_CRL) {
+		/* optional issuerUniqueID and subjectUniqueID */
+		sc_asn1_skip_tag(ctx, &p, &left, SC_ASN1_CTX | 1, &len);
+		sc_asn1_skip_tag(ctx, &p, &left, SC_ASN1_CTX | 2, &len);
+
+		/* cert->crl has always been the third extension */
+		obj = sc_asn1_skip_tag(ctx, &p, &left, SC_ASN1_CTX | 3 | SC_ASN1_CONS, &objlen);
+		if (obj != NULL)
+			obj = sc_asn1_skip_tag(ctx, &obj, &objlen, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, &len);
+		for (i = 0, q = NULL; obj != NULL && i < 3; i++)
+			q = sc_asn1_skip_tag(ctx, &obj, &len, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, &objlen);
+		if (q != NULL && objlen) {
+			r = copy_tlv(q, q + objlen, &cert->crl, &cert->crl_len);
+			LOG_TEST_RET(ctx, r, "Cannot copy extension");
+		}
 	}
 
 	return SC_SUCCESS;
@@ -152,7 +157,7 @@ sc_pkcs15_pubkey_from_cert(struct sc_context *ctx,
 	if (cert == NULL)
 		return SC_ERROR_OUT_OF_MEMORY;
 
-	rv = parse_x509_cert(ctx, cert_blob, cert);
+	rv = parse_x509_cert(ctx, cert_blob, cert, SC_PKCS15_CERT_KEY);
 
 	*out = cert->key;
 	cert->key = NULL;
@@ -165,6 +170,14 @@ sc_pkcs15_pubkey_from_cert(struct sc_context *ctx,
 int
 sc_pkcs15_read_certificate(struct sc_pkcs15_card *p15card, const struct sc_pkcs15_cert_info *info,
 		struct sc_pkcs15_cert **cert_out)
+{
+	return sc_pkcs15_read_certificate_fields(p15card, info, SC_PKCS15_CERT_ALL_FIELDS, cert_out);
+}
+
+
+int
+sc_pkcs15_read_certificate_fields(struct sc_pkcs15_card *p15card, const struct sc_pkcs15_cert_info *info,
+		unsigned int fields, struct sc_pkcs15_cert **cert_out)
 {
 	struct sc_context *ctx = NULL;
 	struct sc_pkcs15_cert *cert = NULL;
@@ -192,12 +205,13 @@ sc_pkcs15_read_certificate(struct sc_pkcs15_card *p15card, const struct sc_pkcs1
 		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
 	}
 	memset(cert, 0, sizeof(struct sc_pkcs15_cert));
-	if (parse_x509_cert(ctx, &der, cert)) {
+	if (parse_x509_cert(ctx, &der, cert, fields)) {
 		free(der.value);
 		sc_pkcs15_free_certificate(cert);
 		LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_ASN1_OBJECT);
 	}
-	free(der.value);
+	/* the certificate keeps the buffer it was read into */
+	cert->data.value = der.value;
 
 	*cert_out = cert;
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
@@ -269,6 +283,9 @@ sc_pkcs15_decode_cdf_entry(struct sc_pkcs15_card *p15card, struct sc_pkcs15_obje
 	sc_format_asn1_entry(asn1_x509_cert_value_choice + 1, &der->value, &der->len, 0);
 	sc_format_asn1_entry(asn1_type_cert_attr + 0, asn1_x509_cert_attr, NULL, 0);
 	sc_format_asn1_entry(asn1_cert + 0, &cert_obj, NULL, 0);
+	/* point into the copy of the DF kept by the arena */
+	if (obj->arena != NULL)
+		asn1_x509_cert_value_choice[1].flags |= SC_ASN1_REF;
 
         /* Fill in defaults */
         memset(&info, 0, sizeof(info));
@@ -276,7 +293,7 @@ sc_pkcs15_decode_cdf_entry(struct sc_pkcs15_card *p15card, struct sc_pkcs15_obje
 
 	r = sc_asn1_decode(ctx, asn1_cert, *buf, *buflen, buf, buflen);
 	/* In case of error, trash the cert value (direct coding) */
-	if (r < 0 && der->value)
+	if (r < 0 && der->value && obj->arena == NULL)
 		free(der->value);
 	if (r == SC_ERROR_ASN1_END_OF_CONTENTS)
 		return r;
@@ -292,7 +309,7 @@ sc_pkcs15_decode_cdf_entry(struct sc_pkcs15_card *p15card, struct sc_pkcs15_obje
 	sc_log(ctx, "Certificate path '%s'", sc_print_path(&info.path));
 
 	obj->type = SC_PKCS15_TYPE_CERT_X509;
-	obj->data = malloc(sizeof(info));
+	obj->data = sc_pkcs15_alloc_object_data(obj, sizeof(info));
 	if (obj->data == NULL)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
 	memcpy(obj->data, &info, sizeof(info));
@@ -244,6 +244,9 @@ int sc_pkcs15_decode_prkdf_entry(struct sc_pkcs15_card *p15card,
 	sc_format_asn1_entry(asn1_com_key_attr + 5, asn1_supported_algorithms, NULL, 0);
 
 	sc_format_asn1_entry(asn1_com_prkey_attr + 0, &info.subject.value, &info.subject.len, 0);
+	/* point into the copy of the DF kept by the arena */
+	if (obj->arena != NULL)
+		asn1_com_prkey_attr[0].flags |= SC_ASN1_REF;
 
 	/* Fill in defaults */
 	memset(&info, 0, sizeof(info));
@@ -332,7 +335,7 @@ int sc_pkcs15_decode_prkdf_entry(struct sc_pkcs15_card *p15card,
 			sc_log(ctx, "Warning: No auth ID found");
 	}
 
-	obj->data = malloc(sizeof(info));
+	obj->data = sc_pkcs15_alloc_object_data(obj, sizeof(info));
 	if (obj->data == NULL) {
 		sc_pkcs15_free_key_params(&info.params);
 		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
@@ -802,6 +802,8 @@ sc_pkcs15_card_free(struct sc_pkcs15_card *p15card)
 	if (p15card->file_unusedspace != NULL)
 		sc_file_free(p15card->file_unusedspace);
 
+	sc_pkcs15_free_cache_store(p15card);
+
 	p15card->magic = 0;
 	sc_pkcs15_free_tokeninfo(p15card);
 	sc_pkcs15_free_app(p15card);
@@ -821,6 +823,7 @@ sc_pkcs15_card_clear(struct sc_pkcs15_card *p15card)
 	p15card->flags = 0;
 	p15card->tokeninfo->version = 0;
 	p15card->tokeninfo->flags   = 0;
+	p15card->cache_digest_set = 0;
 
 	sc_pkcs15_remove_objects(p15card);
 	sc_pkcs15_remove_dfs(p15card);
@@ -974,6 +977,29 @@ sc_pkcs15_get_application_by_type(struct sc_card * card, char *app_type)
 }
 
 
+/* FNV-1a 64 bit, over the data that identifies the content of the card */
+static void
+cache_digest_update(struct sc_pkcs15_card *p15card, const unsigned char *data, size_t len)
+{
+	unsigned long long h = 0;
+	size_t i;
+
+	for (i = 0; i < sizeof(p15card->cache_digest); i++)
+		h = h << 8 | p15card->cache_digest[i];
+	if (!p15card->cache_digest_set)
+		h = 0xCBF29CE484222325ULL;
+	for (i = 0; i < len; i++) {
+		h ^= data[i];
+		h *= 0x100000001B3ULL;
+	}
+	for (i = sizeof(p15card->cache_digest); i > 0; i--, h >>= 8)
+		p15card->cache_digest[i - 1] = (unsigned char)h;
+	p15card->cache_digest_set = 1;
+}
+
+
+static int sc_pkcs15_load_snapshot(struct sc_pkcs15_card *p15card);
+
 int
 sc_pkcs15_bind_internal(struct sc_pkcs15_card *p15card, struct sc_aid *aid)
 {
@@ -1085,6 +1111,10 @@ sc_pkcs15_bind_internal(struct sc_pkcs15_card *p15card, struct sc_aid *aid)
 	}
 	len = err;
 
+	p15card->cache_digest_set = 0;
+	cache_digest_update(p15card, card->atr.value, card->atr.len);
+	cache_digest_update(p15card, buf, len);
+
 	if (parse_odf(buf, len, p15card)) {
 		err = SC_ERROR_PKCS15_APP_NOT_FOUND;
 		sc_log(ctx, "Unable to parse ODF");
@@ -1139,6 +1169,8 @@ sc_pkcs15_bind_internal(struct sc_pkcs15_card *p15card, struct sc_aid *aid)
 		goto end;
 	}
 
+	cache_digest_update(p15card, buf, (size_t)err);
+
 	memset(&tokeninfo, 0, sizeof(tokeninfo));
 	err = sc_pkcs15_parse_tokeninfo(ctx, &tokeninfo, buf, (size_t)err);
 	if (err != SC_SUCCESS)   {
@@ -1159,6 +1191,12 @@ sc_pkcs15_bind_internal(struct sc_pkcs15_card *p15card, struct sc_aid *aid)
 		sc_log(ctx, "p15card->tokeninfo->serial_number %s", p15card->tokeninfo->serial_number);
 	}
 
+	if (p15card->opts.use_object_snapshot) {
+		err = sc_pkcs15_load_snapshot(p15card);
+		if (err != SC_SUCCESS)
+			sc_log(ctx, "Object snapshot not used: %s", sc_strerror(err));
+	}
+
 	ok = 1;
 end:
 	if(buf != NULL)
@@ -1181,6 +1219,7 @@ sc_pkcs15_bind(struct sc_card *card, struct sc_aid *aid,
 	struct sc_pkcs15_card *p15card = NULL;
 	struct sc_context *ctx = card->ctx;
 	scconf_block *conf_block = NULL;
+	const char *backend;
 	int r, emu_first, enable_emu;
 
 	LOG_FUNC_CALLED(ctx);
@@ -1193,6 +1232,10 @@ sc_pkcs15_bind(struct sc_card *card, struct sc_aid *aid,
 
 	p15card->card = card;
 	p15card->opts.use_file_cache = 0;
+	p15card->opts.file_cache_backend = SC_PKCS15_FILE_CACHE_FILES;
+	p15card->opts.validate_file_cache = 1;
+	p15card->opts.use_object_snapshot = 0;
+	p15card->opts.use_df_arena = 0;
 	p15card->opts.use_pin_cache = 1;
 	p15card->opts.pin_cache_counter = 10;
 	p15card->opts.pin_cache_ignore_user_consent = 0;
@@ -1201,13 +1244,28 @@ sc_pkcs15_bind(struct sc_card *card, struct sc_aid *aid,
 
 	if (conf_block) {
 		p15card->opts.use_file_cache = scconf_get_bool(conf_block, "use_file_caching", p15card->opts.use_file_cache);
+		p15card->opts.validate_file_cache = scconf_get_bool(conf_block, "validate_file_cache",
+				p15card->opts.validate_file_cache);
+		p15card->opts.use_object_snapshot = scconf_get_bool(conf_block, "use_object_snapshot",
+				p15card->opts.use_object_snapshot);
+		p15card->opts.use_df_arena = scconf_get_bool(conf_block, "use_df_arena",
+				p15card->opts.use_df_arena);
+		backend = scconf_get_str(conf_block, "file_cache_backend", "files");
+		if (!strcmp(backend, "mmap"))
+			p15card->opts.file_cache_backend = SC_PKCS15_FILE_CACHE_MMAP;
+		else if (strcmp(backend, "files"))
+			sc_log(ctx, "Unknown file_cache_backend '%s', using 'files'", backend);
 		p15card->opts.use_pin_cache = scconf_get_bool(conf_block, "use_pin_caching", p15card->opts.use_pin_cache);
 		p15card->opts.pin_cache_counter = scconf_get_int(conf_block, "pin_cache_counter", p15card->opts.pin_cache_counter);
 		p15card->opts.pin_cache_ignore_user_consent =  scconf_get_bool(conf_block, "pin_cache_ignore_user_consent",
 				p15card->opts.pin_cache_ignore_user_consent);
 	}
-	sc_log(ctx, "PKCS#15 options: use_file_cache=%d use_pin_cache=%d pin_cache_counter=%d pin_cache_ignore_user_consent=%d",
-	         p15card->opts.use_file_cache, p15card->opts.use_pin_cache,
+	sc_log(ctx, "PKCS#15 options: use_file_cache=%d file_cache_backend=%d validate_file_cache=%d "
+		 "use_object_snapshot=%d use_df_arena=%d use_pin_cache=%d pin_cache_counter=%d "
+		 "pin_cache_ignore_user_consent=%d",
+	         p15card->opts.use_file_cache, p15card->opts.file_cache_backend,
+		 p15card->opts.validate_file_cache, p15card->opts.use_object_snapshot,
+		 p15card->opts.use_df_arena, p15card->opts.use_pin_cache,
 		 p15card->opts.pin_cache_counter, p15card->opts.pin_cache_ignore_user_consent);
 
 	r = sc_lock(card);
@@ -1244,6 +1302,10 @@ sc_pkcs15_bind(struct sc_card *card, struct sc_aid *aid,
 	}
 done:
 	fix_starcos_pkcs15_card(p15card);
+	/* write the files cached while binding in one go */
+	r = sc_pkcs15_flush_cache(p15card);
+	if (r != SC_SUCCESS)
+		sc_log(ctx, "Cannot write the file cache: %s", sc_strerror(r));
 
 	*p15card_out = p15card;
 	sc_unlock(card);
@@ -1870,11 +1932,149 @@ sc_pkcs15_remove_objects(struct sc_pkcs15_card *p15card)
 }
 
 
+/* Arena of a DF parsed with use_df_arena. It holds a copy of the DF
+ * content, which values decoded with SC_ASN1_REF point into, and the
+ * objects of the DF with their data. It is freed with its last object. */
+#define ARENA_BLOCK_SIZE	16384
+#define ARENA_ALIGN(n)		(((n) + 15) & ~(size_t)15)
+
+struct sc_pkcs15_arena_block {
+	struct sc_pkcs15_arena_block *next;
+	size_t size, used;
+};
+
+struct sc_pkcs15_arena {
+	struct sc_pkcs15_arena_block *blocks;
+	unsigned int refs;	/* objects, and the parser while it runs */
+};
+
+static struct sc_pkcs15_arena *
+arena_new(void)
+{
+	struct sc_pkcs15_arena *arena = calloc(1, sizeof(struct sc_pkcs15_arena));
+
+	if (arena != NULL)
+		arena->refs = 1;
+	return arena;
+}
+
+static void
+arena_put(struct sc_pkcs15_arena *arena)
+{
+	struct sc_pkcs15_arena_block *block;
+
+	if (--arena->refs > 0)
+		return;
+	while ((block = arena->blocks) != NULL) {
+		arena->blocks = block->next;
+		free(block);
+	}
+	free(arena);
+}
+
+/* Returns zeroed memory */
+static void *
+arena_alloc(struct sc_pkcs15_arena *arena, size_t size)
+{
+	struct sc_pkcs15_arena_block *block = arena->blocks;
+	unsigned char *p;
+
+	size = ARENA_ALIGN(size);
+	if (block == NULL || block->size - block->used < size) {
+		size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+
+		block = malloc(ARENA_ALIGN(sizeof(*block)) + block_size);
+		if (block == NULL)
+			return NULL;
+		block->size = block_size;
+		block->used = 0;
+		block->next = arena->blocks;
+		arena->blocks = block;
+	}
+	p = (unsigned char *)block + ARENA_ALIGN(sizeof(*block)) + block->used;
+	block->used += size;
+	memset(p, 0, size);
+	return p;
+}
+
+static int
+arena_owns(const struct sc_pkcs15_arena *arena, const void *ptr)
+{
+	const struct sc_pkcs15_arena_block *block;
+	const unsigned char *start;
+
+	for (block = arena->blocks; block != NULL; block = block->next) {
+		start = (const unsigned char *)block + ARENA_ALIGN(sizeof(*block));
+		if ((const unsigned char *)ptr >= start && (const unsigned char *)ptr <= start + block->size)
+			return 1;
+	}
+	return 0;
+}
+
+static void
+arena_free(const struct sc_pkcs15_arena *arena, void *ptr)
+{
+	if (ptr != NULL && !arena_owns(arena, ptr))
+		free(ptr);
+}
+
+/* Frees what sc_pkcs15_free_*_info() would, except the memory of the arena */
+static void
+arena_free_object(struct sc_pkcs15_object *obj)
+{
+	struct sc_pkcs15_arena *arena = obj->arena;
+
+	switch (obj->type & SC_PKCS15_TYPE_CLASS_MASK) {
+	case SC_PKCS15_TYPE_PRKEY: {
+		sc_pkcs15_prkey_info_t *info = (sc_pkcs15_prkey_info_t *)obj->data;
+
+		if (info == NULL)
+			break;
+		arena_free(arena, info->subject.value);
+		free(info->cmap_record.guid);
+		sc_pkcs15_free_key_params(&info->params);
+		break;
+	}
+	case SC_PKCS15_TYPE_PUBKEY: {
+		sc_pkcs15_pubkey_info_t *info = (sc_pkcs15_pubkey_info_t *)obj->data;
+
+		if (info == NULL)
+			break;
+		arena_free(arena, info->subject.value);
+		sc_pkcs15_free_key_params(&info->params);
+		break;
+	}
+	case SC_PKCS15_TYPE_CERT:
+		if (obj->data != NULL)
+			arena_free(arena, ((sc_pkcs15_cert_info_t *)obj->data)->value.value);
+		break;
+	case SC_PKCS15_TYPE_DATA_OBJECT:
+		if (obj->data != NULL && ((sc_pkcs15_data_info_t *)obj->data)->data.len)
+			arena_free(arena, ((sc_pkcs15_data_info_t *)obj->data)->data.value);
+		break;
+	}
+
+	sc_pkcs15_free_object_content(obj);
+	arena_put(arena);
+}
+
+void *
+sc_pkcs15_alloc_object_data(struct sc_pkcs15_object *obj, size_t size)
+{
+	if (obj->arena != NULL)
+		return arena_alloc(obj->arena, size);
+	return malloc(size);
+}
+
 void
 sc_pkcs15_free_object(struct sc_pkcs15_object *obj)
 {
 	if (!obj)
 		return;
+	if (obj->arena != NULL) {
+		arena_free_object(obj);
+		return;
+	}
 	switch (obj->type & SC_PKCS15_TYPE_CLASS_MASK) {
 	case SC_PKCS15_TYPE_PRKEY:
 		sc_pkcs15_free_prkey_info((sc_pkcs15_prkey_info_t *)obj->data);
@@ -1949,7 +2149,7 @@ sc_pkcs15_encode_df(struct sc_context *ctx, struct sc_pkcs15_card *p15card, stru
 		unsigned char **buf_out, size_t *bufsize_out)
 {
 	unsigned char *buf = NULL, *tmp = NULL, *p;
-	size_t bufsize = 0, tmpsize;
+	size_t bufsize = 0, bufalloc = 0, tmpsize;
 	const struct sc_pkcs15_object *obj;
 	int (* func)(struct sc_context *, const struct sc_pkcs15_object *nobj,
 		     unsigned char **nbuf, size_t *nbufsize) = NULL;
@@ -1991,13 +2191,17 @@ sc_pkcs15_encode_df(struct sc_context *ctx, struct sc_pkcs15_card *p15card, stru
 			free(buf);
 			return r;
 		}
-		p = (u8 *) realloc(buf, bufsize + tmpsize);
-		if (!p) {
-			free(tmp);
-			free(buf);
-			return SC_ERROR_OUT_OF_MEMORY;
+		if (bufsize + tmpsize > bufalloc) {
+			/* grow geometrically, large DFs have hundreds of entries */
+			bufalloc = 2 * bufalloc > bufsize + tmpsize ? 2 * bufalloc : bufsize + tmpsize;
+			p = (u8 *) realloc(buf, bufalloc);
+			if (!p) {
+				free(tmp);
+				free(buf);
+				return SC_ERROR_OUT_OF_MEMORY;
+			}
+			buf = p;
 		}
-		buf = p;
 		memcpy(buf + bufsize, tmp, tmpsize);
 		free(tmp);
 		bufsize += tmpsize;
@@ -2009,28 +2213,18 @@ sc_pkcs15_encode_df(struct sc_context *ctx, struct sc_pkcs15_card *p15card, stru
 }
 
 
-int
-sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df)
+static int
+parse_df_content(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df,
+		const unsigned char *buf, size_t bufsize)
 {
 	struct sc_context *ctx = p15card->card->ctx;
-	unsigned char *buf;
-	const unsigned char *p;
-	size_t bufsize;
-	int r;
-	struct sc_pkcs15_object *obj = NULL;
+	const unsigned char *p = buf;
+	struct sc_pkcs15_object *obj = NULL, *last;
+	struct sc_pkcs15_arena *arena = NULL;
+	int r = 0;
 	int (* func)(struct sc_pkcs15_card *, struct sc_pkcs15_object *,
 		     const u8 **nbuf, size_t *nbufsize) = NULL;
 
-	sc_log(ctx, "called; path=%s, type=%d, enum=%d", sc_print_path(&df->path), df->type, df->enumerated);
-
-	if (p15card->ops.parse_df)   {
-		r = p15card->ops.parse_df(p15card, df);
-		LOG_FUNC_RETURN(ctx, r);
-	}
-
-	if (df->enumerated)
-		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
-
 	switch (df->type) {
 	case SC_PKCS15_PRKDF:
 		func = sc_pkcs15_decode_prkdf_entry;
@@ -2055,50 +2249,239 @@ sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df)
 	}
 	if (func == NULL) {
 		sc_log(ctx, "unknown DF type: %d", df->type);
-		LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_ARGUMENTS);
+		return SC_ERROR_INVALID_ARGUMENTS;
+	}
+
+	/* Append to the tail found once: sc_pkcs15_add_object() walks the
+	 * whole list for every entry, which is quadratic on large DFs. */
+	for (last = p15card->obj_list; last != NULL && last->next != NULL; last = last->next)
+		;
+
+	/* Decode a copy that lives as long as the objects referring to it */
+	if (p15card->opts.use_df_arena) {
+		unsigned char *copy;
+
+		arena = arena_new();
+		if (arena == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		copy = arena_alloc(arena, bufsize);
+		if (copy == NULL) {
+			arena_put(arena);
+			return SC_ERROR_OUT_OF_MEMORY;
+		}
+		memcpy(copy, buf, bufsize);
+		p = copy;
 	}
-	r = sc_pkcs15_read_file(p15card, &df->path, &buf, &bufsize);
-	LOG_TEST_RET(ctx, r, "pkcs15 read file failed");
 
-	p = buf;
 	while (bufsize && *p != 0x00) {
 
-		obj = calloc(1, sizeof(struct sc_pkcs15_object));
+		if (arena != NULL)
+			obj = arena_alloc(arena, sizeof(struct sc_pkcs15_object));
+		else
+			obj = calloc(1, sizeof(struct sc_pkcs15_object));
 		if (obj == NULL) {
 			r = SC_ERROR_OUT_OF_MEMORY;
-			goto ret;
+			break;
 		}
+		obj->arena = arena;
 		r = func(p15card, obj, &p, &bufsize);
 		if (r) {
-			free(obj);
+			if (arena == NULL)
+				free(obj);
 			if (r == SC_ERROR_ASN1_END_OF_CONTENTS) {
 				r = 0;
 				break;
 			}
 			sc_log(ctx, "%s: Error decoding DF entry", sc_strerror(r));
-			goto ret;
+			break;
 		}
 
+		if (arena != NULL)
+			arena->refs++;
 		obj->df = df;
-		r = sc_pkcs15_add_object(p15card, obj);
-		if (r) {
-			if (obj->data)
-				free(obj->data);
-			free(obj);
-			sc_log(ctx, "%s: Error adding object", sc_strerror(r));
-			goto ret;
-		}
+		obj->next = NULL;
+		obj->prev = last;
+		if (last != NULL)
+			last->next = obj;
+		else
+			p15card->obj_list = obj;
+		last = obj;
 	};
 
+	if (arena != NULL)
+		arena_put(arena);
 	if (r > 0)
 		r = 0;
-ret:
+	return r;
+}
+
+
+int
+sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	unsigned char *buf;
+	size_t bufsize;
+	int r;
+
+	sc_log(ctx, "called; path=%s, type=%d, enum=%d", sc_print_path(&df->path), df->type, df->enumerated);
+
+	if (p15card->ops.parse_df)   {
+		r = p15card->ops.parse_df(p15card, df);
+		LOG_FUNC_RETURN(ctx, r);
+	}
+
+	if (df->enumerated)
+		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+
+	r = sc_pkcs15_read_file(p15card, &df->path, &buf, &bufsize);
+	LOG_TEST_RET(ctx, r, "pkcs15 read file failed");
+
+	r = parse_df_content(p15card, df, buf, bufsize);
 	df->enumerated = 1;
 	free(buf);
 	LOG_FUNC_RETURN(ctx, r);
 }
 
 
+/* The snapshot keeps the content of all object directories in a single
+ * file cache entry, see sc_pkcs15_get_snapshot_path(). Each record is
+ *	type(1) path length(1) path index(4) count(4) content length(4) content
+ * behind a four byte magic. It is only used with the validated file cache,
+ * whose entry names follow the ODF and TokenInfo of the card. */
+#define SNAPSHOT_MAGIC		"P15S"
+#define SNAPSHOT_MAGIC_LEN	4
+#define SNAPSHOT_RECORD_LEN	14
+
+static int
+snapshot_record_matches(const struct sc_pkcs15_df *df, const unsigned char *rec)
+{
+	return df->type == rec[0]
+		&& df->path.len == rec[1]
+		&& !memcmp(df->path.value, rec + SNAPSHOT_RECORD_LEN, rec[1])
+		&& (unsigned long)df->path.index == bebytes2ulong(rec + 2)
+		&& (int)bebytes2ulong(rec + 6) == df->path.count;
+}
+
+/* Enumerate all DFs and store the content the file cache accepted */
+static int
+snapshot_create(struct sc_pkcs15_card *p15card, const struct sc_path *path)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_pkcs15_df *df;
+	unsigned char *snap = NULL, *tmp, *buf;
+	size_t len = SNAPSHOT_MAGIC_LEN, bufsize;
+	int r;
+
+	for (df = p15card->df_list; df; df = df->next)
+		sc_pkcs15_parse_df(p15card, df);
+
+	snap = malloc(len);
+	if (snap == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	memcpy(snap, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN);
+
+	for (df = p15card->df_list; df; df = df->next) {
+		buf = NULL;
+		if (!df->enumerated
+				|| sc_pkcs15_read_cached_file(p15card, &df->path, &buf, &bufsize) != SC_SUCCESS) {
+			sc_log(ctx, "DF %s not in the file cache, left out of the snapshot",
+					sc_print_path(&df->path));
+			continue;
+		}
+		tmp = realloc(snap, len + SNAPSHOT_RECORD_LEN + df->path.len + bufsize);
+		if (tmp == NULL) {
+			free(buf);
+			r = SC_ERROR_OUT_OF_MEMORY;
+			goto out;
+		}
+		snap = tmp;
+		tmp = snap + len;
+		tmp[0] = df->type;
+		tmp[1] = (unsigned char)df->path.len;
+		ulong2bebytes(tmp + 2, (unsigned long)df->path.index);
+		ulong2bebytes(tmp + 6, (unsigned long)df->path.count);
+		ulong2bebytes(tmp + 10, (unsigned long)bufsize);
+		memcpy(tmp + SNAPSHOT_RECORD_LEN, df->path.value, df->path.len);
+		memcpy(tmp + SNAPSHOT_RECORD_LEN + df->path.len, buf, bufsize);
+		len += SNAPSHOT_RECORD_LEN + df->path.len + bufsize;
+		free(buf);
+	}
+
+	r = sc_pkcs15_cache_file(p15card, path, snap, len);
+out:
+	free(snap);
+	return r;
+}
+
+/* Enumerate the DFs from the snapshot, or create it */
+static int
+sc_pkcs15_load_snapshot(struct sc_pkcs15_card *p15card)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_pkcs15_df *df;
+	struct sc_path path;
+	unsigned char *snap = NULL, *rec;
+	size_t len = 0, pos, reclen;
+	int r;
+
+	LOG_FUNC_CALLED(ctx);
+	if (!p15card->opts.use_file_cache || !p15card->opts.validate_file_cache
+			|| !p15card->cache_digest_set) {
+		sc_log(ctx, "Object snapshot needs the validated file cache");
+		LOG_FUNC_RETURN(ctx, SC_ERROR_NOT_SUPPORTED);
+	}
+
+	r = sc_pkcs15_get_snapshot_path(p15card, &path);
+	LOG_TEST_RET(ctx, r, "Cannot make path of the object snapshot");
+
+	r = sc_pkcs15_read_cached_file(p15card, &path, &snap, &len);
+	if (r != SC_SUCCESS) {
+		sc_log(ctx, "No object snapshot, creating one");
+		r = snapshot_create(p15card, &path);
+		LOG_FUNC_RETURN(ctx, r);
+	}
+
+	/* Check the whole layout before any object is added */
+	r = SC_ERROR_CORRUPTED_DATA;
+	if (len < SNAPSHOT_MAGIC_LEN || memcmp(snap, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN))
+		goto out;
+	for (pos = SNAPSHOT_MAGIC_LEN; pos < len; pos += reclen) {
+		rec = snap + pos;
+		if (len - pos < SNAPSHOT_RECORD_LEN || rec[1] > SC_MAX_PATH_SIZE)
+			goto out;
+		reclen = SNAPSHOT_RECORD_LEN + rec[1];
+		if (len - pos < reclen || len - pos - reclen < bebytes2ulong(rec + 10))
+			goto out;
+		reclen += bebytes2ulong(rec + 10);
+	}
+
+	for (pos = SNAPSHOT_MAGIC_LEN; pos < len; pos += reclen) {
+		rec = snap + pos;
+		reclen = SNAPSHOT_RECORD_LEN + rec[1] + bebytes2ulong(rec + 10);
+		for (df = p15card->df_list; df; df = df->next)
+			if (!df->enumerated && snapshot_record_matches(df, rec))
+				break;
+		if (df == NULL)
+			continue;
+		r = parse_df_content(p15card, df, rec + SNAPSHOT_RECORD_LEN + rec[1],
+				bebytes2ulong(rec + 10));
+		df->enumerated = 1;
+		if (r != SC_SUCCESS)
+			sc_log(ctx, "Cannot parse DF %s from the snapshot: %s",
+					sc_print_path(&df->path), sc_strerror(r));
+	}
+	r = SC_SUCCESS;
+out:
+	if (r == SC_ERROR_CORRUPTED_DATA) {
+		sc_log(ctx, "Damaged object snapshot, dropping it");
+		sc_pkcs15_uncache_file(p15card, &path);
+	}
+	free(snap);
+	LOG_FUNC_RETURN(ctx, r);
+}
+
+
 int
 sc_pkcs15_add_unusedspace(struct sc_pkcs15_card *p15card, const struct sc_path *path,
 		const struct sc_pkcs15_id *auth_id)
@@ -2298,6 +2681,27 @@ sc_pkcs15_parse_unusedspace(const unsigned char *buf, size_t buflen, struct sc_p
 }
 
 
+/* Files read with the file cache enabled are stored in it, unless reading
+ * them needs authentication or they hold private objects */
+static int
+file_is_cacheable(struct sc_pkcs15_card *p15card, const struct sc_path *path,
+		const struct sc_file *file)
+{
+	const struct sc_acl_entry *e;
+	struct sc_pkcs15_object *obj;
+
+	e = sc_file_get_acl_entry(file, SC_AC_OP_READ);
+	if (e != NULL && e->method != SC_AC_NONE)
+		return 0;
+
+	for (obj = p15card->obj_list; obj != NULL; obj = obj->next)
+		if ((obj->flags & SC_PKCS15_CO_FLAG_PRIVATE) && compare_obj_path(obj, path))
+			return 0;
+
+	return 1;
+}
+
+
 int
 sc_pkcs15_read_file(struct sc_pkcs15_card *p15card, const struct sc_path *in_path,
 		unsigned char **buf, size_t *buflen)
@@ -2390,6 +2794,14 @@ sc_pkcs15_read_file(struct sc_pkcs15_card *p15card, const struct sc_path *in_pat
 		}
 		sc_unlock(p15card->card);
 
+		/* Only whole files are cached */
+		if (p15card->opts.use_file_cache && in_path->count < 0 && len
+				&& file_is_cacheable(p15card, in_path, file)) {
+			r = sc_pkcs15_cache_file(p15card, in_path, data, len);
+			if (r != SC_SUCCESS)
+				sc_log(ctx, "Cannot cache file: %s", sc_strerror(r));
+		}
+
 		sc_file_free(file);
 	}
 	*buf = data;
@@ -2488,7 +2900,8 @@ sc_pkcs15_make_absolute_path(const struct sc_path *parent, struct sc_path *child
 
 void sc_pkcs15_free_object_content(struct sc_pkcs15_object *obj)
 {
-	if (obj->content.value && obj->content.len)   {
+	if (obj->content.value && obj->content.len
+			&& (obj->arena == NULL || !arena_owns(obj->arena, obj->content.value)))   {
 		sc_mem_clear(obj->content.value, obj->content.len);
 		free(obj->content.value);
 	}
@@ -285,6 +285,15 @@ struct sc_pkcs15_cert {
 };
 typedef struct sc_pkcs15_cert sc_pkcs15_cert_t;
 
+/* Fields of struct sc_pkcs15_cert to parse, the version and the raw
+ * certificate are always there */
+#define SC_PKCS15_CERT_SERIAL		0x01
+#define SC_PKCS15_CERT_ISSUER		0x02
+#define SC_PKCS15_CERT_SUBJECT		0x04
+#define SC_PKCS15_CERT_KEY		0x08
+#define SC_PKCS15_CERT_CRL		0x10
+#define SC_PKCS15_CERT_ALL_FIELDS	0x1F
+
 struct sc_pkcs15_cert_info {
 	struct sc_pkcs15_id id;	/* correlates to private key id */
 	int authority;		/* boolean */
@@ -541,6 +550,10 @@ struct sc_pkcs15_object {
 	struct sc_pkcs15_object *next, *prev; /* used only internally */
 
 	struct sc_pkcs15_der content;
+
+	/* Set for objects parsed with use_df_arena: the object, its data
+	 * and values decoded by reference belong to the arena of the DF */
+	struct sc_pkcs15_arena *arena;
 };
 typedef struct sc_pkcs15_object sc_pkcs15_object_t;
 
@@ -557,6 +570,7 @@ typedef struct sc_pkcs15_object sc_pkcs15_object_t;
 #define SC_PKCS15_DF_TYPE_COUNT		9
 
 struct sc_pkcs15_card;
+struct sc_pkcs15_arena;
 
 struct sc_pkcs15_df {
 	struct sc_path path;
@@ -578,6 +592,12 @@ typedef struct sc_pkcs15_unusedspace sc_pkcs15_unusedspace_t;
 
 #define SC_PKCS15_CARD_MAGIC		0x10203040
 
+/* File cache backends */
+#define SC_PKCS15_FILE_CACHE_FILES	0	/* one file per cached card file */
+#define SC_PKCS15_FILE_CACHE_MMAP	1	/* one memory mapped file per token */
+
+struct sc_pkcs15_cache_store;
+
 typedef struct sc_pkcs15_sec_env_info {
 	int			se;
 	struct sc_object_id	owner;
@@ -636,6 +656,10 @@ typedef struct sc_pkcs15_card {
 
 	struct sc_pkcs15_card_opts {
 		int use_file_cache;
+		int file_cache_backend;
+		int validate_file_cache;
+		int use_object_snapshot;
+		int use_df_arena;
 		int use_pin_cache;
 		int pin_cache_counter;
 		int pin_cache_ignore_user_consent;
@@ -648,6 +672,12 @@ typedef struct sc_pkcs15_card {
 
 	struct sc_pkcs15_operations ops;
 
+	struct sc_pkcs15_cache_store *cache_store;	/* single file cache backend */
+	/* Digest of the ATR, EF(ODF) and EF(TokenInfo) read at bind time.
+	 * With validate_file_cache, cache entries are only used for the same digest. */
+	u8 cache_digest[8];
+	int cache_digest_set;
+
 } sc_pkcs15_card_t;
 
 /* flags suitable for sc_pkcs15_tokeninfo_t */
@@ -758,6 +788,12 @@ void sc_pkcs15_free_data_object(struct sc_pkcs15_data *data_object);
 int sc_pkcs15_read_certificate(struct sc_pkcs15_card *card,
 			       const struct sc_pkcs15_cert_info *info,
 			       struct sc_pkcs15_cert **cert);
+/* Same, but only parses the SC_PKCS15_CERT_* <fields>; the others are
+ * left empty */
+int sc_pkcs15_read_certificate_fields(struct sc_pkcs15_card *card,
+			       const struct sc_pkcs15_cert_info *info,
+			       unsigned int fields,
+			       struct sc_pkcs15_cert **cert);
 void sc_pkcs15_free_certificate(struct sc_pkcs15_cert *cert);
 int sc_pkcs15_find_cert_by_id(struct sc_pkcs15_card *card,
 			      const struct sc_pkcs15_id *id,
@@ -906,6 +942,8 @@ void sc_pkcs15_free_cert_info(sc_pkcs15_cert_info_t *cert);
 void sc_pkcs15_free_data_info(sc_pkcs15_data_info_t *data);
 void sc_pkcs15_free_auth_info(sc_pkcs15_auth_info_t *auth_info);
 void sc_pkcs15_free_object(struct sc_pkcs15_object *obj);
+/* Allocates obj->data, from the arena of the object if it has one */
+void *sc_pkcs15_alloc_object_data(struct sc_pkcs15_object *obj, size_t size);
 
 /* Generic file i/o */
 int sc_pkcs15_read_file(struct sc_pkcs15_card *p15card,
@@ -919,6 +957,12 @@ int sc_pkcs15_read_cached_file(struct sc_pkcs15_card *p15card,
 int sc_pkcs15_cache_file(struct sc_pkcs15_card *p15card,
 			 const struct sc_path *path,
 			 const u8 *buf, size_t bufsize);
+int sc_pkcs15_uncache_file(struct sc_pkcs15_card *p15card,
+			   const struct sc_path *path);
+int sc_pkcs15_get_snapshot_path(struct sc_pkcs15_card *p15card,
+				struct sc_path *path);
+int sc_pkcs15_flush_cache(struct sc_pkcs15_card *p15card);
+void sc_pkcs15_free_cache_store(struct sc_pkcs15_card *p15card);
 
 /* PKCS #15 ID handling functions */
 int sc_pkcs15_compare_id(const struct sc_pkcs15_id *id1,
@@ -34,6 +34,10 @@
 #else
 #include <arpa/inet.h>
 #endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#include <sys/time.h>
+#endif
 
 #include "common/libscdl.h"
 #include "internal.h"
@@ -59,6 +63,7 @@ struct pcsc_global_private_data {
 	DWORD disconnect_action;
 	DWORD transaction_end_action;
 	DWORD reconnect_action;
+	int transaction_linger;		/* ms to keep a transaction after unlock */
 	const char *provider_library;
 	void *dlhandle;
 	SCardEstablishContext_t SCardEstablishContext;
@@ -97,6 +102,19 @@ struct pcsc_private_data {
 	DWORD get_tlv_properties;
 
 	int locked;
+
+#ifdef HAVE_PTHREAD
+	/* Lingering transaction, see pcsc_unlock(). The thread ends the
+	 * transaction when nobody locked the reader again in time. */
+	int linger_started;
+	int lingering;
+	int linger_stop;
+	struct timespec linger_deadline;
+	struct timespec transaction_start;
+	pthread_mutex_t linger_mutex;
+	pthread_cond_t linger_cond;
+	pthread_t linger_thread;
+#endif
 };
 
 static int pcsc_detect_card_presence(sc_reader_t *reader);
@@ -404,6 +422,157 @@ static int check_forced_protocol(sc_context_t *ctx, struct sc_atr *atr, DWORD *p
 }
 
 
+#ifdef HAVE_PTHREAD
+static void timespec_now(struct timespec *ts)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	ts->tv_sec = tv.tv_sec;
+	ts->tv_nsec = tv.tv_usec * 1000;
+}
+
+static void timespec_add_ms(struct timespec *ts, long ms)
+{
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+static int timespec_before(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/* Must be called with linger_mutex held */
+static void pcsc_end_lingering_locked(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
+	LONG rv;
+
+	if (!priv->lingering)
+		return;
+	rv = priv->gpriv->SCardEndTransaction(priv->pcsc_card, priv->gpriv->transaction_end_action);
+	if (rv != SCARD_S_SUCCESS)
+		PCSC_TRACE(reader, "SCardEndTransaction failed", rv);
+	priv->lingering = 0;
+	priv->locked = 0;
+}
+
+static void *pcsc_linger_thread(void *arg)
+{
+	sc_reader_t *reader = arg;
+	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
+	struct timespec now;
+
+	pthread_mutex_lock(&priv->linger_mutex);
+	while (!priv->linger_stop) {
+		if (!priv->lingering) {
+			pthread_cond_wait(&priv->linger_cond, &priv->linger_mutex);
+			continue;
+		}
+		pthread_cond_timedwait(&priv->linger_cond, &priv->linger_mutex, &priv->linger_deadline);
+		/* the deadline moves when the reader was locked and unlocked meanwhile */
+		timespec_now(&now);
+		if (priv->lingering && !timespec_before(&now, &priv->linger_deadline))
+			pcsc_end_lingering_locked(reader);
+	}
+	pthread_mutex_unlock(&priv->linger_mutex);
+	return NULL;
+}
+
+/* Keep the transaction for transaction_linger ms instead of ending it */
+static int pcsc_linger(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
+
+	if (!priv->linger_started) {
+		if (pthread_mutex_init(&priv->linger_mutex, NULL) != 0)
+			return SC_ERROR_INTERNAL;
+		if (pthread_cond_init(&priv->linger_cond, NULL) != 0) {
+			pthread_mutex_destroy(&priv->linger_mutex);
+			return SC_ERROR_INTERNAL;
+		}
+		priv->lingering = 0;
+		priv->linger_stop = 0;
+		if (pthread_create(&priv->linger_thread, NULL, pcsc_linger_thread, reader) != 0) {
+			pthread_cond_destroy(&priv->linger_cond);
+			pthread_mutex_destroy(&priv->linger_mutex);
+			return SC_ERROR_INTERNAL;
+		}
+		priv->linger_started = 1;
+	}
+
+	pthread_mutex_lock(&priv->linger_mutex);
+	timespec_now(&priv->linger_deadline);
+	timespec_add_ms(&priv->linger_deadline, priv->gpriv->transaction_linger);
+	priv->lingering = 1;
+	pthread_cond_signal(&priv->linger_cond);
+	pthread_mutex_unlock(&priv->linger_mutex);
+	return SC_SUCCESS;
+}
+
+/* Take over a lingering transaction, returns 1 if there was one */
+static int pcsc_resume_lingering(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
+	struct timespec now, limit;
+	int resumed = 0;
+
+	if (!priv->linger_started)
+		return 0;
+
+	pthread_mutex_lock(&priv->linger_mutex);
+	if (priv->lingering) {
+		/* Let other applications have the card now and then: the
+		 * same transaction is not kept for more than ten times
+		 * the linger time */
+		limit = priv->transaction_start;
+		timespec_add_ms(&limit, 10L * priv->gpriv->transaction_linger);
+		timespec_now(&now);
+		if (timespec_before(&now, &limit)) {
+			priv->lingering = 0;
+			resumed = 1;
+		} else {
+			pcsc_end_lingering_locked(reader);
+		}
+	}
+	pthread_mutex_unlock(&priv->linger_mutex);
+	return resumed;
+}
+
+static void pcsc_end_lingering(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
+
+	if (!priv->linger_started)
+		return;
+	pthread_mutex_lock(&priv->linger_mutex);
+	pcsc_end_lingering_locked(reader);
+	pthread_mutex_unlock(&priv->linger_mutex);
+}
+
+static void pcsc_stop_lingering(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
+
+	if (!priv->linger_started)
+		return;
+	pthread_mutex_lock(&priv->linger_mutex);
+	pcsc_end_lingering_locked(reader);
+	priv->linger_stop = 1;
+	pthread_cond_signal(&priv->linger_cond);
+	pthread_mutex_unlock(&priv->linger_mutex);
+	pthread_join(priv->linger_thread, NULL);
+	pthread_cond_destroy(&priv->linger_cond);
+	pthread_mutex_destroy(&priv->linger_mutex);
+	priv->linger_started = 0;
+}
+#endif
+
 static int pcsc_reconnect(sc_reader_t * reader, DWORD action)
 {
 	DWORD active_proto = opensc_proto_to_pcsc(reader->active_protocol),
@@ -426,6 +595,9 @@ static int pcsc_reconnect(sc_reader_t * reader, DWORD action)
 		protocol = tmp;
 
 	/* reconnect always unlocks transaction */
+#ifdef HAVE_PTHREAD
+	pcsc_end_lingering(reader);
+#endif
 	priv->locked = 0;
 
 	rv = priv->gpriv->SCardReconnect(priv->pcsc_card,
@@ -505,6 +677,9 @@ static int pcsc_disconnect(sc_reader_t * reader)
 
 	SC_FUNC_CALLED(reader->ctx, SC_LOG_DEBUG_NORMAL);
 
+#ifdef HAVE_PTHREAD
+	pcsc_end_lingering(reader);
+#endif
 	priv->gpriv->SCardDisconnect(priv->pcsc_card, priv->gpriv->disconnect_action);
 	reader->flags = 0;
 	return SC_SUCCESS;
@@ -518,6 +693,13 @@ static int pcsc_lock(sc_reader_t *reader)
 
 	SC_FUNC_CALLED(reader->ctx, SC_LOG_DEBUG_NORMAL);
 
+#ifdef HAVE_PTHREAD
+	if (pcsc_resume_lingering(reader)) {
+		sc_debug(reader->ctx, SC_LOG_DEBUG_NORMAL, "reusing lingering transaction");
+		return SC_SUCCESS;
+	}
+#endif
+
 	rv = priv->gpriv->SCardBeginTransaction(priv->pcsc_card);
 
 	switch (rv) {
@@ -541,6 +723,9 @@ static int pcsc_lock(sc_reader_t *reader)
 			return SC_ERROR_CARD_RESET;
 		case SCARD_S_SUCCESS:
 			priv->locked = 1;
+#ifdef HAVE_PTHREAD
+			timespec_now(&priv->transaction_start);
+#endif
 			return SC_SUCCESS;
 		default:
 			PCSC_TRACE(reader, "SCardBeginTransaction failed", rv);
@@ -555,6 +740,11 @@ static int pcsc_unlock(sc_reader_t *reader)
 
 	SC_FUNC_CALLED(reader->ctx, SC_LOG_DEBUG_NORMAL);
 
+#ifdef HAVE_PTHREAD
+	if (priv->gpriv->transaction_linger > 0 && pcsc_linger(reader) == SC_SUCCESS)
+		return SC_SUCCESS;
+#endif
+
 	rv = priv->gpriv->SCardEndTransaction(priv->pcsc_card, priv->gpriv->transaction_end_action);
 
 	priv->locked = 0;
@@ -569,6 +759,9 @@ static int pcsc_release(sc_reader_t *reader)
 {
 	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
 
+#ifdef HAVE_PTHREAD
+	pcsc_stop_lingering(reader);
+#endif
 	free(priv);
 	return SC_SUCCESS;
 }
@@ -577,7 +770,13 @@ static int pcsc_reset(sc_reader_t *reader, int do_cold_reset)
 {
 	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
 	int r;
-	int old_locked = priv->locked;
+	int old_locked;
+
+#ifdef HAVE_PTHREAD
+	/* a lingering transaction is not held by anyone */
+	pcsc_end_lingering(reader);
+#endif
+	old_locked = priv->locked;
 
 	r = pcsc_reconnect(reader, do_cold_reset ? SCARD_UNPOWER_CARD : SCARD_RESET_CARD);
 	if(r != SC_SUCCESS)
@@ -600,9 +799,11 @@ static int pcsc_cancel(sc_context_t *ctx)
 #ifndef _WIN32
 	if (gpriv->pcsc_wait_ctx != -1) {
 		rv = gpriv->SCardCancel(gpriv->pcsc_wait_ctx);
-		if (rv == SCARD_S_SUCCESS)
+		if (rv == SCARD_S_SUCCESS) {
 			 /* Also close and clear the waiting context */
 			 rv = gpriv->SCardReleaseContext(gpriv->pcsc_wait_ctx);
+			 gpriv->pcsc_wait_ctx = -1;
+		}
 	}
 #else
 	rv = gpriv->SCardCancel(gpriv->pcsc_ctx);
@@ -641,6 +842,7 @@ static int pcsc_init(sc_context_t *ctx)
 	gpriv->disconnect_action = SCARD_RESET_CARD;
 	gpriv->transaction_end_action = SCARD_LEAVE_CARD;
 	gpriv->reconnect_action = SCARD_LEAVE_CARD;
+	gpriv->transaction_linger = 0;
 	gpriv->enable_pinpad = 1;
 	gpriv->enable_pace = 1;
 	gpriv->provider_library = DEFAULT_PCSC_PROVIDER;
@@ -657,6 +859,8 @@ static int pcsc_init(sc_context_t *ctx)
 		    pcsc_reset_action(scconf_get_str(conf_block, "transaction_end_action", "leave"));
 		gpriv->reconnect_action =
 		    pcsc_reset_action(scconf_get_str(conf_block, "reconnect_action", "leave"));
+		gpriv->transaction_linger =
+		    scconf_get_int(conf_block, "transaction_linger", gpriv->transaction_linger);
 		gpriv->enable_pinpad =
 		    scconf_get_bool(conf_block, "enable_pinpad", gpriv->enable_pinpad);
 		gpriv->enable_pace =
@@ -664,8 +868,15 @@ static int pcsc_init(sc_context_t *ctx)
 		gpriv->provider_library =
 		    scconf_get_str(conf_block, "provider_library", gpriv->provider_library);
 	}
-	sc_log(ctx, "PC/SC options: connect_exclusive=%d disconnect_action=%d transaction_end_action=%d reconnect_action=%d enable_pinpad=%d enable_pace=%d",
-		gpriv->connect_exclusive, gpriv->disconnect_action, gpriv->transaction_end_action, gpriv->reconnect_action, gpriv->enable_pinpad, gpriv->enable_pace);
+	/* Resetting the card at the end of a transaction must not wait for
+	 * a lingering transaction to expire */
+	if (gpriv->transaction_linger > 0 && gpriv->transaction_end_action != SCARD_LEAVE_CARD) {
+		sc_log(ctx, "transaction_linger ignored, transaction_end_action is not 'leave'");
+		gpriv->transaction_linger = 0;
+	}
+	sc_log(ctx, "PC/SC options: connect_exclusive=%d disconnect_action=%d transaction_end_action=%d reconnect_action=%d transaction_linger=%d enable_pinpad=%d enable_pace=%d",
+		gpriv->connect_exclusive, gpriv->disconnect_action, gpriv->transaction_end_action, gpriv->reconnect_action,
+		gpriv->transaction_linger, gpriv->enable_pinpad, gpriv->enable_pace);
 
 	gpriv->dlhandle = sc_dlopen(gpriv->provider_library);
 	if (gpriv->dlhandle == NULL) {
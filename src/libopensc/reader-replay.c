@@ -0,0 +1,360 @@
+/*
+ * reader-replay.c: reader driver answering from a recorded APDU transcript
+ *
+ * Transcripts are written with the apdu_record option: a line
+ * "atr <hex> <protocol>" for every connected card, where the protocol
+ * is T0, T1 or RAW and defaults to T1, and a line
+ * "<microseconds> <command hex> <response hex>" for every APDU.
+ * Commands have to arrive in the recorded order, so that a change
+ * that adds, drops or reorders APDUs makes the replay fail.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _WIN32	/* recorded timings are replayed with nanosleep() */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "internal.h"
+
+struct replay_apdu {
+	unsigned long usec;
+	u8 *command;
+	size_t command_len;
+	u8 *response;
+	size_t response_len;
+};
+
+/* private data structures */
+struct driver_data {
+	struct replay_apdu *apdus;
+	size_t count, allocated, next;
+	unsigned int protocol;
+	int timing;
+	int presence_reported;
+};
+
+static struct sc_reader_operations replay_ops;
+
+static struct sc_reader_driver replay_reader_driver = {
+	"Replay reader",
+	"replay",
+	&replay_ops,
+	NULL
+};
+
+static void replay_free(struct driver_data *data)
+{
+	size_t i;
+
+	for (i = 0; i < data->count; i++) {
+		free(data->apdus[i].command);
+		free(data->apdus[i].response);
+	}
+	free(data->apdus);
+	free(data);
+}
+
+static int replay_parse_hex(const char *hex, u8 **out, size_t *outlen)
+{
+	*outlen = strlen(hex) / 2 + 1;
+	*out = malloc(*outlen);
+	if (*out == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	return sc_hex_to_bin(hex, *out, outlen);
+}
+
+static int replay_parse_apdu(struct driver_data *data, char *line)
+{
+	struct replay_apdu *apdu;
+	char *command, *response;
+	int r;
+
+	command = strchr(line, ' ');
+	response = command ? strchr(command + 1, ' ') : NULL;
+	if (response == NULL)
+		return SC_ERROR_INVALID_DATA;
+	*command++ = '\0';
+	*response++ = '\0';
+
+	if (data->count == data->allocated) {
+		size_t allocated = data->allocated ? 2 * data->allocated : 64;
+		struct replay_apdu *apdus;
+
+		apdus = realloc(data->apdus, allocated * sizeof(*apdus));
+		if (apdus == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		data->apdus = apdus;
+		data->allocated = allocated;
+	}
+	apdu = &data->apdus[data->count];
+	memset(apdu, 0, sizeof(*apdu));
+	data->count++;
+
+	apdu->usec = strtoul(line, NULL, 10);
+	r = replay_parse_hex(command, &apdu->command, &apdu->command_len);
+	if (r == SC_SUCCESS)
+		r = replay_parse_hex(response, &apdu->response, &apdu->response_len);
+	if (r == SC_SUCCESS && (apdu->command_len < 4 || apdu->response_len < 2))
+		r = SC_ERROR_INVALID_DATA;
+	return r;
+}
+
+static int replay_parse_atr(sc_reader_t *reader, struct driver_data *data, char *line)
+{
+	char *proto;
+
+	proto = strchr(line, ' ');
+	if (proto != NULL)
+		*proto++ = '\0';
+	if (proto == NULL || strcmp(proto, "T1") == 0)
+		data->protocol = SC_PROTO_T1;
+	else if (strcmp(proto, "T0") == 0)
+		data->protocol = SC_PROTO_T0;
+	else if (strcmp(proto, "RAW") == 0)
+		data->protocol = SC_PROTO_RAW;
+	else
+		return SC_ERROR_INVALID_DATA;
+	reader->atr.len = sizeof(reader->atr.value);
+	return sc_hex_to_bin(line, reader->atr.value, &reader->atr.len);
+}
+
+static int replay_load(sc_context_t *ctx, sc_reader_t *reader,
+		struct driver_data *data, const char *transcript)
+{
+	FILE *f;
+	char *text = NULL, *line, *next;
+	size_t len = 0, size = 0, n;
+	int r = SC_SUCCESS;
+
+	f = fopen(transcript, "r");
+	if (f == NULL) {
+		sc_log(ctx, "cannot open APDU transcript %s: %s", transcript, strerror(errno));
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+	do {
+		if (size - len < 4096) {
+			char *p = realloc(text, size ? 2 * size : 65536);
+
+			if (p == NULL) {
+				r = SC_ERROR_OUT_OF_MEMORY;
+				goto out;
+			}
+			text = p;
+			size = size ? 2 * size : 65536;
+		}
+		n = fread(text + len, 1, size - len - 1, f);
+		len += n;
+	} while (n > 0);
+	text[len] = '\0';
+
+	for (line = text; line != NULL && r == SC_SUCCESS; line = next) {
+		next = strchr(line, '\n');
+		if (next != NULL)
+			*next++ = '\0';
+		line[strcspn(line, "\r")] = '\0';
+		if (*line == '\0' || *line == '#')
+			continue;
+		if (strncmp(line, "atr ", 4) == 0) {
+			/* the first card is replayed */
+			if (reader->atr.len == 0)
+				r = replay_parse_atr(reader, data, line + 4);
+			continue;
+		}
+		r = replay_parse_apdu(data, line);
+		if (r != SC_SUCCESS)
+			sc_log(ctx, "invalid transcript line %u", (unsigned int) data->count);
+	}
+	if (r == SC_SUCCESS && reader->atr.len == 0) {
+		sc_log(ctx, "transcript has no ATR");
+		r = SC_ERROR_INVALID_DATA;
+	}
+out:
+	fclose(f);
+	free(text);
+	return r;
+}
+
+static int replay_reader_init(sc_context_t *ctx)
+{
+	scconf_block *conf_block;
+	const char *transcript = NULL;
+	struct driver_data *data;
+	sc_reader_t *reader;
+	int r;
+
+	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_VERBOSE);
+
+	conf_block = sc_get_conf_block(ctx, "reader_driver", "replay", 1);
+	if (conf_block)
+		transcript = scconf_get_str(conf_block, "transcript", NULL);
+	if (transcript == NULL)
+		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+
+	reader = calloc(1, sizeof(*reader));
+	data = calloc(1, sizeof(*data));
+	if (reader == NULL || data == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto err;
+	}
+	data->timing = scconf_get_bool(conf_block, "timing", 0);
+
+	r = replay_load(ctx, reader, data, transcript);
+	if (r < 0)
+		goto err;
+
+	reader->driver = &replay_reader_driver;
+	reader->ops = &replay_ops;
+	reader->drv_data = data;
+	reader->supported_protocols = data->protocol;
+	reader->name = strdup("Replay reader");
+	if (reader->name == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto err;
+	}
+	r = _sc_add_reader(ctx, reader);
+	if (r < 0)
+		goto err;
+
+	sc_log(ctx, "transcript %s, %u APDUs", transcript, (unsigned int) data->count);
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+err:
+	if (data != NULL)
+		replay_free(data);
+	if (reader != NULL) {
+		free(reader->name);
+		free(reader);
+	}
+	LOG_FUNC_RETURN(ctx, r);
+}
+
+static int replay_reader_finish(sc_context_t *ctx)
+{
+	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_VERBOSE);
+	return SC_SUCCESS;
+}
+
+static int replay_reader_release(sc_reader_t *reader)
+{
+	struct driver_data *data = (struct driver_data *) reader->drv_data;
+
+	SC_FUNC_CALLED(reader->ctx, SC_LOG_DEBUG_VERBOSE);
+	if (data) {
+		sc_log(reader->ctx, "replayed %u of %u transcript APDUs",
+				(unsigned int) data->next, (unsigned int) data->count);
+		replay_free(data);
+		reader->drv_data = NULL;
+	}
+	return SC_SUCCESS;
+}
+
+static int replay_reader_detect_card_presence(sc_reader_t *reader)
+{
+	struct driver_data *data = (struct driver_data *) reader->drv_data;
+
+	reader->flags = SC_READER_CARD_PRESENT;
+	if (!data->presence_reported)
+		reader->flags |= SC_READER_CARD_CHANGED;
+	data->presence_reported = 1;
+	return reader->flags;
+}
+
+static int replay_reader_connect(sc_reader_t *reader)
+{
+	struct driver_data *data = (struct driver_data *) reader->drv_data;
+
+	reader->active_protocol = data->protocol;
+	return SC_SUCCESS;
+}
+
+static int replay_reader_disconnect(sc_reader_t *reader)
+{
+	return SC_SUCCESS;
+}
+
+static int replay_reader_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
+{
+	struct driver_data *data = (struct driver_data *) reader->drv_data;
+	struct replay_apdu *recorded;
+	size_t ssize;
+	u8 *sbuf = NULL;
+	int r;
+
+	/* encode and log the APDU */
+	r = sc_apdu_get_octets(reader->ctx, apdu, &sbuf, &ssize, SC_PROTO_RAW);
+	if (r != SC_SUCCESS)
+		goto out;
+	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, sbuf, ssize, 1);
+
+	if (data->next == data->count) {
+		sc_log(reader->ctx, "APDU %u is not in the transcript", (unsigned int) data->next + 1);
+		r = SC_ERROR_TRANSMIT_FAILED;
+		goto out;
+	}
+	recorded = &data->apdus[data->next];
+	if (recorded->command_len != ssize || memcmp(recorded->command, sbuf, ssize) != 0) {
+		sc_log(reader->ctx, "APDU %u differs from the transcript, expected %s",
+				(unsigned int) data->next + 1,
+				sc_dump_hex(recorded->command, recorded->command_len));
+		r = SC_ERROR_TRANSMIT_FAILED;
+		goto out;
+	}
+	data->next++;
+
+	if (data->timing && recorded->usec > 0) {
+		struct timespec ts;
+
+		ts.tv_sec = recorded->usec / 1000000;
+		ts.tv_nsec = (recorded->usec % 1000000) * 1000;
+		while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+			;
+	}
+
+	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, recorded->response, recorded->response_len, 0);
+	/* set response */
+	r = sc_apdu_set_resp(reader->ctx, apdu, recorded->response, recorded->response_len);
+out:
+	if (sbuf != NULL) {
+		sc_mem_clear(sbuf, ssize);
+		free(sbuf);
+	}
+	return r;
+}
+
+struct sc_reader_driver *sc_get_replay_driver(void)
+{
+	replay_ops.init = replay_reader_init;
+	replay_ops.finish = replay_reader_finish;
+	replay_ops.detect_readers = NULL;
+	replay_ops.release = replay_reader_release;
+	replay_ops.detect_card_presence = replay_reader_detect_card_presence;
+	replay_ops.connect = replay_reader_connect;
+	replay_ops.disconnect = replay_reader_disconnect;
+	replay_ops.transmit = replay_reader_transmit;
+	replay_ops.lock = NULL;
+	replay_ops.unlock = NULL;
+	replay_ops.use_reader = NULL;
+
+	return &replay_reader_driver;
+}
+
+#endif	/* _WIN32 */
@@ -0,0 +1,1188 @@
+/*
+ * reader-virtual.c: reader driver emulating an ISO 7816-4 card
+ *
+ * The card is loaded from an image directory:
+ *
+ *   atr		the ATR in hex (optional)
+ *   pins		one PIN per line: <reference in hex> <value> [<tries>]
+ *   3F00/		the MF
+ *
+ * Inside a DF every entry named by a file identifier in hex is a file:
+ * a directory is a DF, a regular file a transparent EF, "<FID>.rec"
+ * a linear variable EF holding one record in hex per line, and
+ * "<FID>.pem" a private key whose key reference is the low byte of
+ * the file identifier. A file named "aid" holds the DF name in hex.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _WIN32	/* the image is read with POSIX directory functions */
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifdef ENABLE_OPENSSL
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rand.h>
+#include <openssl/rsa.h>
+#endif
+
+#include "internal.h"
+#include "asn1.h"
+#include "iso7816.h"
+
+#define VR_MAX_PINS		8
+#define VR_DEFAULT_TRIES	3
+#define VR_MAX_FILE_SIZE	0x10000
+
+/* ATR of a T=1 card without historical bytes */
+static const u8 vr_default_atr[] = { 0x3B, 0x80, 0x80, 0x01, 0x01 };
+
+enum {
+	VR_DF,
+	VR_EF,
+	VR_EF_RECORD,
+	VR_KEY
+};
+
+struct vr_file {
+	unsigned int id;
+	int type;
+	u8 name[SC_MAX_AID_SIZE];
+	size_t namelen;
+
+	u8 *data;
+	size_t len;
+	/* offsets of the records in data, followed by the end offset */
+	size_t *records;
+	size_t record_count;
+#ifdef ENABLE_OPENSSL
+	EVP_PKEY *key;
+#endif
+
+	struct vr_file *parent, *child, *next;
+};
+
+struct vr_pin {
+	unsigned int ref;
+	u8 value[SC_MAX_PIN_SIZE];
+	size_t len;
+	int tries, tries_left;
+	int verified;
+};
+
+/* private data structures */
+struct driver_data {
+	struct vr_file *mf;
+	struct vr_pin pins[VR_MAX_PINS];
+	size_t pin_count;
+	int latency;
+	int presence_reported;
+
+	/* card state, lost on reset */
+	struct vr_file *current_df, *current_ef;
+	struct vr_file *se_key;
+	u8 se_template;
+};
+
+static struct sc_reader_operations virtual_ops;
+
+static struct sc_reader_driver virtual_reader_driver = {
+	"Virtual reader",
+	"virtual",
+	&virtual_ops,
+	NULL
+};
+
+static void vr_free_file(struct vr_file *file)
+{
+	struct vr_file *child, *next;
+
+	if (file == NULL)
+		return;
+	for (child = file->child; child != NULL; child = next) {
+		next = child->next;
+		vr_free_file(child);
+	}
+	if (file->data != NULL) {
+		sc_mem_clear(file->data, file->len);
+		free(file->data);
+	}
+	free(file->records);
+#ifdef ENABLE_OPENSSL
+	if (file->key != NULL)
+		EVP_PKEY_free(file->key);
+#endif
+	free(file);
+}
+
+static void vr_reset_state(struct driver_data *data)
+{
+	size_t i;
+
+	data->current_df = data->mf;
+	data->current_ef = NULL;
+	data->se_key = NULL;
+	data->se_template = 0;
+	for (i = 0; i < data->pin_count; i++)
+		data->pins[i].verified = 0;
+}
+
+/* Read a whole file, NUL terminated so that text can be parsed in place */
+static int vr_read_file(const char *path, u8 **out, size_t *outlen)
+{
+	FILE *f;
+	u8 *buf;
+	size_t len;
+
+	f = fopen(path, "rb");
+	if (f == NULL)
+		return SC_ERROR_FILE_NOT_FOUND;
+	buf = malloc(VR_MAX_FILE_SIZE + 1);
+	if (buf == NULL) {
+		fclose(f);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	len = fread(buf, 1, VR_MAX_FILE_SIZE + 1, f);
+	if (ferror(f) || len > VR_MAX_FILE_SIZE) {
+		fclose(f);
+		free(buf);
+		return SC_ERROR_FILE_TOO_SMALL;
+	}
+	fclose(f);
+	buf[len] = '\0';
+	*out = buf;
+	*outlen = len;
+	return SC_SUCCESS;
+}
+
+/* Convert one line of hex text, skipping surrounding white space */
+static int vr_parse_hex(char *line, u8 *out, size_t *outlen)
+{
+	char *end;
+
+	while (*line == ' ' || *line == '\t')
+		line++;
+	end = line + strlen(line);
+	while (end > line && strchr(" \t\r\n", end[-1]) != NULL)
+		*--end = '\0';
+	if (*line == '\0') {
+		*outlen = 0;
+		return SC_SUCCESS;
+	}
+	return sc_hex_to_bin(line, out, outlen);
+}
+
+static int vr_load_records(struct vr_file *file, const char *path)
+{
+	u8 *text, *data;
+	char *line, *next;
+	size_t len, used = 0, count = 0, *records;
+	int r;
+
+	r = vr_read_file(path, &text, &len);
+	if (r < 0)
+		return r;
+	data = malloc(len / 2 + 1);
+	/* every record takes at least three characters */
+	records = malloc((len / 3 + 2) * sizeof(*records));
+	if (data == NULL || records == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto err;
+	}
+	for (line = (char *) text; line != NULL; line = next) {
+		size_t reclen = len / 2 + 1 - used;
+
+		next = strchr(line, '\n');
+		if (next != NULL)
+			*next++ = '\0';
+		r = vr_parse_hex(line, data + used, &reclen);
+		if (r < 0)
+			goto err;
+		if (reclen == 0)
+			continue;
+		if (reclen > 255) {
+			r = SC_ERROR_INVALID_DATA;
+			goto err;
+		}
+		records[count++] = used;
+		used += reclen;
+	}
+	records[count] = used;
+	free(text);
+	file->data = data;
+	file->len = used;
+	file->records = records;
+	file->record_count = count;
+	return SC_SUCCESS;
+err:
+	free(text);
+	free(data);
+	free(records);
+	return r;
+}
+
+#ifdef ENABLE_OPENSSL
+static int vr_load_key(struct vr_file *file, const char *path)
+{
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (f == NULL)
+		return SC_ERROR_FILE_NOT_FOUND;
+	file->key = PEM_read_PrivateKey(f, NULL, NULL, NULL);
+	fclose(f);
+	if (file->key == NULL)
+		return SC_ERROR_INVALID_DATA;
+	return SC_SUCCESS;
+}
+#endif
+
+/* Parse "<4 hex digits><suffix>" */
+static int vr_parse_fid(const char *name, unsigned int *id, const char **suffix)
+{
+	unsigned int value = 0;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		char c = name[i];
+
+		if ('0' <= c && c <= '9')
+			value = (value << 4) | (c - '0');
+		else if ('a' <= c && c <= 'f')
+			value = (value << 4) | (c - 'a' + 10);
+		else if ('A' <= c && c <= 'F')
+			value = (value << 4) | (c - 'A' + 10);
+		else
+			return -1;
+	}
+	*id = value;
+	*suffix = name + 4;
+	return 0;
+}
+
+static int vr_load_df(sc_context_t *ctx, struct vr_file *df, const char *dir)
+{
+	DIR *d;
+	struct dirent *de;
+	int r = SC_SUCCESS;
+
+	d = opendir(dir);
+	if (d == NULL) {
+		sc_log(ctx, "cannot open image directory %s: %s", dir, strerror(errno));
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+	while (r >= 0 && (de = readdir(d)) != NULL) {
+		char path[PATH_MAX];
+		struct stat st;
+		struct vr_file *file;
+		const char *suffix;
+		unsigned int id;
+
+		if (de->d_name[0] == '.')
+			continue;
+		if ((size_t) snprintf(path, sizeof(path), "%s/%s", dir, de->d_name) >= sizeof(path)
+				|| stat(path, &st) != 0)
+			continue;
+		if (strcmp(de->d_name, "aid") == 0) {
+			u8 *text;
+			size_t len;
+
+			r = vr_read_file(path, &text, &len);
+			if (r < 0)
+				break;
+			df->namelen = sizeof(df->name);
+			r = vr_parse_hex((char *) text, df->name, &df->namelen);
+			free(text);
+			continue;
+		}
+		if (vr_parse_fid(de->d_name, &id, &suffix) != 0) {
+			sc_log(ctx, "ignoring %s", path);
+			continue;
+		}
+
+		file = calloc(1, sizeof(*file));
+		if (file == NULL) {
+			r = SC_ERROR_OUT_OF_MEMORY;
+			break;
+		}
+		file->id = id;
+		file->parent = df;
+		if (S_ISDIR(st.st_mode) && *suffix == '\0') {
+			file->type = VR_DF;
+			r = vr_load_df(ctx, file, path);
+		} else if (S_ISREG(st.st_mode) && *suffix == '\0') {
+			file->type = VR_EF;
+			r = vr_read_file(path, &file->data, &file->len);
+		} else if (S_ISREG(st.st_mode) && strcmp(suffix, ".rec") == 0) {
+			file->type = VR_EF_RECORD;
+			r = vr_load_records(file, path);
+		} else if (S_ISREG(st.st_mode) && strcmp(suffix, ".pem") == 0) {
+#ifdef ENABLE_OPENSSL
+			file->type = VR_KEY;
+			r = vr_load_key(file, path);
+#else
+			sc_log(ctx, "ignoring %s: built without OpenSSL", path);
+			free(file);
+			continue;
+#endif
+		} else {
+			sc_log(ctx, "ignoring %s", path);
+			free(file);
+			continue;
+		}
+		if (r < 0)
+			sc_log(ctx, "cannot load %s: %s", path, sc_strerror(r));
+		file->next = df->child;
+		df->child = file;
+	}
+	closedir(d);
+	return r;
+}
+
+static int vr_load_pins(sc_context_t *ctx, struct driver_data *data, const char *path)
+{
+	u8 *text;
+	char *line, *next;
+	size_t len;
+	int r;
+
+	r = vr_read_file(path, &text, &len);
+	if (r == SC_ERROR_FILE_NOT_FOUND)
+		return SC_SUCCESS;
+	if (r < 0)
+		return r;
+	for (line = (char *) text; line != NULL; line = next) {
+		struct vr_pin pin;
+		char value[SC_MAX_PIN_SIZE + 1];
+		int n;
+
+		next = strchr(line, '\n');
+		if (next != NULL)
+			*next++ = '\0';
+		memset(&pin, 0, sizeof(pin));
+		pin.tries = VR_DEFAULT_TRIES;
+		n = sscanf(line, "%x %256s %d", &pin.ref, value, &pin.tries);
+		if (n <= 0)
+			continue;
+		if (n < 2 || pin.tries <= 0) {
+			sc_log(ctx, "invalid PIN entry '%s'", line);
+			r = SC_ERROR_INVALID_DATA;
+			break;
+		}
+		if (data->pin_count == VR_MAX_PINS) {
+			sc_log(ctx, "more than %d PINs in %s", VR_MAX_PINS, path);
+			r = SC_ERROR_TOO_MANY_OBJECTS;
+			break;
+		}
+		pin.len = strlen(value);
+		memcpy(pin.value, value, pin.len);
+		pin.tries_left = pin.tries;
+		data->pins[data->pin_count++] = pin;
+		sc_mem_clear(&pin, sizeof(pin));
+		sc_mem_clear(value, sizeof(value));
+	}
+	sc_mem_clear(text, len);
+	free(text);
+	return r;
+}
+
+static int vr_load_image(sc_context_t *ctx, sc_reader_t *reader,
+		struct driver_data *data, const char *image)
+{
+	char path[PATH_MAX];
+	u8 *text;
+	size_t len;
+	int r;
+
+	snprintf(path, sizeof(path), "%s/atr", image);
+	r = vr_read_file(path, &text, &len);
+	if (r == SC_SUCCESS) {
+		reader->atr.len = sizeof(reader->atr.value);
+		r = vr_parse_hex((char *) text, reader->atr.value, &reader->atr.len);
+		free(text);
+		if (r < 0)
+			return r;
+	} else {
+		memcpy(reader->atr.value, vr_default_atr, sizeof(vr_default_atr));
+		reader->atr.len = sizeof(vr_default_atr);
+	}
+
+	snprintf(path, sizeof(path), "%s/pins", image);
+	r = vr_load_pins(ctx, data, path);
+	if (r < 0)
+		return r;
+
+	data->mf = calloc(1, sizeof(*data->mf));
+	if (data->mf == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	data->mf->id = 0x3F00;
+	data->mf->type = VR_DF;
+	snprintf(path, sizeof(path), "%s/3F00", image);
+	return vr_load_df(ctx, data->mf, path);
+}
+
+/*
+ * File system
+ */
+static struct vr_file *vr_find_child(struct vr_file *df, unsigned int id)
+{
+	struct vr_file *file;
+
+	for (file = df->child; file != NULL; file = file->next)
+		if (file->id == id)
+			return file;
+	return NULL;
+}
+
+/* SELECT with P1=00 may name the current DF, a child, the parent or a sibling */
+static struct vr_file *vr_find_near(struct vr_file *df, unsigned int id)
+{
+	struct vr_file *file;
+
+	if (df->id == id)
+		return df;
+	if ((file = vr_find_child(df, id)) != NULL)
+		return file;
+	if (df->parent == NULL)
+		return NULL;
+	if (df->parent->id == id)
+		return df->parent;
+	return vr_find_child(df->parent, id);
+}
+
+static struct vr_file *vr_find_name(struct vr_file *df, const u8 *name, size_t len)
+{
+	struct vr_file *file, *found;
+
+	if (len > 0 && df->namelen >= len && memcmp(df->name, name, len) == 0)
+		return df;
+	for (file = df->child; file != NULL; file = file->next)
+		if (file->type == VR_DF && (found = vr_find_name(file, name, len)) != NULL)
+			return found;
+	return NULL;
+}
+
+static struct vr_file *vr_find_key(struct vr_file *df, unsigned int ref)
+{
+	struct vr_file *file, *found;
+
+	for (file = df->child; file != NULL; file = file->next) {
+		if (file->type == VR_KEY && (file->id & 0xFF) == ref)
+			return file;
+		if (file->type == VR_DF && (found = vr_find_key(file, ref)) != NULL)
+			return found;
+	}
+	return NULL;
+}
+
+/* A path starts at the given DF unless it starts with the MF */
+static struct vr_file *vr_find_path(struct driver_data *data, struct vr_file *df,
+		const u8 *path, size_t len)
+{
+	struct vr_file *file = df;
+	size_t i;
+
+	if (len == 0 || len % 2)
+		return NULL;
+	for (i = 0; file != NULL && i < len; i += 2) {
+		unsigned int id = (path[i] << 8) | path[i + 1];
+
+		if (i == 0 && id == 0x3F00)
+			file = data->mf;
+		else if (file->type != VR_DF)
+			file = NULL;
+		else
+			file = vr_find_child(file, id);
+	}
+	return file;
+}
+
+static size_t vr_encode_fcp(const struct vr_file *file, u8 tag, u8 *out)
+{
+	u8 *p = out + 2;
+	size_t maxrec = 0, i;
+
+	*p++ = 0x83;
+	*p++ = 2;
+	*p++ = file->id >> 8;
+	*p++ = file->id & 0xFF;
+	switch (file->type) {
+	case VR_DF:
+		*p++ = 0x82;
+		*p++ = 1;
+		*p++ = 0x38;
+		if (file->namelen > 0) {
+			*p++ = 0x84;
+			*p++ = file->namelen;
+			memcpy(p, file->name, file->namelen);
+			p += file->namelen;
+		}
+		break;
+	case VR_EF_RECORD:
+		for (i = 0; i < file->record_count; i++)
+			if (file->records[i + 1] - file->records[i] > maxrec)
+				maxrec = file->records[i + 1] - file->records[i];
+		*p++ = 0x82;
+		*p++ = 5;
+		*p++ = 0x04;
+		*p++ = 0x21;
+		*p++ = 0;
+		*p++ = maxrec;
+		*p++ = file->record_count;
+		/* fall through */
+	default:
+		/* the size is a signed integer */
+		*p++ = 0x80;
+		if (file->len >= 0x8000) {
+			*p++ = 3;
+			*p++ = 0;
+		} else {
+			*p++ = 2;
+		}
+		*p++ = (file->len >> 8) & 0xFF;
+		*p++ = file->len & 0xFF;
+		if (file->type == VR_EF) {
+			*p++ = 0x82;
+			*p++ = 1;
+			*p++ = 0x01;
+		} else if (file->type == VR_KEY) {
+			*p++ = 0x82;
+			*p++ = 1;
+			*p++ = 0x09;
+		}
+		break;
+	}
+	*p++ = 0x8A;
+	*p++ = 1;
+	*p++ = 0x05;
+	out[0] = tag;
+	out[1] = p - out - 2;
+	return p - out;
+}
+
+/*
+ * Commands. Each returns the status word and on success sets *outlen
+ * to the length of the response data, which may not exceed its
+ * initial value.
+ */
+static unsigned int vr_select(struct driver_data *data, const sc_apdu_t *apdu,
+		u8 *out, size_t *outlen)
+{
+	struct vr_file *file = NULL, *df = data->current_df;
+	const u8 *p = apdu->data;
+	size_t n = apdu->datalen, len;
+	u8 fcp[64 + SC_MAX_AID_SIZE];
+
+	switch (apdu->p1) {
+	case 0x00:
+		if (n == 0 || (n == 2 && p[0] == 0x3F && p[1] == 0x00))
+			file = data->mf;
+		else if (n == 2)
+			file = vr_find_near(df, (p[0] << 8) | p[1]);
+		break;
+	case 0x01:
+	case 0x02:
+		if (n == 2)
+			file = vr_find_child(df, (p[0] << 8) | p[1]);
+		if (file != NULL && (file->type == VR_DF) != (apdu->p1 == 0x01))
+			file = NULL;
+		break;
+	case 0x03:
+		file = df->parent;
+		break;
+	case 0x04:
+		file = vr_find_name(data->mf, p, n);
+		break;
+	case 0x08:
+	case 0x09:
+		if (n == 0 || n % 2)
+			return 0x6A87;
+		file = vr_find_path(data, apdu->p1 == 0x08 ? data->mf : df, p, n);
+		break;
+	default:
+		return 0x6A86;
+	}
+	if (file == NULL)
+		return 0x6A82;
+
+	if (file->type == VR_DF) {
+		data->current_df = file;
+		data->current_ef = NULL;
+	} else {
+		data->current_df = file->parent;
+		data->current_ef = file;
+	}
+	if ((apdu->p2 & 0x0C) == 0x0C) {
+		*outlen = 0;
+		return 0x9000;
+	}
+	len = vr_encode_fcp(file, (apdu->p2 & 0x0C) == 0x04 ? ISO7816_TAG_FCP : ISO7816_TAG_FCI, fcp);
+	if (len > *outlen)
+		len = *outlen;
+	memcpy(out, fcp, len);
+	*outlen = len;
+	return 0x9000;
+}
+
+static unsigned int vr_read_binary(struct driver_data *data, const sc_apdu_t *apdu,
+		u8 *out, size_t *outlen)
+{
+	struct vr_file *ef = data->current_ef;
+	size_t offset = ((apdu->p1 & 0x7F) << 8) | apdu->p2, count = *outlen;
+
+	if (apdu->p1 & 0x80)
+		return 0x6A81;
+	if (ef == NULL)
+		return 0x6986;
+	if (ef->type != VR_EF)
+		return 0x6981;
+	if (offset >= ef->len)
+		return 0x6B00;
+	if (count > ef->len - offset)
+		count = ef->len - offset;
+	memcpy(out, ef->data + offset, count);
+	*outlen = count;
+	return count < apdu->le ? 0x6282 : 0x9000;
+}
+
+static unsigned int vr_update_binary(struct driver_data *data, const sc_apdu_t *apdu)
+{
+	struct vr_file *ef = data->current_ef;
+	size_t offset = ((apdu->p1 & 0x7F) << 8) | apdu->p2;
+
+	if (apdu->p1 & 0x80)
+		return 0x6A81;
+	if (ef == NULL)
+		return 0x6986;
+	if (ef->type != VR_EF)
+		return 0x6981;
+	if (offset > ef->len || apdu->datalen > ef->len - offset)
+		return 0x6A84;
+	memcpy(ef->data + offset, apdu->data, apdu->datalen);
+	return 0x9000;
+}
+
+static unsigned int vr_read_record(struct driver_data *data, const sc_apdu_t *apdu,
+		u8 *out, size_t *outlen)
+{
+	struct vr_file *ef = data->current_ef;
+	size_t len;
+
+	if (apdu->p2 != 0x04)
+		return 0x6A81;
+	if (ef == NULL)
+		return 0x6986;
+	if (ef->type != VR_EF_RECORD)
+		return 0x6981;
+	if (apdu->p1 == 0 || apdu->p1 > ef->record_count)
+		return 0x6A83;
+	len = ef->records[apdu->p1] - ef->records[apdu->p1 - 1];
+	if (len > *outlen)
+		len = *outlen;
+	memcpy(out, ef->data + ef->records[apdu->p1 - 1], len);
+	*outlen = len;
+	return 0x9000;
+}
+
+static struct vr_pin *vr_find_pin(struct driver_data *data, unsigned int ref)
+{
+	size_t i;
+
+	for (i = 0; i < data->pin_count; i++)
+		if (data->pins[i].ref == ref)
+			return &data->pins[i];
+	return NULL;
+}
+
+/* Trailing 0xFF and 0x00 bytes are padding */
+static size_t vr_pin_length(const u8 *value, size_t len)
+{
+	while (len > 0 && (value[len - 1] == 0xFF || value[len - 1] == 0x00))
+		len--;
+	return len;
+}
+
+static int vr_pin_matches(const struct vr_pin *pin, const u8 *value, size_t len)
+{
+	return vr_pin_length(value, len) == pin->len && memcmp(value, pin->value, pin->len) == 0;
+}
+
+static unsigned int vr_pin_failed(struct vr_pin *pin)
+{
+	pin->verified = 0;
+	if (pin->tries_left > 0)
+		pin->tries_left--;
+	return pin->tries_left ? 0x63C0 | (pin->tries_left & 0x0F) : 0x6983;
+}
+
+static unsigned int vr_verify(struct driver_data *data, const sc_apdu_t *apdu)
+{
+	struct vr_pin *pin = vr_find_pin(data, apdu->p2);
+
+	if (pin == NULL)
+		return 0x6A88;
+	if (apdu->p1 == 0xFF) {
+		pin->verified = 0;
+		return 0x9000;
+	}
+	if (apdu->p1 != 0x00)
+		return 0x6A86;
+	if (pin->tries_left == 0)
+		return 0x6983;
+	if (apdu->datalen == 0)
+		return pin->verified ? 0x9000 : 0x63C0 | (pin->tries_left & 0x0F);
+	if (!vr_pin_matches(pin, apdu->data, apdu->datalen))
+		return vr_pin_failed(pin);
+	pin->tries_left = pin->tries;
+	pin->verified = 1;
+	return 0x9000;
+}
+
+static unsigned int vr_change_reference_data(struct driver_data *data, const sc_apdu_t *apdu)
+{
+	struct vr_pin *pin = vr_find_pin(data, apdu->p2);
+	size_t split, len;
+
+	if (pin == NULL)
+		return 0x6A88;
+	if (apdu->p1 != 0x00)
+		return 0x6A86;
+	if (pin->tries_left == 0)
+		return 0x6983;
+	/* the old PIN is sent either as is or padded like the new one */
+	if (apdu->datalen > pin->len && vr_pin_matches(pin, apdu->data, pin->len))
+		split = pin->len;
+	else if (apdu->datalen % 2 == 0 && vr_pin_matches(pin, apdu->data, apdu->datalen / 2))
+		split = apdu->datalen / 2;
+	else
+		return vr_pin_failed(pin);
+	len = vr_pin_length(apdu->data + split, apdu->datalen - split);
+	if (len == 0)
+		return 0x6A80;
+	memcpy(pin->value, apdu->data + split, len);
+	pin->len = len;
+	pin->tries_left = pin->tries;
+	pin->verified = 1;
+	return 0x9000;
+}
+
+static unsigned int vr_get_challenge(u8 *out, size_t *outlen)
+{
+	size_t i;
+
+	if (*outlen == 0)
+		return 0x6700;
+#ifdef ENABLE_OPENSSL
+	if (RAND_bytes(out, *outlen) == 1)
+		return 0x9000;
+#endif
+	for (i = 0; i < *outlen; i++)
+		out[i] = rand() & 0xFF;
+	return 0x9000;
+}
+
+static unsigned int vr_manage_security_env(struct driver_data *data, const sc_apdu_t *apdu)
+{
+	const u8 *p = apdu->data, *end = apdu->data + apdu->datalen;
+	struct vr_file *key = NULL;
+
+	if (apdu->p1 == 0xF3) {
+		data->se_key = NULL;
+		data->se_template = 0;
+		return 0x9000;
+	}
+	if (!(apdu->p1 & 0x01))
+		return 0x6A86;
+	if (apdu->p2 != 0xA4 && apdu->p2 != 0xB6 && apdu->p2 != 0xB8)
+		return 0x6A86;
+	while (end - p >= 2 && p[1] <= end - p - 2) {
+		switch (p[0]) {
+		case 0x81:
+			key = vr_find_path(data, data->current_df, p + 2, p[1]);
+			break;
+		case 0x83:
+		case 0x84:
+			if (p[1] == 1)
+				key = vr_find_key(data->mf, p[2]);
+			break;
+		}
+		p += 2 + p[1];
+	}
+	if (p != end)
+		return 0x6A80;
+	if (key == NULL || key->type != VR_KEY)
+		return 0x6A88;
+	data->se_key = key;
+	data->se_template = apdu->p2;
+	return 0x9000;
+}
+
+/* Private key operations need a verified PIN if the card has any */
+static int vr_key_usable(struct driver_data *data)
+{
+	size_t i;
+
+	for (i = 0; i < data->pin_count; i++)
+		if (data->pins[i].verified)
+			return 1;
+	return data->pin_count == 0;
+}
+
+#ifdef ENABLE_OPENSSL
+static unsigned int vr_sign(sc_context_t *ctx, EVP_PKEY *pkey,
+		const u8 *in, size_t inlen, u8 *out, size_t *outlen)
+{
+	RSA *rsa;
+	int r, padding;
+
+	rsa = EVP_PKEY_get1_RSA(pkey);
+	if (rsa != NULL) {
+		if ((size_t) RSA_size(rsa) > *outlen) {
+			RSA_free(rsa);
+			return 0x6700;
+		}
+		/* a full length block is signed as is */
+		padding = inlen == (size_t) RSA_size(rsa) ? RSA_NO_PADDING : RSA_PKCS1_PADDING;
+		r = RSA_private_encrypt(inlen, in, out, rsa, padding);
+		RSA_free(rsa);
+		if (r <= 0)
+			return 0x6A80;
+		*outlen = r;
+		return 0x9000;
+	}
+#ifndef OPENSSL_NO_EC
+	{
+		EC_KEY *ec = EVP_PKEY_get1_EC_KEY(pkey);
+		unsigned int derlen;
+		size_t fieldlen;
+		u8 *der;
+
+		if (ec == NULL)
+			return 0x6981;
+		fieldlen = (EC_GROUP_get_degree(EC_KEY_get0_group(ec)) + 7) / 8;
+		der = malloc(ECDSA_size(ec));
+		if (der == NULL || 2 * fieldlen > *outlen
+				|| ECDSA_sign(0, in, inlen, der, &derlen, ec) != 1
+				|| sc_asn1_sig_value_sequence_to_rs(ctx, der, derlen, out, 2 * fieldlen) != SC_SUCCESS)
+			r = 0;
+		else
+			r = 1;
+		free(der);
+		EC_KEY_free(ec);
+		if (!r)
+			return 0x6A80;
+		*outlen = 2 * fieldlen;
+		return 0x9000;
+	}
+#else
+	return 0x6981;
+#endif
+}
+
+static unsigned int vr_decipher(EVP_PKEY *pkey, const u8 *in, size_t inlen,
+		u8 *out, size_t *outlen)
+{
+	RSA *rsa;
+	int r;
+
+	rsa = EVP_PKEY_get1_RSA(pkey);
+	if (rsa == NULL)
+		return 0x6981;
+	/* the first byte is the padding indicator */
+	if (inlen < 1 || in[0] != 0x00 || inlen - 1 != (size_t) RSA_size(rsa)
+			|| (size_t) RSA_size(rsa) > *outlen) {
+		RSA_free(rsa);
+		return 0x6700;
+	}
+	r = RSA_private_decrypt(inlen - 1, in + 1, out, rsa, RSA_NO_PADDING);
+	RSA_free(rsa);
+	if (r <= 0)
+		return 0x6A80;
+	*outlen = r;
+	return 0x9000;
+}
+#endif
+
+static unsigned int vr_key_operation(sc_context_t *ctx, struct driver_data *data,
+		const sc_apdu_t *apdu, u8 *out, size_t *outlen)
+{
+	u8 template;
+
+	if (apdu->ins == 0x88)
+		template = 0xA4;
+	else if (apdu->p1 == 0x9E && apdu->p2 == 0x9A)
+		template = 0xB6;
+	else if (apdu->p1 == 0x80 && apdu->p2 == 0x86)
+		template = 0xB8;
+	else
+		return 0x6A86;
+	if (data->se_key == NULL || data->se_template != template)
+		return 0x6985;
+	if (!vr_key_usable(data))
+		return 0x6982;
+#ifdef ENABLE_OPENSSL
+	if (template == 0xB8)
+		return vr_decipher(data->se_key->key, apdu->data, apdu->datalen, out, outlen);
+	return vr_sign(ctx, data->se_key->key, apdu->data, apdu->datalen, out, outlen);
+#else
+	return 0x6A81;
+#endif
+}
+
+static unsigned int vr_process(sc_context_t *ctx, struct driver_data *data,
+		const sc_apdu_t *apdu, u8 *out, size_t *outlen)
+{
+	unsigned int sw;
+
+	if ((apdu->cla & 0x0C) != 0) {
+		/* secure messaging */
+		sw = 0x6882;
+		goto out;
+	}
+	switch (apdu->ins) {
+	case 0xA4:
+		return vr_select(data, apdu, out, outlen);
+	case 0xB0:
+		sw = vr_read_binary(data, apdu, out, outlen);
+		break;
+	case 0xB2:
+		sw = vr_read_record(data, apdu, out, outlen);
+		break;
+	case 0x84:
+		sw = vr_get_challenge(out, outlen);
+		break;
+	case 0x2A:
+	case 0x88:
+		sw = vr_key_operation(ctx, data, apdu, out, outlen);
+		break;
+	case 0xD6:
+		*outlen = 0;
+		return vr_update_binary(data, apdu);
+	case 0x20:
+		*outlen = 0;
+		return vr_verify(data, apdu);
+	case 0x24:
+		*outlen = 0;
+		return vr_change_reference_data(data, apdu);
+	case 0x22:
+		*outlen = 0;
+		return vr_manage_security_env(data, apdu);
+	default:
+		sw = 0x6D00;
+		break;
+	}
+out:
+	if (sw != 0x9000 && sw != 0x6282)
+		*outlen = 0;
+	return sw;
+}
+
+/*
+ * Reader operations
+ */
+static int virtual_reader_init(sc_context_t *ctx)
+{
+	scconf_block *conf_block;
+	const char *image = NULL;
+	struct driver_data *data;
+	sc_reader_t *reader;
+	int r;
+
+	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_VERBOSE);
+
+	conf_block = sc_get_conf_block(ctx, "reader_driver", "virtual", 1);
+	if (conf_block)
+		image = scconf_get_str(conf_block, "image", NULL);
+	if (image == NULL)
+		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+
+	reader = calloc(1, sizeof(*reader));
+	data = calloc(1, sizeof(*data));
+	if (reader == NULL || data == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto err;
+	}
+	data->latency = scconf_get_int(conf_block, "latency", 0);
+
+	r = vr_load_image(ctx, reader, data, image);
+	if (r < 0) {
+		sc_log(ctx, "cannot load card image %s", image);
+		goto err;
+	}
+	vr_reset_state(data);
+
+	reader->driver = &virtual_reader_driver;
+	reader->ops = &virtual_ops;
+	reader->drv_data = data;
+	reader->supported_protocols = SC_PROTO_T1;
+	reader->name = strdup("Virtual reader");
+	if (reader->name == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto err;
+	}
+	r = _sc_add_reader(ctx, reader);
+	if (r < 0)
+		goto err;
+
+	sc_log(ctx, "card image %s, %d ms per APDU", image, data->latency);
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+err:
+	if (data != NULL) {
+		vr_free_file(data->mf);
+		sc_mem_clear(data, sizeof(*data));
+		free(data);
+	}
+	if (reader != NULL) {
+		free(reader->name);
+		free(reader);
+	}
+	LOG_FUNC_RETURN(ctx, r);
+}
+
+static int virtual_reader_finish(sc_context_t *ctx)
+{
+	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_VERBOSE);
+	return SC_SUCCESS;
+}
+
+static int virtual_reader_release(sc_reader_t *reader)
+{
+	struct driver_data *data = (struct driver_data *) reader->drv_data;
+
+	SC_FUNC_CALLED(reader->ctx, SC_LOG_DEBUG_VERBOSE);
+	if (data) {
+		vr_free_file(data->mf);
+		sc_mem_clear(data, sizeof(*data));
+		reader->drv_data = NULL;
+		free(data);
+	}
+	return SC_SUCCESS;
+}
+
+static int virtual_reader_detect_card_presence(sc_reader_t *reader)
+{
+	struct driver_data *data = (struct driver_data *) reader->drv_data;
+
+	reader->flags = SC_READER_CARD_PRESENT;
+	if (!data->presence_reported)
+		reader->flags |= SC_READER_CARD_CHANGED;
+	data->presence_reported = 1;
+	return reader->flags;
+}
+
+static int virtual_reader_connect(sc_reader_t *reader)
+{
+	struct driver_data *data = (struct driver_data *) reader->drv_data;
+
+	SC_FUNC_CALLED(reader->ctx, SC_LOG_DEBUG_VERBOSE);
+	vr_reset_state(data);
+	reader->active_protocol = SC_PROTO_T1;
+	return SC_SUCCESS;
+}
+
+static int virtual_reader_disconnect(sc_reader_t *reader)
+{
+	SC_FUNC_CALLED(reader->ctx, SC_LOG_DEBUG_VERBOSE);
+	vr_reset_state((struct driver_data *) reader->drv_data);
+	return SC_SUCCESS;
+}
+
+static int virtual_reader_reset(sc_reader_t *reader, int do_cold_reset)
+{
+	vr_reset_state((struct driver_data *) reader->drv_data);
+	return SC_SUCCESS;
+}
+
+static int virtual_reader_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
+{
+	struct driver_data *data = (struct driver_data *) reader->drv_data;
+	size_t ssize, rsize = 0;
+	u8 *sbuf = NULL, *rbuf = NULL;
+	unsigned int sw;
+	int r;
+
+	/* encode and log the APDU */
+	r = sc_apdu_get_octets(reader->ctx, apdu, &sbuf, &ssize, SC_PROTO_RAW);
+	if (r != SC_SUCCESS)
+		goto out;
+	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, sbuf, ssize, 1);
+
+	rbuf = malloc(SC_MAX_EXT_APDU_BUFFER_SIZE);
+	if (rbuf == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto out;
+	}
+	rsize = apdu->le < SC_MAX_EXT_APDU_BUFFER_SIZE - 2 ? apdu->le : SC_MAX_EXT_APDU_BUFFER_SIZE - 2;
+
+	if (data->latency > 0) {
+		struct timespec ts;
+
+		ts.tv_sec = data->latency / 1000;
+		ts.tv_nsec = (data->latency % 1000) * 1000000L;
+		while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+			;
+	}
+
+	sw = vr_process(reader->ctx, data, apdu, rbuf, &rsize);
+	rbuf[rsize++] = sw >> 8;
+	rbuf[rsize++] = sw & 0xFF;
+	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, rbuf, rsize, 0);
+	/* set response */
+	r = sc_apdu_set_resp(reader->ctx, apdu, rbuf, rsize);
+out:
+	if (sbuf != NULL) {
+		sc_mem_clear(sbuf, ssize);
+		free(sbuf);
+	}
+	if (rbuf != NULL) {
+		sc_mem_clear(rbuf, rsize);
+		free(rbuf);
+	}
+	return r;
+}
+
+struct sc_reader_driver *sc_get_virtual_driver(void)
+{
+	virtual_ops.init = virtual_reader_init;
+	virtual_ops.finish = virtual_reader_finish;
+	virtual_ops.detect_readers = NULL;
+	virtual_ops.release = virtual_reader_release;
+	virtual_ops.detect_card_presence = virtual_reader_detect_card_presence;
+	virtual_ops.connect = virtual_reader_connect;
+	virtual_ops.disconnect = virtual_reader_disconnect;
+	virtual_ops.transmit = virtual_reader_transmit;
+	virtual_ops.lock = NULL;
+	virtual_ops.unlock = NULL;
+	virtual_ops.reset = virtual_reader_reset;
+	virtual_ops.use_reader = NULL;
+
+	return &virtual_reader_driver;
+}
+
+#endif	/* _WIN32 */
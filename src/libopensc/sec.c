@@ -31,16 +31,81 @@
 
 #include "internal.h"
 
+/* Compares two security environments field by field, returns 1 if equal */
+static int sec_env_equal(const struct sc_security_env *a, const struct sc_security_env *b)
+{
+	const struct sc_path *pa = &a->file_ref, *pb = &b->file_ref;
+	int i;
+
+	if (a->flags != b->flags || a->operation != b->operation
+			|| a->algorithm != b->algorithm || a->algorithm_flags != b->algorithm_flags
+			|| a->algorithm_ref != b->algorithm_ref)
+		return 0;
+	if (a->key_ref_len != b->key_ref_len || a->key_ref_len > sizeof(a->key_ref)
+			|| memcmp(a->key_ref, b->key_ref, a->key_ref_len) != 0)
+		return 0;
+	if (pa->len != pb->len || pa->len > sizeof(pa->value)
+			|| memcmp(pa->value, pb->value, pa->len) != 0
+			|| pa->index != pb->index || pa->count != pb->count || pa->type != pb->type
+			|| pa->aid.len != pb->aid.len || pa->aid.len > sizeof(pa->aid.value)
+			|| memcmp(pa->aid.value, pb->aid.value, pa->aid.len) != 0)
+		return 0;
+	for (i = 0; i < SC_MAX_SUPPORTED_ALGORITHMS; i++) {
+		const struct sc_supported_algo_info *aa = &a->supported_algos[i];
+		const struct sc_supported_algo_info *ab = &b->supported_algos[i];
+
+		if (aa->reference != ab->reference || aa->mechanism != ab->mechanism
+				|| aa->operations != ab->operations || aa->algo_ref != ab->algo_ref
+				|| !sc_compare_oid(&aa->algo_id, &ab->algo_id))
+			return 0;
+	}
+	return 1;
+}
+
+/* Sets the cached security environment again after an operation failed
+ * with it, returns 1 if the operation is worth retrying.  Only errors
+ * that the card reports for a missing or lost environment qualify:
+ * "conditions of use not satisfied", "referenced data not found" and
+ * "referenced data not usable" */
+static int sec_env_retry(sc_card_t *card, int skipped, int r)
+{
+	struct sc_security_env env;
+
+	if (!skipped || card->ops->set_security_env == NULL)
+		return 0;
+	if (r != SC_ERROR_NOT_ALLOWED && r != SC_ERROR_DATA_OBJECT_NOT_FOUND
+			&& r != SC_ERROR_REF_DATA_NOT_USABLE)
+		return 0;
+	sc_log(card->ctx, "setting the security environment again");
+	env = card->cache.sec_env;
+	if (card->ops->set_security_env(card, &env, card->cache.sec_env_num) != SC_SUCCESS)
+		return 0;
+	return 1;
+}
+
+static void sec_env_not_kept(sc_card_t *card)
+{
+	sc_log(card->ctx, "card does not keep the security environment, not caching it");
+	card->cache.sec_env_not_kept = 1;
+}
+
 int sc_decipher(sc_card_t *card,
 		const u8 * crgram, size_t crgram_len, u8 * out, size_t outlen)
 {
-	int r;
+	int r, skipped;
 
 	assert(card != NULL && crgram != NULL && out != NULL);
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_NORMAL);
 	if (card->ops->decipher == NULL)
 		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_ERROR_NOT_SUPPORTED);
+	skipped = card->cache.sec_env_skipped;
+	card->cache.sec_env_skipped = 0;
 	r = card->ops->decipher(card, crgram, crgram_len, out, outlen);
+	if (r < 0 && sec_env_retry(card, skipped, r)) {
+		r = card->ops->decipher(card, crgram, crgram_len, out, outlen);
+		if (r >= 0)
+			sec_env_not_kept(card);
+	}
         SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
 }
 
@@ -48,13 +113,20 @@ int sc_compute_signature(sc_card_t *card,
 			 const u8 * data, size_t datalen,
 			 u8 * out, size_t outlen)
 {
-	int r;
+	int r, skipped;
 
 	assert(card != NULL);
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_NORMAL);
 	if (card->ops->compute_signature == NULL)
 		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_ERROR_NOT_SUPPORTED);
+	skipped = card->cache.sec_env_skipped;
+	card->cache.sec_env_skipped = 0;
 	r = card->ops->compute_signature(card, data, datalen, out, outlen);
+	if (r < 0 && sec_env_retry(card, skipped, r)) {
+		r = card->ops->compute_signature(card, data, datalen, out, outlen);
+		if (r >= 0)
+			sec_env_not_kept(card);
+	}
         SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
 }
 
@@ -68,7 +140,22 @@ int sc_set_security_env(sc_card_t *card,
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_NORMAL);
 	if (card->ops->set_security_env == NULL)
 		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_ERROR_NOT_SUPPORTED);
+	if (card->cache.sec_env_valid && card->cache.sec_env_num == se_num
+			&& sec_env_equal(&card->cache.sec_env, env)) {
+		sc_log(card->ctx, "security environment already set");
+		card->cache.sec_env_skipped = 1;
+		card->apdu_stats->sec_envs_skipped++;
+		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_SUCCESS);
+	}
+	card->cache.sec_env_skipped = 0;
 	r = card->ops->set_security_env(card, env, se_num);
+	/* remembered until the card is unlocked, see sc_invalidate_selection() */
+	if (r == SC_SUCCESS && card->ctx->enable_sec_env_cache && card->lock_count > 0
+			&& !card->cache.sec_env_not_kept) {
+		card->cache.sec_env = *env;
+		card->cache.sec_env_num = se_num;
+		card->cache.sec_env_valid = 1;
+	}
         SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
 }
 
@@ -80,6 +167,7 @@ int sc_restore_security_env(sc_card_t *card, int se_num)
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_NORMAL);
 	if (card->ops->restore_security_env == NULL)
 		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_ERROR_NOT_SUPPORTED);
+	card->cache.sec_env_valid = 0;
 	r = card->ops->restore_security_env(card, se_num);
 	SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
 }
@@ -103,6 +191,7 @@ int sc_logout(sc_card_t *card)
 {
 	if (card->ops->logout == NULL)
 		return SC_ERROR_NOT_SUPPORTED;
+	card->cache.sec_env_valid = 0;
 	return card->ops->logout(card);
 }
 
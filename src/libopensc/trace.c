@@ -0,0 +1,271 @@
+/*
+ * trace.c: binary APDU trace, see trace.h
+ *
+ * Writers claim a slot with an atomic increment and fill it in without
+ * taking any lock, so the trace can stay enabled in production.  A dump
+ * taken while another thread is filling a slot may contain that one
+ * record half written.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#include <process.h>
+#else
+#include <signal.h>
+#include <unistd.h>
+#endif
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#include "internal.h"
+#include "trace.h"
+
+#ifndef O_BINARY
+#define O_BINARY	0
+#endif
+
+struct sc_trace {
+	struct sc_trace_record *records;
+	unsigned long size;
+	volatile unsigned long next;	/* records written so far */
+	char *file;
+};
+
+#ifndef _WIN32
+/* the context dumped on SIGUSR2 */
+static struct sc_trace * volatile signal_trace = NULL;
+static struct sigaction signal_saved;
+#endif
+
+static uint64_t trace_now(void)
+{
+#if defined(_WIN32)
+	LARGE_INTEGER count, frequency;
+
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&frequency);
+	return (uint64_t) (count.QuadPart / frequency.QuadPart) * 1000000
+		+ (uint64_t) (count.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#elif defined(HAVE_GETTIMEOFDAY)
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+#else
+	return 0;
+#endif
+}
+
+unsigned long sc_trace_clock(void)
+{
+	return (unsigned long) trace_now();
+}
+
+static struct sc_trace_record *trace_claim(sc_context_t *ctx, sc_reader_t *reader,
+		unsigned int event)
+{
+	struct sc_trace *trace = ctx->trace;
+	struct sc_trace_record *record;
+	unsigned long n;
+
+	if (trace == NULL)
+		return NULL;
+#if defined(_WIN32)
+	n = (unsigned long) InterlockedIncrement((LONG volatile *) &trace->next) - 1;
+#elif defined(__GNUC__)
+	n = __sync_fetch_and_add(&trace->next, 1);
+#else
+	n = trace->next++;
+#endif
+	record = &trace->records[n % trace->size];
+	memset(record, 0, sizeof(*record));
+	record->time = trace_now();
+	record->event = event;
+	if (reader != NULL)
+		record->reader = list_locate(&ctx->readers, reader);
+	return record;
+}
+
+void sc_trace_event(sc_context_t *ctx, sc_reader_t *reader, unsigned int event,
+		int result, unsigned long usec)
+{
+	struct sc_trace_record *record = trace_claim(ctx, reader, event);
+
+	if (record != NULL) {
+		record->result = result;
+		record->duration = usec;
+	}
+}
+
+void sc_trace_apdu(sc_context_t *ctx, sc_reader_t *reader, const sc_apdu_t *apdu,
+		int result, unsigned long usec)
+{
+	struct sc_trace_record *record = trace_claim(ctx, reader, SC_TRACE_APDU);
+
+	if (record == NULL)
+		return;
+	record->result = result;
+	record->duration = usec;
+	record->cse = apdu->cse;
+	record->cla = apdu->cla;
+	record->ins = apdu->ins;
+	record->p1 = apdu->p1;
+	record->p2 = apdu->p2;
+	record->lc = apdu->lc;
+	record->le = apdu->le;
+	if (result == SC_SUCCESS) {
+		record->resplen = apdu->resplen;
+		record->sw1 = apdu->sw1;
+		record->sw2 = apdu->sw2;
+	}
+}
+
+/* Only uses calls that are safe in a signal handler */
+static int trace_write(struct sc_trace *trace, const char *file)
+{
+	struct sc_trace_header header;
+	unsigned long next = trace->next, first, end;
+	int fd, ok;
+
+	fd = open(file, O_WRONLY | O_CREAT | O_APPEND | O_BINARY, 0600);
+	if (fd < 0)
+		return SC_ERROR_FILE_NOT_FOUND;
+
+	first = next > trace->size ? next - trace->size : 0;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SC_TRACE_MAGIC, sizeof(header.magic));
+	header.version = SC_TRACE_VERSION;
+	header.byte_order = SC_TRACE_BYTE_ORDER;
+	header.record_size = sizeof(struct sc_trace_record);
+	header.count = next - first;
+	header.lost = first;
+	header.time = trace_now();
+	header.pid = getpid();
+	ok = write(fd, &header, sizeof(header)) == sizeof(header);
+
+	/* the ring in two pieces, oldest first */
+	while (ok && first < next) {
+		end = first - first % trace->size + trace->size;
+		if (end > next)
+			end = next;
+		ok = write(fd, &trace->records[first % trace->size],
+				(end - first) * sizeof(struct sc_trace_record))
+			== (int) ((end - first) * sizeof(struct sc_trace_record));
+		first = end;
+	}
+	close(fd);
+	return ok ? SC_SUCCESS : SC_ERROR_INTERNAL;
+}
+
+int sc_trace_dump(sc_context_t *ctx, const char *file)
+{
+	int r;
+
+	if (ctx->trace == NULL)
+		return SC_ERROR_NOT_SUPPORTED;
+	if (file == NULL)
+		file = ctx->trace->file;
+	if (file == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	r = trace_write(ctx->trace, file);
+	if (r != SC_SUCCESS)
+		sc_log(ctx, "cannot write the APDU trace to %s", file);
+	return r;
+}
+
+#ifndef _WIN32
+static void trace_signal_handler(int sig)
+{
+	struct sc_trace *trace = signal_trace;
+
+	if (trace != NULL)
+		trace_write(trace, trace->file);
+}
+#endif
+
+int sc_trace_create(sc_context_t *ctx, size_t size, const char *file, int on_signal)
+{
+	struct sc_trace *trace;
+
+	if (size == 0)
+		return SC_SUCCESS;
+	trace = calloc(1, sizeof(*trace));
+	if (trace == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	trace->size = size;
+	trace->records = calloc(size, sizeof(struct sc_trace_record));
+	if (file != NULL)
+		trace->file = strdup(file);
+	if (trace->records == NULL || (file != NULL && trace->file == NULL)) {
+		free(trace->records);
+		free(trace->file);
+		free(trace);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	ctx->trace = trace;
+
+#ifndef _WIN32
+	if (on_signal && trace->file != NULL && signal_trace == NULL) {
+		struct sigaction sa;
+
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = trace_signal_handler;
+		sa.sa_flags = SA_RESTART;
+		sigemptyset(&sa.sa_mask);
+		signal_trace = trace;
+		if (sigaction(SIGUSR2, &sa, &signal_saved) != 0)
+			signal_trace = NULL;
+	}
+#endif
+	return SC_SUCCESS;
+}
+
+void sc_trace_free(sc_context_t *ctx)
+{
+	struct sc_trace *trace = ctx->trace;
+
+	if (trace == NULL)
+		return;
+#ifndef _WIN32
+	if (signal_trace == trace) {
+		sigaction(SIGUSR2, &signal_saved, NULL);
+		signal_trace = NULL;
+	}
+#endif
+	/* dump at exit */
+	if (trace->file != NULL && trace->next > 0)
+		sc_trace_dump(ctx, NULL);
+	ctx->trace = NULL;
+	free(trace->records);
+	free(trace->file);
+	free(trace);
+}
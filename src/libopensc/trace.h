@@ -0,0 +1,74 @@
+/*
+ * trace.h: binary APDU trace
+ *
+ * Every context keeps its last APDUs and reader events in a ring of
+ * fixed-size records.  A dump is a struct sc_trace_header followed by
+ * the records, oldest first; dumps are appended to the trace file and
+ * decoded with opensc-trace.  Records are in host byte order and never
+ * contain APDU data.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _OPENSC_TRACE_H
+#define _OPENSC_TRACE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SC_TRACE_MAGIC		"OSCTRACE"
+#define SC_TRACE_VERSION	1
+#define SC_TRACE_BYTE_ORDER	0x01020304
+
+enum {
+	SC_TRACE_APDU = 1,
+	SC_TRACE_CONNECT,
+	SC_TRACE_DISCONNECT,
+	SC_TRACE_LOCK,		/* reader lock taken by the first sc_lock() */
+	SC_TRACE_UNLOCK,	/* reader lock released by the last sc_unlock() */
+	SC_TRACE_RESET
+};
+
+struct sc_trace_header {
+	char magic[8];			/* SC_TRACE_MAGIC */
+	uint32_t version;		/* SC_TRACE_VERSION */
+	uint32_t byte_order;		/* SC_TRACE_BYTE_ORDER */
+	uint32_t record_size;		/* sizeof(struct sc_trace_record) */
+	uint32_t count;			/* records following the header */
+	uint64_t lost;			/* older records overwritten in the ring */
+	uint64_t time;			/* clock at the time of the dump */
+	uint32_t pid;
+	uint32_t reserved;
+};
+
+struct sc_trace_record {
+	uint64_t time;			/* monotonic clock, microseconds */
+	uint32_t duration;		/* microseconds spent in the reader driver */
+	int32_t result;			/* SC_SUCCESS or an error code */
+	uint16_t event;			/* SC_TRACE_* */
+	uint16_t reader;		/* index in the context's reader list */
+	uint32_t lc, le, resplen;	/* as in struct sc_apdu */
+	uint8_t cse, cla, ins, p1, p2, sw1, sw2;
+	uint8_t reserved;
+};
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
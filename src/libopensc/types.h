@@ -343,12 +343,15 @@ typedef struct sc_serial_number {
  */
 #define SC_REMOTE_APDU_FLAG_NOT_FATAL		0x01
 #define SC_REMOTE_APDU_FLAG_RETURN_ANSWER	0x02
+/* status of an APDU that sc_transmit_apdus() did not send */
+#define SC_REMOTE_APDU_NOT_SENT			1
 struct sc_remote_apdu {
 	unsigned char sbuf[2*SC_MAX_APDU_BUFFER_SIZE];
 	unsigned char rbuf[2*SC_MAX_APDU_BUFFER_SIZE];
 	struct sc_apdu apdu;
 
 	unsigned flags;
+	int status;	/* set by sc_transmit_apdus() */
 
 	struct sc_remote_apdu *next;
 };
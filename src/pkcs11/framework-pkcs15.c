@@ -470,14 +470,10 @@ CK_RV C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo)
 	if (pInfo == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
-	rv = slot_get_token(slotID, &slot);
+	rv = sc_pkcs11_lock_slot(slotID, &slot);
 	if (rv != CKR_OK)   {
 		sc_log(context, "C_GetTokenInfo() get token: rv 0x%X", rv);
-		goto out;
+		return rv;
 	}
 
 	/* User PIN flags are cleared before re-calculation */
@@ -517,7 +513,7 @@ CK_RV C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo)
 	}
 	memcpy(pInfo, &slot->token_info, sizeof(CK_TOKEN_INFO));
 out:
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(slot);
 	sc_log(context, "C_GetTokenInfo(%lx) returns 0x%lX", slotID, rv);
 	return rv;
 }
@@ -555,30 +551,20 @@ __pkcs15_create_cert_object(struct pkcs15_fw_data *fw_data, struct sc_pkcs15_obj
 		struct pkcs15_any_object **cert_object)
 {
 	struct sc_pkcs15_cert_info *p15_info = NULL;
-	struct sc_pkcs15_cert *p15_cert = NULL;
 	struct pkcs15_cert_object *object = NULL;
 	struct pkcs15_pubkey_object *obj2 = NULL;
 	int rv;
 
 	p15_info = (struct sc_pkcs15_cert_info *) cert->data;
 
-	if (cert->flags & SC_PKCS15_CO_FLAG_PRIVATE)  {	/* is the cert private? */
-		p15_cert = NULL;			/* will read cert when needed */
-	}
-	else    {
-		rv = sc_pkcs15_read_certificate(fw_data->p15_card, p15_info, &p15_cert);
-		if (rv < 0)
-			return rv;
-	}
-
-	/* Certificate object */
+	/* Certificate object, the certificate is read when needed */
 	rv = __pkcs15_create_object(fw_data, (struct pkcs15_any_object **) &object,
 			cert, &pkcs15_cert_ops, sizeof(struct pkcs15_cert_object));
 	if (rv < 0)
 		return rv;
 
 	object->cert_info = p15_info;
-	object->cert_data = p15_cert;
+	object->cert_data = NULL;
 
 	/* Corresponding public key */
 	rv = public_key_created(fw_data, &p15_info->id, (struct pkcs15_any_object **) &obj2);
@@ -588,14 +574,6 @@ __pkcs15_create_cert_object(struct pkcs15_fw_data *fw_data, struct sc_pkcs15_obj
 	if (rv < 0)
 		return rv;
 
-	if (p15_cert) {
-		 /* make a copy of public key from the cert */
-		if (!obj2->pub_data)
-			rv = sc_pkcs15_pubkey_from_cert(context, &p15_cert->data, &obj2->pub_data);
-		if (rv < 0)
-			return rv;
-	}
-
 	obj2->pub_genfrom = object;
 	object->cert_pubkey = obj2;
 
@@ -842,8 +820,9 @@ pkcs15_bind_related_objects(struct pkcs15_fw_data *fw_data)
 }
 
 
-/* We deferred reading of the cert until needed, as it may be
- * a private object, so we must wait till login to read  */
+/* We deferred reading of the cert until an attribute needs it: the
+ * CDF has the ID and label, and a private cert can only be read after
+ * login.  Issuers are only bound to certs that were both read. */
 static int
 check_cert_data_read(struct pkcs15_fw_data *fw_data, struct pkcs15_cert_object *cert)
 {
@@ -855,14 +834,18 @@ check_cert_data_read(struct pkcs15_fw_data *fw_data, struct pkcs15_cert_object *
 
 	if (cert->cert_data)
 		return 0;
-	rv = sc_pkcs15_read_certificate(fw_data->p15_card, cert->cert_info, &cert->cert_data);
+	obj2 = cert->cert_pubkey;
+	rv = sc_pkcs15_read_certificate_fields(fw_data->p15_card, cert->cert_info,
+			obj2->pub_data ? SC_PKCS15_CERT_ALL_FIELDS & ~SC_PKCS15_CERT_KEY : SC_PKCS15_CERT_ALL_FIELDS,
+			&cert->cert_data);
 	if (rv < 0)
 		return rv;
 
-	obj2 = cert->cert_pubkey;
-	/* make a copy of public key from the cert data */
-	if (!obj2->pub_data)
-		rv = sc_pkcs15_pubkey_from_cert(context, &cert->cert_data->data, &obj2->pub_data);
+	/* the public key object takes the key parsed from the cert */
+	if (!obj2->pub_data) {
+		obj2->pub_data = cert->cert_data->key;
+		cert->cert_data->key = NULL;
+	}
 
 	/* now that we have the cert and pub key, lets see if we can bind anything else */
 	pkcs15_bind_related_objects(fw_data);
@@ -871,6 +854,33 @@ check_cert_data_read(struct pkcs15_fw_data *fw_data, struct pkcs15_cert_object *
 }
 
 
+/* Cache CKA_CLASS of an object about to be added to a slot, which then
+ * indexes the object under its class */
+static void
+pkcs15_index_object(struct pkcs15_any_object *obj)
+{
+	struct sc_pkcs11_search_keys *keys = &obj->base.search_keys;
+	CK_OBJECT_CLASS class;
+
+	if (obj->base.ops == &pkcs15_cert_ops)
+		class = CKO_CERTIFICATE;
+	else if (obj->base.ops == &pkcs15_prkey_ops)
+		class = CKO_PRIVATE_KEY;
+	else if (obj->base.ops == &pkcs15_pubkey_ops)
+		class = CKO_PUBLIC_KEY;
+	else if (obj->base.ops == &pkcs15_dobj_ops)
+		class = CKO_DATA;
+	else if (obj->base.ops == &pkcs15_skey_ops)
+		class = CKO_SECRET_KEY;
+	else
+		return;
+
+	memcpy(keys->value[SC_PKCS11_SEARCH_KEY_CLASS], &class, sizeof(class));
+	keys->len[SC_PKCS11_SEARCH_KEY_CLASS] = sizeof(class);
+	keys->cached |= 1U << SC_PKCS11_SEARCH_KEY_CLASS;
+}
+
+
 static void
 pkcs15_add_object(struct sc_pkcs11_slot *slot, struct pkcs15_any_object *obj,
 		  CK_OBJECT_HANDLE_PTR pHandle)
@@ -883,15 +893,18 @@ pkcs15_add_object(struct sc_pkcs11_slot *slot, struct pkcs15_any_object *obj,
 	if (obj->base.flags & (SC_PKCS11_OBJECT_HIDDEN | SC_PKCS11_OBJECT_RECURS))
 		return;
 
-	if (list_contains(&slot->objects, obj))
+	if (slot_find_object(slot, (CK_OBJECT_HANDLE)obj) == &obj->base)
 		return;
 
-	if (pHandle != NULL)
-		*pHandle = (CK_OBJECT_HANDLE)obj; /* cast pointer to long */
-
-	list_append(&slot->objects, obj);
 	sc_log(context, "Slot:%X Setting object handle of 0x%lx to 0x%lx", slot->id, obj->base.handle, (CK_OBJECT_HANDLE)obj);
 	obj->base.handle = (CK_OBJECT_HANDLE)obj; /* cast pointer to long */
+	obj->base.flags |= SC_PKCS11_OBJECT_INDEXED;
+	pkcs15_index_object(obj);
+	if (slot_add_object(slot, &obj->base) != CKR_OK)
+		return;
+
+	if (pHandle != NULL)
+		*pHandle = (CK_OBJECT_HANDLE)obj; /* cast pointer to long */
 	obj->base.flags |= SC_PKCS11_OBJECT_SEEN;
 	obj->refcount++;
 
@@ -2878,7 +2891,7 @@ pkcs15_skey_destroy(struct sc_pkcs11_session *session, void *object)
 
 	/* Oppose to pkcs15_add_object */
 	--any_obj->refcount; /* correct refcont */
-	list_delete(&session->slot->objects, any_obj);
+	slot_remove_object(session->slot, &any_obj->base);
 	/* Delete object in pkcs15 */
 	rv = __pkcs15_delete_object(fw_data, any_obj);
 
@@ -2944,7 +2957,7 @@ pkcs15_any_destroy(struct sc_pkcs11_session *session, void *object)
 				/* Unlink related public key FW object if it has no corresponding PKCS#15 object
 				 * and was created from certificate. */
 				--ao_pubkey->refcount;
-				list_delete(&session->slot->objects, ao_pubkey);
+				slot_remove_object(session->slot, &ao_pubkey->base);
 				/* Delete public key object in pkcs15 */
 				if (pubkey->pub_data)   {
 					sc_log(context, "Found pub_data %p", pubkey->pub_data);
@@ -2962,7 +2975,7 @@ pkcs15_any_destroy(struct sc_pkcs11_session *session, void *object)
 	if (rv >= 0) {
 		/* Oppose to pkcs15_add_object */
 		--any_obj->refcount; /* correct refcont */
-		list_delete(&session->slot->objects, any_obj);
+		slot_remove_object(session->slot, &any_obj->base);
 		/* Delete object in pkcs15 */
 		rv = __pkcs15_delete_object(fw_data, any_obj);
 	}
@@ -3864,6 +3877,12 @@ pkcs15_pubkey_get_attribute(struct sc_pkcs11_session *session, void *object, CK_
 				if (SC_SUCCESS != check_cert_data_read(fw_data, cert))
 					return sc_to_cryptoki_error(SC_ERROR_INTERNAL, "check_cert_data_read");
 			break;
+		case CKA_KEY_TYPE:
+			/* the algorithm of a key from a cert is in the cert,
+			 * or in the PrKDF if the cert has a private key */
+			if (pubkey->pub_data == NULL && cert != NULL && cert->cert_prvkey == NULL)
+				check_cert_data_read(fw_data, cert);
+			break;
 	}
 
 	switch (attr->type) {
@@ -3920,6 +3939,10 @@ pkcs15_pubkey_get_attribute(struct sc_pkcs11_session *session, void *object, CK_
 			*(CK_KEY_TYPE*)attr->pValue = CKK_GOSTR3410;
 		else if (pubkey->pub_data && pubkey->pub_data->algorithm == SC_ALGORITHM_EC)
 			*(CK_KEY_TYPE*)attr->pValue = CKK_EC;
+		else if (!pubkey->pub_data && cert && __p15_type((struct pkcs15_any_object *) cert->cert_prvkey) == SC_PKCS15_TYPE_PRKEY_GOSTR3410)
+			*(CK_KEY_TYPE*)attr->pValue = CKK_GOSTR3410;
+		else if (!pubkey->pub_data && cert && __p15_type((struct pkcs15_any_object *) cert->cert_prvkey) == SC_PKCS15_TYPE_PRKEY_EC)
+			*(CK_KEY_TYPE*)attr->pValue = CKK_EC;
 		else
 			*(CK_KEY_TYPE*)attr->pValue = CKK_RSA;
 		break;
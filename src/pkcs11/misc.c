@@ -308,6 +308,138 @@ CK_RV attr_find_var(CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, CK_ULONG type,
 	return attr_extract(pTemplate, ptr, sizep);
 }
 
+#define HANDLE_TABLE_MIN_SIZE	16
+
+/* Handles are pointer values: drop the alignment bits and mix the rest */
+static unsigned int handle_hash(CK_ULONG handle, unsigned int mask)
+{
+	CK_ULONG h = handle >> 3;
+
+	h ^= h >> 16;
+	return ((unsigned int)h * 2654435761U) & mask;
+}
+
+void handle_table_init(struct sc_pkcs11_handle_table *table)
+{
+	memset(table, 0, sizeof(*table));
+}
+
+void handle_table_free(struct sc_pkcs11_handle_table *table)
+{
+	free(table->handles);
+	free(table->values);
+	memset(table, 0, sizeof(*table));
+}
+
+static CK_RV handle_table_resize(struct sc_pkcs11_handle_table *table, unsigned int size)
+{
+	CK_ULONG *handles;
+	void **values;
+	unsigned int i, j;
+
+	handles = calloc(size, sizeof(*handles));
+	values = calloc(size, sizeof(*values));
+	if (handles == NULL || values == NULL) {
+		free(handles);
+		free(values);
+		return CKR_HOST_MEMORY;
+	}
+
+	for (i = 0; i < table->size; i++) {
+		if (table->values[i] == NULL)
+			continue;
+		j = handle_hash(table->handles[i], size - 1);
+		while (handles[j] != 0)
+			j = (j + 1) & (size - 1);
+		handles[j] = table->handles[i];
+		values[j] = table->values[i];
+	}
+
+	free(table->handles);
+	free(table->values);
+	table->handles = handles;
+	table->values = values;
+	table->size = size;
+	table->used = table->count;
+	return CKR_OK;
+}
+
+CK_RV handle_table_insert(struct sc_pkcs11_handle_table *table, CK_ULONG handle, void *value)
+{
+	unsigned int i, mask, tomb = 0;
+	int have_tomb = 0;
+	CK_RV rv;
+
+	if (handle == 0 || value == NULL)
+		return CKR_ARGUMENTS_BAD;
+
+	/* Keep the load, deleted buckets included, under 3/4 */
+	if ((table->used + 1) * 4 > table->size * 3) {
+		unsigned int size = table->size ? table->size : HANDLE_TABLE_MIN_SIZE;
+
+		if ((table->count + 1) * 2 > size)
+			size *= 2;
+		rv = handle_table_resize(table, size);
+		if (rv != CKR_OK)
+			return rv;
+	}
+
+	mask = table->size - 1;
+	for (i = handle_hash(handle, mask); table->handles[i] != 0; i = (i + 1) & mask) {
+		if (table->handles[i] == handle && table->values[i] != NULL) {
+			table->values[i] = value;
+			return CKR_OK;
+		}
+		if (table->values[i] == NULL && !have_tomb) {
+			tomb = i;
+			have_tomb = 1;
+		}
+	}
+
+	if (have_tomb) {
+		i = tomb;
+	} else {
+		table->used++;
+	}
+	table->handles[i] = handle;
+	table->values[i] = value;
+	table->count++;
+	return CKR_OK;
+}
+
+static int handle_table_bucket(struct sc_pkcs11_handle_table *table, CK_ULONG handle)
+{
+	unsigned int i, mask;
+
+	if (table->size == 0 || handle == 0)
+		return -1;
+
+	mask = table->size - 1;
+	for (i = handle_hash(handle, mask); table->handles[i] != 0; i = (i + 1) & mask) {
+		if (table->handles[i] == handle && table->values[i] != NULL)
+			return (int)i;
+	}
+	return -1;
+}
+
+void *handle_table_find(struct sc_pkcs11_handle_table *table, CK_ULONG handle)
+{
+	int i = handle_table_bucket(table, handle);
+
+	return i < 0 ? NULL : table->values[i];
+}
+
+void handle_table_remove(struct sc_pkcs11_handle_table *table, CK_ULONG handle)
+{
+	int i = handle_table_bucket(table, handle);
+
+	if (i < 0)
+		return;
+	/* Leave the handle in place so that probe chains stay intact */
+	table->values[i] = NULL;
+	table->count--;
+}
+
 void load_pkcs11_parameters(struct sc_pkcs11_config *conf, sc_context_t * ctx)
 {
 	scconf_block *conf_block = NULL;
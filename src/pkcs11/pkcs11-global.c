@@ -25,7 +25,15 @@
 #ifdef HAVE_SYS_TIME_H
 #include <sys/time.h>
 #endif
+#ifdef _WIN32
+#include <windows.h>
+#define msleep(t)	Sleep(t)
+#else
+#include <unistd.h>
+#define msleep(t)	usleep((t) * 1000)
+#endif
 
+#include "libopensc/cardctl.h"
 #include "sc-pkcs11.h"
 
 #ifndef MODULE_APP_NAME
@@ -35,11 +43,13 @@
 sc_context_t *context = NULL;
 struct sc_pkcs11_config sc_pkcs11_conf;
 list_t sessions;
+struct sc_pkcs11_handle_table session_table;
 list_t virtual_slots;
 #if !defined(_WIN32)
 pid_t initialized_pid = (pid_t)-1;
 #endif
 static int in_finalize = 0;
+static unsigned int waiting_threads = 0;	/* Threads blocked in C_WaitForSlotEvent() */
 extern CK_FUNCTION_LIST pkcs11_function_list;
 
 #if defined(HAVE_PTHREAD) && defined(PKCS11_THREAD_LOCKING)
@@ -238,6 +248,7 @@ CK_RV C_Initialize(CK_VOID_PTR pInitArgs)
 	/* List of sessions */
 	list_init(&sessions);
 	list_attributes_seeker(&sessions, session_list_seeker);
+	handle_table_init(&session_table);
 
 	/* List of slots */
 	list_init(&virtual_slots);
@@ -293,6 +304,14 @@ CK_RV C_Finalize(CK_VOID_PTR pReserved)
 	/* cancel pending calls */
 	in_finalize = 1;
 	sc_cancel(context);
+	/* Blocked C_WaitForSlotEvent() calls still use the context: let them
+	 * leave. Cancel again in case a thread was not waiting yet. */
+	while (waiting_threads > 0) {
+		sc_pkcs11_unlock();
+		msleep(10);
+		sc_pkcs11_lock();
+		sc_cancel(context);
+	}
 	/* remove all cards from readers */
 	for (i=0; i < (int)sc_ctx_get_reader_count(context); i++)
 		card_removed(sc_ctx_get_reader(context, i));
@@ -300,9 +319,11 @@ CK_RV C_Finalize(CK_VOID_PTR pReserved)
 	while ((p = list_fetch(&sessions)))
 		free(p);
 	list_destroy(&sessions);
+	handle_table_free(&session_table);
 
 	while ((slot = list_fetch(&virtual_slots))) {
-		list_destroy(&slot->objects);
+		slot_free_objects(slot);
+		sc_pkcs11_free_slot_lock(slot);
 		free(slot);
 	}
 	list_destroy(&virtual_slots);
@@ -589,6 +610,12 @@ CK_RV C_InitToken(CK_SLOT_ID slotID,
 		goto out;
 	}
 
+	/* Make sure no other thread is working with this token */
+	if (slot_is_busy(slot->reader)) {
+		rv = CKR_SESSION_EXISTS;
+		goto out;
+	}
+
 	/* Make sure there's no open session for this token */
 	for (i=0; i<list_size(&sessions); i++) {
 		session = (struct sc_pkcs11_session*)list_get_at(&sessions, i);
@@ -624,15 +651,12 @@ CK_RV C_WaitForSlotEvent(CK_FLAGS flags,   /* blocking/nonblocking flag */
 	if (pReserved != NULL_PTR)
 		return  CKR_ARGUMENTS_BAD;
 
-	sc_log(context, "C_WaitForSlotEvent(block=%d)", !(flags & CKF_DONT_BLOCK));
-	/* Not all pcsc-lite versions implement consistently used functions as they are */
-	/* FIXME: add proper checking into build to check correct pcsc-lite version for SCardStatusChange/SCardCancel */
-	if (!(flags & CKF_DONT_BLOCK))
-		return CKR_FUNCTION_NOT_SUPPORTED;
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
+	sc_log(context, "C_WaitForSlotEvent(block=%d)", !(flags & CKF_DONT_BLOCK));
+
 	mask = SC_EVENT_CARD_EVENTS;
 
 	/* Detect and add new slots for added readers v2.20 */
@@ -644,33 +668,42 @@ CK_RV C_WaitForSlotEvent(CK_FLAGS flags,   /* blocking/nonblocking flag */
 	if ((rv == CKR_OK) || (flags & CKF_DONT_BLOCK))
 		goto out;
 
+	/* Block in sc_wait_for_event() without the global lock.
+	 * C_Finalize() cancels the wait and waits for us to leave. */
+	waiting_threads++;
 again:
+	if (in_finalize == 1) {
+		rv = CKR_CRYPTOKI_NOT_INITIALIZED;
+		goto done;
+	}
 	sc_log(context, "C_WaitForSlotEvent() reader_states:%p", reader_states);
 	sc_pkcs11_unlock();
 	r = sc_wait_for_event(context, mask, &found, &events, -1, &reader_states);
-	if (sc_pkcs11_conf.plug_and_play && events & SC_EVENT_READER_ATTACHED) {
-		/* NSS/Firefox Triggers a C_GetSlotList(NULL) only if a slot ID is returned that it does not know yet
-		   Change the first hotplug slot id on every call to make this happen. */
-		sc_pkcs11_slot_t *hotplug_slot = list_get_at(&virtual_slots, 0);
-		*pSlot= hotplug_slot->id -1;
-
-		rv = sc_pkcs11_lock();
-		if (rv != CKR_OK)
-			return rv;
-
-		goto out;
+	if ((rv = sc_pkcs11_lock()) != CKR_OK) {
+		/* Cannot happen with a working mutex, do not touch the context */
+		waiting_threads--;
+		return rv;
 	}
-	/* Was C_Finalize called ? */
-	if (in_finalize == 1)
-		return CKR_CRYPTOKI_NOT_INITIALIZED;
 
-	if ((rv = sc_pkcs11_lock()) != CKR_OK)
-		return rv;
+	/* Was C_Finalize called ? */
+	if (in_finalize == 1) {
+		rv = CKR_CRYPTOKI_NOT_INITIALIZED;
+		goto done;
+	}
 
 	if (r != SC_SUCCESS) {
 		sc_log(context, "sc_wait_for_event() returned %d\n",  r);
 		rv = sc_to_cryptoki_error(r, "C_WaitForSlotEvent");
-		goto out;
+		goto done;
+	}
+
+	if (sc_pkcs11_conf.plug_and_play && events & SC_EVENT_READER_ATTACHED) {
+		/* NSS/Firefox Triggers a C_GetSlotList(NULL) only if a slot ID is returned that it does not know yet
+		   Change the first hotplug slot id on every call to make this happen. */
+		sc_pkcs11_slot_t *hotplug_slot = list_get_at(&virtual_slots, 0);
+		slot_id = hotplug_slot->id -1;
+		rv = CKR_OK;
+		goto done;
 	}
 
 	/* If no changed slot was found (maybe an unsupported card
@@ -679,8 +712,10 @@ again:
 	if (rv != CKR_OK)
 		goto again;
 
+done:
+	waiting_threads--;
 out:
-	if (pSlot)
+	if (pSlot && rv == CKR_OK)
 		*pSlot = slot_id;
 
 	/* Free allocated readers states holder */
@@ -694,6 +729,64 @@ out:
 	return rv;
 }
 
+/* OpenSC extension: APDU counters of the card in a slot, see pkcs11-opensc.h */
+CK_RV C_OpenSC_GetAPDUStats(CK_SLOT_ID slotID, CK_OPENSC_APDU_STATS_PTR pStats, CK_BBOOL reset)
+{
+	struct sc_pkcs11_slot *slot;
+	struct sc_apdu_stats *stats = NULL;
+	CK_RV rv;
+	int i, j, r;
+
+	if (pStats == NULL_PTR)
+		return CKR_ARGUMENTS_BAD;
+
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = slot_get_token(slotID, &slot);
+	if (rv != CKR_OK)
+		goto out;
+	if (slot->p11card == NULL || slot->p11card->card == NULL) {
+		rv = CKR_TOKEN_NOT_PRESENT;
+		goto out;
+	}
+
+	stats = malloc(sizeof(*stats));
+	if (stats == NULL) {
+		rv = CKR_HOST_MEMORY;
+		goto out;
+	}
+	r = sc_card_ctl(slot->p11card->card, SC_CARDCTL_GET_APDU_STATS, stats);
+	if (r == SC_SUCCESS && reset)
+		r = sc_card_ctl(slot->p11card->card, SC_CARDCTL_RESET_APDU_STATS, NULL);
+	if (r != SC_SUCCESS) {
+		rv = sc_to_cryptoki_error(r, "C_OpenSC_GetAPDUStats");
+		goto out;
+	}
+
+	for (i = 0; i <= 256; i++) {
+		const struct sc_apdu_counter *from = i < 256 ? &stats->ins[i] : &stats->total;
+		CK_OPENSC_APDU_COUNTER *to = i < 256 ? &pStats->ins[i] : &pStats->total;
+
+		to->count = from->count;
+		to->bytesSent = from->bytes_sent;
+		to->bytesReceived = from->bytes_received;
+		to->usec = from->usec;
+		for (j = 0; j < SC_APDU_STATS_BUCKETS; j++)
+			to->histogram[j] = from->histogram[j];
+	}
+	pStats->getResponses = stats->get_responses;
+	pStats->retransmits = stats->retransmits;
+	pStats->selectsSkipped = stats->selects_skipped;
+	pStats->secEnvsSkipped = stats->sec_envs_skipped;
+
+out:
+	free(stats);
+	sc_pkcs11_unlock();
+	return rv;
+}
+
 /*
  * Locking functions
  */
@@ -806,6 +899,128 @@ void sc_pkcs11_free_lock(void)
 	global_locking = NULL;
 }
 
+/*
+ * Slot locking functions
+ *
+ * All virtual slots of a reader share one mutex, owned by the first slot
+ * of that reader (slot->lock_slot). The global lock is only held to look up
+ * the session or slot and to account the users of the slot lock; the token
+ * operation itself runs with just the slot lock held. Lock order is always
+ * slot lock before global lock. Slots with lock users are never torn down
+ * (see slot_is_busy()), so a thread waiting for a slot lock can rely on it.
+ */
+
+CK_RV
+sc_pkcs11_init_slot_lock(struct sc_pkcs11_slot *slot)
+{
+	slot->mutex = NULL;
+	slot->lock_users = 0;
+	if (slot->lock_slot != slot)
+		return CKR_OK;
+	if (!global_lock || !global_locking)
+		return CKR_OK;
+
+	return global_locking->CreateMutex(&slot->mutex);
+}
+
+void
+sc_pkcs11_free_slot_lock(struct sc_pkcs11_slot *slot)
+{
+	if (!slot->mutex)
+		return;
+	if (global_locking)
+		global_locking->DestroyMutex(slot->mutex);
+	slot->mutex = NULL;
+}
+
+static void
+__sc_pkcs11_lock_slot(struct sc_pkcs11_slot *lock_slot)
+{
+	if (!lock_slot->mutex)
+		return;
+	if (global_locking)  {
+		while (global_locking->LockMutex(lock_slot->mutex) != CKR_OK)
+			;
+	}
+}
+
+/* Lock the slot that holds a token, called without the global lock */
+CK_RV
+sc_pkcs11_lock_slot(CK_SLOT_ID slotID, struct sc_pkcs11_slot **slot)
+{
+	struct sc_pkcs11_slot *lock_slot;
+	CK_RV rv;
+
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = slot_get_token(slotID, slot);
+	if (rv != CKR_OK) {
+		sc_pkcs11_unlock();
+		return rv;
+	}
+
+	lock_slot = (*slot)->lock_slot;
+	lock_slot->lock_users++;
+	sc_pkcs11_unlock();
+
+	__sc_pkcs11_lock_slot(lock_slot);
+	return CKR_OK;
+}
+
+/* Lock the slot of a session, called without the global lock */
+CK_RV
+sc_pkcs11_lock_session(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session **session)
+{
+	struct sc_pkcs11_slot *lock_slot;
+	CK_RV rv;
+
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = get_session(hSession, session);
+	if (rv != CKR_OK) {
+		sc_pkcs11_unlock();
+		return rv;
+	}
+
+	lock_slot = (*session)->slot->lock_slot;
+	lock_slot->lock_users++;
+	sc_pkcs11_unlock();
+
+	__sc_pkcs11_lock_slot(lock_slot);
+
+	/* The session could have been closed while we were waiting */
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK) {
+		__sc_pkcs11_unlock(lock_slot->mutex);
+		return rv;
+	}
+	rv = get_session(hSession, session);
+	if (rv == CKR_OK && (*session)->slot->lock_slot != lock_slot)
+		rv = CKR_SESSION_HANDLE_INVALID;
+	sc_pkcs11_unlock();
+
+	if (rv != CKR_OK)
+		sc_pkcs11_unlock_slot(lock_slot);
+	return rv;
+}
+
+void
+sc_pkcs11_unlock_slot(struct sc_pkcs11_slot *slot)
+{
+	struct sc_pkcs11_slot *lock_slot = slot->lock_slot;
+
+	__sc_pkcs11_unlock(lock_slot->mutex);
+
+	if (sc_pkcs11_lock() != CKR_OK)
+		return;
+	lock_slot->lock_users--;
+	sc_pkcs11_unlock();
+}
+
 CK_FUNCTION_LIST pkcs11_function_list = {
 	{ 2, 11 }, /* Note: NSS/Firefox ignores this version number and uses C_GetInfo() */
 	C_Initialize,
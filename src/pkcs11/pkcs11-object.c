@@ -64,26 +64,19 @@ sc_find_release(sc_pkcs11_operation_t *operation)
 }
 
 
+/* Called with the slot lock of the session held */
 static CK_RV
-get_object_from_session(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject,
-		struct sc_pkcs11_session **session, struct sc_pkcs11_object **object)
+get_object_from_session(struct sc_pkcs11_session *session, CK_OBJECT_HANDLE hObject,
+		struct sc_pkcs11_object **object)
 {
-	struct sc_pkcs11_session *sess;
-	CK_RV rv;
-
-	rv = get_session(hSession, &sess);
-	if (rv != CKR_OK)
-		return rv;
-
-	*object = list_seek(&sess->slot->objects, &hObject);
+	*object = slot_find_object(session->slot, hObject);
 	if (!*object)
 		return CKR_OBJECT_HANDLE_INVALID;
-	*session = sess;
 	return CKR_OK;
 }
 
 /* C_CreateObject can be called from C_DeriveKey
- * which is holding the sc_pkcs11_lock
+ * which is holding the slot lock
  * So dont get the lock again. */
 static
 CK_RV sc_create_object_int(CK_SESSION_HANDLE hSession,	/* the session's handle */
@@ -101,28 +94,28 @@ CK_RV sc_create_object_int(CK_SESSION_HANDLE hSession,	/* the session's handle *
 		return CKR_ARGUMENTS_BAD;
 
 	if (use_lock) {
-	    rv = sc_pkcs11_lock();
-	    if (rv != CKR_OK)
-		return rv;
+		rv = sc_pkcs11_lock_session(hSession, &session);
 	}
+	else {
+		rv = sc_pkcs11_lock();
+		if (rv == CKR_OK) {
+			rv = get_session(hSession, &session);
+			sc_pkcs11_unlock();
+		}
+	}
+	if (rv != CKR_OK)
+		return rv;
 
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_CreateObject()", pTemplate, ulCount);
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
-
 	card = session->slot->p11card;
 	if (card->framework->create_object == NULL)
 		rv = CKR_FUNCTION_NOT_SUPPORTED;
 	else
 		rv = card->framework->create_object(session->slot, pTemplate, ulCount, phObject);
 
-out:
 	if (use_lock)
-		sc_pkcs11_unlock();
+		sc_pkcs11_unlock_slot(session->slot);
 	LOG_FUNC_RETURN(context, rv);
 }
 
@@ -158,12 +151,12 @@ C_DestroyObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_BBOOL is_token = FALSE;
 	CK_ATTRIBUTE token_attribure = {CKA_TOKEN, &is_token, sizeof(is_token)};
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
 	sc_log(context, "C_DestroyObject(hSession=0x%lx, hObject=0x%lx)", hSession, hObject);
-	rv = get_object_from_session(hSession, hObject, &session, &object);
+	rv = get_object_from_session(session, hObject, &object);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -179,7 +172,7 @@ C_DestroyObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		rv = object->ops->destroy_object(session, object);
 
 out:
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(session->slot);
 	return rv;
 }
 
@@ -217,11 +210,11 @@ C_GetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pTemplate == NULL_PTR || ulCount == 0)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hObject, &session, &object);
+	rv = get_object_from_session(session, hObject, &object);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -257,7 +250,7 @@ C_GetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 out:	sc_log(context, "C_GetAttributeValue(hSession=0x%lx, hObject=0x%lx) = %s",
 			hSession, hObject, lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(session->slot);
 	return rv;
 }
 
@@ -276,13 +269,13 @@ C_SetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pTemplate == NULL_PTR || ulCount == 0)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_SetAttributeValue", pTemplate, ulCount);
 
-	rv = get_object_from_session(hSession, hObject, &session, &object);
+	rv = get_object_from_session(session, hObject, &object);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -299,40 +292,204 @@ C_SetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			if (rv != CKR_OK)
 				break;
 		}
+		/* CKA_CLASS does not change, and indexes the object in its slot */
+		object->search_keys.cached &= 1U << SC_PKCS11_SEARCH_KEY_CLASS;
 	}
 
 out:
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(session->slot);
 	return rv;
 }
 
 
+/* Attributes kept in struct sc_pkcs11_search_keys, in order */
+static const CK_ATTRIBUTE_TYPE search_key_types[SC_PKCS11_SEARCH_KEYS] = {
+	CKA_CLASS, CKA_KEY_TYPE, CKA_PRIVATE, CKA_ID, CKA_LABEL
+};
+
+static int search_key_index(CK_ATTRIBUTE_TYPE type)
+{
+	int i;
+
+	for (i = 0; i < SC_PKCS11_SEARCH_KEYS; i++)
+		if (search_key_types[i] == type)
+			return i;
+	return -1;
+}
+
+/* Cache a search key of an object the first time a search needs it, so
+ * that keys nobody searches for are never read.  Keys that cannot be read
+ * right now, or are too long, are left to cmp_attribute() */
+static void
+load_search_key(struct sc_pkcs11_session *session, struct sc_pkcs11_object *object, int i)
+{
+	struct sc_pkcs11_search_keys *keys = &object->search_keys;
+	CK_ATTRIBUTE attr;
+	CK_RV rv;
+
+	if (!(object->flags & SC_PKCS11_OBJECT_INDEXED) || (keys->cached & (1U << i)))
+		return;
+
+	attr.type = search_key_types[i];
+	attr.pValue = NULL;
+	attr.ulValueLen = 0;
+	rv = object->ops->get_attribute(session, object, &attr);
+	if (rv == CKR_ATTRIBUTE_TYPE_INVALID) {
+		keys->len[i] = CK_UNAVAILABLE_INFORMATION;
+	} else {
+		if (rv != CKR_OK || attr.ulValueLen > SC_PKCS11_SEARCH_KEY_SIZE)
+			return;
+		attr.pValue = keys->value[i];
+		rv = object->ops->get_attribute(session, object, &attr);
+		if (rv != CKR_OK)
+			return;
+		keys->len[i] = attr.ulValueLen;
+	}
+	keys->cached |= 1U << i;
+}
+
+/* Match a template attribute against the cached search keys.
+ * Returns -1 when the attribute is not cached, otherwise the same
+ * as cmp_attribute() */
+static int
+match_search_key(struct sc_pkcs11_session *session, struct sc_pkcs11_object *object,
+		CK_ATTRIBUTE_PTR attr)
+{
+	struct sc_pkcs11_search_keys *keys = &object->search_keys;
+	int i = search_key_index(attr->type);
+
+	if (i < 0)
+		return -1;
+	load_search_key(session, object, i);
+	if (!(keys->cached & (1U << i)))
+		return -1;
+	if (keys->len[i] == CK_UNAVAILABLE_INFORMATION || keys->len[i] != attr->ulValueLen)
+		return 0;
+	return !memcmp(keys->value[i], attr->pValue, attr->ulValueLen);
+}
+
+/* get_attribute() served from the cached search keys when possible */
+static CK_RV
+get_search_key(struct sc_pkcs11_session *session, struct sc_pkcs11_object *object,
+		CK_ATTRIBUTE_PTR attr)
+{
+	struct sc_pkcs11_search_keys *keys = &object->search_keys;
+	int i = search_key_index(attr->type);
+
+	if (i >= 0)
+		load_search_key(session, object, i);
+	if (i < 0 || !(keys->cached & (1U << i)))
+		return object->ops->get_attribute(session, object, attr);
+	if (keys->len[i] == CK_UNAVAILABLE_INFORMATION)
+		return CKR_ATTRIBUTE_TYPE_INVALID;
+	if (attr->ulValueLen < keys->len[i])
+		return CKR_BUFFER_TOO_SMALL;
+	memcpy(attr->pValue, keys->value[i], keys->len[i]);
+	attr->ulValueLen = keys->len[i];
+	return CKR_OK;
+}
+
+
+/* Lists of the slot objects a template may match. With CKA_CLASS only
+ * the objects indexed under that class, and those of unknown class */
+static int
+find_object_lists(struct sc_pkcs11_slot *slot, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount,
+		list_t **lists)
+{
+	CK_OBJECT_CLASS class;
+	CK_ULONG j;
+
+	for (j = 0; j < ulCount; j++) {
+		if (pTemplate[j].type != CKA_CLASS || pTemplate[j].pValue == NULL
+				|| pTemplate[j].ulValueLen != sizeof(class))
+			continue;
+		memcpy(&class, pTemplate[j].pValue, sizeof(class));
+		lists[0] = slot_class_objects(slot, class);
+		lists[1] = slot_class_objects(slot, (CK_OBJECT_CLASS)-1);
+		return lists[0] == lists[1] ? 1 : 2;
+	}
+	lists[0] = &slot->objects;
+	return 1;
+}
+
+/* Add the handle of an object to the search results if it matches */
+static CK_RV
+find_object(struct sc_pkcs11_session *session, struct sc_pkcs11_find_operation *operation,
+		struct sc_pkcs11_object *object, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount,
+		int hide_private)
+{
+	CK_BBOOL is_private = TRUE;
+	CK_ATTRIBUTE private_attribute = { CKA_PRIVATE, &is_private, sizeof(is_private) };
+	struct sc_pkcs11_slot *slot = session->slot;
+	CK_ULONG j;
+	int res;
+
+	sc_log(context, "Object with handle 0x%lx", object->handle);
+
+	/* User not logged in and private object? */
+	if (hide_private) {
+		if (get_search_key(session, object, &private_attribute) != CKR_OK)
+			return CKR_OK;
+		if (is_private) {
+			sc_log(context, "Object %d/%d: Private object and not logged in.",
+				 slot->id, object->handle);
+			return CKR_OK;
+		}
+	}
+
+	/* Try to match every attribute */
+	for (j = 0; j < ulCount; j++) {
+		res = match_search_key(session, object, &pTemplate[j]);
+		if (res < 0)
+			res = object->ops->cmp_attribute(session, object, &pTemplate[j]);
+		if (res == 0) {
+			sc_log(context, "Object %d/%d: Attribute 0x%x does NOT match.",
+				 slot->id, object->handle, pTemplate[j].type);
+			return CKR_OK;
+		}
+
+		if (context->debug >= 4) {
+			sc_log(context, "Object %d/%d: Attribute 0x%x matches.",
+				 slot->id, object->handle, pTemplate[j].type);
+		}
+	}
+
+	sc_log(context, "Object %d/%d matches\n", slot->id, object->handle);
+	/* Realloc handles - remove restriction on only 32 matching objects -dee */
+	if (operation->num_handles >= operation->allocated_handles) {
+		operation->allocated_handles += SC_PKCS11_FIND_INC_HANDLES;
+		sc_log(context, "realloc for %d handles", operation->allocated_handles);
+		operation->handles = realloc(operation->handles,
+			sizeof(CK_OBJECT_HANDLE) * operation->allocated_handles);
+		if (operation->handles == NULL)
+			return CKR_HOST_MEMORY;
+	}
+	operation->handles[operation->num_handles++] = object->handle;
+	return CKR_OK;
+}
+
+
 CK_RV
 C_FindObjectsInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_ATTRIBUTE_PTR pTemplate,	/* attribute values to match */
 		CK_ULONG ulCount)		/* attributes in search template */
 {
 	CK_RV rv;
-	CK_BBOOL is_private = TRUE;
-	CK_ATTRIBUTE private_attribute = { CKA_PRIVATE, &is_private, sizeof(is_private) };
-	int match, hide_private;
-	unsigned int i, j;
+	int hide_private, nlists, l;
+	unsigned int i;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_object *object;
 	struct sc_pkcs11_find_operation *operation;
 	struct sc_pkcs11_slot *slot;
+	list_t *lists[2];
 
 	if (pTemplate == NULL_PTR && ulCount > 0)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
-
 	sc_log(context, "C_FindObjectsInit(slot = %d)\n", session->slot->id);
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_FindObjectsInit()", pTemplate, ulCount);
 
@@ -352,61 +509,21 @@ C_FindObjectsInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (slot->login_user != CKU_USER && (slot->token_info.flags & CKF_LOGIN_REQUIRED))
 		hide_private = 1;
 
-	/* For each object in token do */
-	for (i=0; i<list_size(&slot->objects); i++) {
-		object = (struct sc_pkcs11_object *)list_get_at(&slot->objects, i);
-		sc_log(context, "Object with handle 0x%lx", object->handle);
-
-		/* User not logged in and private object? */
-		if (hide_private) {
-			if (object->ops->get_attribute(session, object, &private_attribute) != CKR_OK)
-			        continue;
-			if (is_private) {
-				sc_log(context, "Object %d/%d: Private object and not logged in.",
-					 slot->id, object->handle);
-				continue;
-			}
-		}
-
-		/* Try to match every attribute */
-		match = 1;
-		for (j = 0; j < ulCount; j++) {
-			rv = object->ops->cmp_attribute(session, object, &pTemplate[j]);
-			if (rv == 0) {
-				sc_log(context, "Object %d/%d: Attribute 0x%x does NOT match.",
-					 slot->id, object->handle, pTemplate[j].type);
-				match = 0;
-				break;
-			}
-
-			if (context->debug >= 4) {
-				sc_log(context, "Object %d/%d: Attribute 0x%x matches.",
-					 slot->id, object->handle, pTemplate[j].type);
-			}
-		}
-
-		if (match) {
-			sc_log(context, "Object %d/%d matches\n", slot->id, object->handle);
-			/* Realloc handles - remove restriction on only 32 matching objects -dee */
-			if (operation->num_handles >= operation->allocated_handles) {
-				operation->allocated_handles += SC_PKCS11_FIND_INC_HANDLES;
-				sc_log(context, "realloc for %d handles", operation->allocated_handles);
-				operation->handles = realloc(operation->handles,
-					sizeof(CK_OBJECT_HANDLE) * operation->allocated_handles);
-				if (operation->handles == NULL) {
-					rv = CKR_HOST_MEMORY;
-					goto out;
-				}
-			}
-			operation->handles[operation->num_handles++] = object->handle;
+	/* For each object in token that may match do */
+	nlists = find_object_lists(slot, pTemplate, ulCount, lists);
+	for (l = 0; l < nlists; l++) {
+		for (i = 0; i < list_size(lists[l]); i++) {
+			object = (struct sc_pkcs11_object *)list_get_at(lists[l], i);
+			rv = find_object(session, operation, object, pTemplate, ulCount, hide_private);
+			if (rv != CKR_OK)
+				goto out;
 		}
 	}
-	rv = CKR_OK;
 
 	sc_log(context, "%d matching objects\n", operation->num_handles);
 
 out:
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(session->slot);
 	return rv;
 }
 
@@ -425,14 +542,10 @@ C_FindObjects(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (phObject == NULL_PTR || ulMaxObjectCount == 0 || pulObjectCount == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
-
 	rv = session_get_operation(session, SC_PKCS11_OPERATION_FIND, (sc_pkcs11_operation_t **) & operation);
 	if (rv != CKR_OK)
 		goto out;
@@ -447,7 +560,7 @@ C_FindObjects(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 	operation->current_handle += to_return;
 
-out:	sc_pkcs11_unlock();
+out:	sc_pkcs11_unlock_slot(session->slot);
 	return rv;
 }
 
@@ -458,19 +571,15 @@ C_FindObjectsFinal(CK_SESSION_HANDLE hSession)	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
-
 	rv = session_get_operation(session, SC_PKCS11_OPERATION_FIND, NULL);
 	if (rv == CKR_OK)
 		session_stop_operation(session, SC_PKCS11_OPERATION_FIND);
 
-out:	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(session->slot);
 	return rv;
 }
 
@@ -488,17 +597,15 @@ C_DigestInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
 	sc_log(context, "C_DigestInit(hSession=0x%lx)", hSession);
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_md_init(session, pMechanism);
+	rv = sc_pkcs11_md_init(session, pMechanism);
 
 	sc_log(context, "C_DigestInit() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(session->slot);
 	return rv;
 }
 
@@ -514,14 +621,11 @@ C_Digest(CK_SESSION_HANDLE hSession,		/* the session's handle */
 	struct sc_pkcs11_session *session;
 	CK_ULONG  ulBuflen = 0;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
 	sc_log(context, "C_Digest(hSession=0x%lx)", hSession);
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
 
 	/* if pDigest == NULL, buffer size request */
 	if (pDigest) {
@@ -542,7 +646,7 @@ C_Digest(CK_SESSION_HANDLE hSession,		/* the session's handle */
 		rv = sc_pkcs11_md_final(session, pDigest, pulDigestLen);
 
 out:	sc_log(context, "C_Digest() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(session->slot);
 	return rv;
 }
 
@@ -555,16 +659,14 @@ C_DigestUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_md_update(session, pPart, ulPartLen);
+	rv = sc_pkcs11_md_update(session, pPart, ulPartLen);
 
 	sc_log(context, "C_DigestUpdate() == %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(session->slot);
 	return rv;
 }
 
@@ -585,16 +687,14 @@ C_DigestFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_md_final(session, pDigest, pulDigestLen);
+	rv = sc_pkcs11_md_final(session, pDigest, pulDigestLen);
 
 	sc_log(context, "C_DigestFinal() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(session->slot);
 	return rv;
 }
 
@@ -615,11 +715,11 @@ C_SignInit(CK_SESSION_HANDLE hSession,		/* the session's handle */
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hKey, &session, &object);
+	rv = get_object_from_session(session, hKey, &object);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -646,7 +746,7 @@ C_SignInit(CK_SESSION_HANDLE hSession,		/* the session's handle */
 
 out:
 	sc_log(context, "C_SignInit() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(session->slot);
 	return rv;
 }
 
@@ -662,14 +762,10 @@ C_Sign(CK_SESSION_HANDLE hSession,		/* the session's handle */
 	struct sc_pkcs11_session *session;
 	CK_ULONG length;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
-
 	/* According to the pkcs11 specs, we must not do any calls that
 	 * change our crypto state if the caller is just asking for the
 	 * signature buffer size, or if the result would be
@@ -690,7 +786,7 @@ C_Sign(CK_SESSION_HANDLE hSession,		/* the session's handle */
 
 out:
 	sc_log(context, "C_Sign() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(session->slot);
 	return rv;
 }
 
@@ -703,16 +799,14 @@ C_SignUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_sign_update(session, pPart, ulPartLen);
+	rv = sc_pkcs11_sign_update(session, pPart, ulPartLen);
 
 	sc_log(context, "C_SignUpdate() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(session->slot);
 	return rv;
 }
 
@@ -726,14 +820,10 @@ C_SignFinal(CK_SESSION_HANDLE hSession,		/* the session's handle */
 	CK_ULONG length;
 	CK_RV rv;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
-
 	/* According to the pkcs11 specs, we must not do any calls that
 	 * change our crypto state if the caller is just asking for the
 	 * signature buffer size, or if the result would be
@@ -751,7 +841,7 @@ C_SignFinal(CK_SESSION_HANDLE hSession,		/* the session's handle */
 
 out:
 	sc_log(context, "C_SignFinal() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(session->slot);
 	return rv;
 }
 
@@ -826,11 +916,11 @@ CK_RV C_DecryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hKey, &session, &object);
+	rv = get_object_from_session(session, hKey, &object);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -860,7 +950,7 @@ CK_RV C_DecryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	rv = sc_pkcs11_decr_init(session, pMechanism, object, key_type);
 
 out:	sc_log(context, "C_DecryptInit() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(session->slot);
 	return rv;
 }
 
@@ -873,17 +963,15 @@ CK_RV C_Decrypt(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_decr(session, pEncryptedData, ulEncryptedDataLen,
-				pData, pulDataLen);
+	rv = sc_pkcs11_decr(session, pEncryptedData, ulEncryptedDataLen,
+			pData, pulDataLen);
 
 	sc_log(context, "C_Decrypt() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(session->slot);
 	return rv;
 }
 
@@ -966,17 +1054,13 @@ CK_RV C_GenerateKeyPair(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			|| (pPrivateKeyTemplate == NULL_PTR && ulPrivateKeyAttributeCount > 0))
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_GenerateKeyPair(), PrivKey attrs", pPrivateKeyTemplate, ulPrivateKeyAttributeCount);
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_GenerateKeyPair(), PubKey attrs", pPublicKeyTemplate, ulPublicKeyAttributeCount);
 
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
-
 	if (!(session->flags & CKF_RW_SESSION)) {
 		rv = CKR_SESSION_READ_ONLY;
 		goto out;
@@ -992,7 +1076,7 @@ CK_RV C_GenerateKeyPair(CK_SESSION_HANDLE hSession,	/* the session's handle */
 				phPublicKey, phPrivateKey);
 
 out:
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(session->slot);
 	return rv;
 }
 
@@ -1040,11 +1124,11 @@ CK_RV C_DeriveKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hBaseKey, &session, &object);
+	rv = get_object_from_session(session, hBaseKey, &object);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -1077,7 +1161,7 @@ CK_RV C_DeriveKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		if (rv != CKR_OK)
 		    goto out;
 
-		rv = get_object_from_session(hSession, *phKey, &session, &key_object);
+		rv = get_object_from_session(session, *phKey, &key_object);
 		if (rv != CKR_OK) {
 			if (rv == CKR_OBJECT_HANDLE_INVALID)
 				rv = CKR_KEY_HANDLE_INVALID;
@@ -1094,7 +1178,7 @@ CK_RV C_DeriveKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	}
 
 out:
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(session->slot);
 	return rv;
 }
 
@@ -1113,20 +1197,17 @@ CK_RV C_GenerateRandom(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK) {
-		slot = session->slot;
-		if (slot->p11card->framework->get_random == NULL)
-			rv = CKR_RANDOM_NO_RNG;
-		else
-			rv = slot->p11card->framework->get_random(slot, RandomData, ulRandomLen);
-	}
+	slot = session->slot;
+	if (slot->p11card->framework->get_random == NULL)
+		rv = CKR_RANDOM_NO_RNG;
+	else
+		rv = slot->p11card->framework->get_random(slot, RandomData, ulRandomLen);
 
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(slot);
 	return rv;
 }
 
@@ -1156,12 +1237,12 @@ CK_RV C_VerifyInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
 
-	rv = get_object_from_session(hSession, hKey, &session, &object);
+	rv = get_object_from_session(session, hKey, &object);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -1176,7 +1257,7 @@ CK_RV C_VerifyInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	rv = sc_pkcs11_verif_init(session, pMechanism, object, key_type);
 
 out:	sc_log(context, "C_VerifyInit() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(session->slot);
 	return rv;
 #endif
 }
@@ -1193,20 +1274,16 @@ CK_RV C_Verify(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
-
 	rv = sc_pkcs11_verif_update(session, pData, ulDataLen);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_verif_final(session, pSignature, ulSignatureLen);
 
-out:	sc_log(context, "C_Verify() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_log(context, "C_Verify() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock_slot(session->slot);
 	return rv;
 #endif
 }
@@ -1221,16 +1298,14 @@ CK_RV C_VerifyUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_verif_update(session, pPart, ulPartLen);
+	rv = sc_pkcs11_verif_update(session, pPart, ulPartLen);
 
 	sc_log(context, "C_VerifyUpdate() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(session->slot);
 	return rv;
 #endif
 }
@@ -1245,16 +1320,14 @@ CK_RV C_VerifyFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_verif_final(session, pSignature, ulSignatureLen);
+	rv = sc_pkcs11_verif_final(session, pSignature, ulSignatureLen);
 
 	sc_log(context, "C_VerifyFinal() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(session->slot);
 	return rv;
 #endif
 }
@@ -9,4 +9,33 @@
  */
 #define CKA_OPENSC_NON_REPUDIATION      (CKA_VENDOR_DEFINED | 1UL)
 
+/*
+ * APDUs sent to the card of a slot, per instruction byte and in total.
+ * histogram[i] counts round trips below 2^i ms, the last one longer ones.
+ */
+#define CK_OPENSC_APDU_STATS_BUCKETS	12
+
+typedef struct CK_OPENSC_APDU_COUNTER {
+	CK_ULONG count;
+	CK_ULONG bytesSent;
+	CK_ULONG bytesReceived;
+	CK_ULONG usec;
+	CK_ULONG histogram[CK_OPENSC_APDU_STATS_BUCKETS];
+} CK_OPENSC_APDU_COUNTER;
+
+typedef struct CK_OPENSC_APDU_STATS {
+	CK_OPENSC_APDU_COUNTER total;
+	CK_OPENSC_APDU_COUNTER ins[256];
+	CK_ULONG getResponses;
+	CK_ULONG retransmits;
+	CK_ULONG selectsSkipped;
+	CK_ULONG secEnvsSkipped;
+} CK_OPENSC_APDU_STATS;
+
+typedef CK_OPENSC_APDU_STATS * CK_OPENSC_APDU_STATS_PTR;
+
+/* Exported by opensc-pkcs11, look it up with dlsym()/GetProcAddress() */
+CK_RV C_OpenSC_GetAPDUStats(CK_SLOT_ID slotID, CK_OPENSC_APDU_STATS_PTR pStats,
+		CK_BBOOL reset);
+
 #endif
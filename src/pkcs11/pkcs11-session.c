@@ -26,9 +26,10 @@
 
 #include "sc-pkcs11.h"
 
+/* Called with the global lock held */
 CK_RV get_session(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session **session)
 {
-	*session = list_seek(&sessions, &hSession);
+	*session = handle_table_find(&session_table, hSession);
 	if (!*session)
 		return CKR_SESSION_HANDLE_INVALID;
 	return CKR_OK;
@@ -76,8 +77,13 @@ CK_RV C_OpenSession(CK_SLOT_ID slotID,	/* the slot's ID */
 	session->notify_callback = Notify;
 	session->notify_data = pApplication;
 	session->flags = flags;
-	slot->nsessions++;
 	session->handle = (CK_SESSION_HANDLE) session;	/* cast a pointer to long */
+	rv = handle_table_insert(&session_table, session->handle, session);
+	if (rv != CKR_OK) {
+		free(session);
+		goto out;
+	}
+	slot->nsessions++;
 	list_append(&sessions, session);
 	*phSession = session->handle;
 	sc_log(context, "C_OpenSession handle: 0x%lx", session->handle);
@@ -89,7 +95,7 @@ out:
 }
 
 /* Internal version of C_CloseSession that gets called with
- * the global lock held */
+ * the global lock held (and the slot lock, unless the token is torn down) */
 static CK_RV sc_pkcs11_close_session(CK_SESSION_HANDLE hSession)
 {
 	struct sc_pkcs11_slot *slot;
@@ -97,7 +103,7 @@ static CK_RV sc_pkcs11_close_session(CK_SESSION_HANDLE hSession)
 
 	sc_log(context, "real C_CloseSession(0x%lx)", hSession);
 
-	session = list_seek(&sessions, &hSession);
+	session = handle_table_find(&session_table, hSession);
 	if (!session)
 		return CKR_SESSION_HANDLE_INVALID;
 
@@ -110,6 +116,7 @@ static CK_RV sc_pkcs11_close_session(CK_SESSION_HANDLE hSession)
 		slot->p11card->framework->logout(slot);
 	}
 
+	handle_table_remove(&session_table, hSession);
 	if (list_delete(&sessions, session) != 0)
 		sc_log(context, "Could not delete session from list!");
 	free(session);
@@ -136,16 +143,23 @@ CK_RV sc_pkcs11_close_all_sessions(CK_SLOT_ID slotID)
 CK_RV C_CloseSession(CK_SESSION_HANDLE hSession)
 {				/* the session's handle */
 	CK_RV rv;
+	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_slot *slot;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
+	slot = session->slot;
 
-	sc_log(context, "C_CloseSession(0x%lx)", hSession);
+	rv = sc_pkcs11_lock();
+	if (rv == CKR_OK) {
+		sc_log(context, "C_CloseSession(0x%lx)", hSession);
 
-	rv = sc_pkcs11_close_session(hSession);
+		rv = sc_pkcs11_close_session(hSession);
 
-	sc_pkcs11_unlock();
+		sc_pkcs11_unlock();
+	}
+	sc_pkcs11_unlock_slot(slot);
 	return rv;
 }
 
@@ -154,19 +168,19 @@ CK_RV C_CloseAllSessions(CK_SLOT_ID slotID)
 	CK_RV rv;
 	struct sc_pkcs11_slot *slot;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_slot(slotID, &slot);
 	if (rv != CKR_OK)
 		return rv;
 
-	sc_log(context, "C_CloseAllSessions(0x%lx)", slotID);
-
-	rv = slot_get_token(slotID, &slot);
-	if (rv != CKR_OK)
-		goto out;
+	rv = sc_pkcs11_lock();
+	if (rv == CKR_OK) {
+		sc_log(context, "C_CloseAllSessions(0x%lx)", slotID);
 
-	rv = sc_pkcs11_close_all_sessions(slotID);
+		rv = sc_pkcs11_close_all_sessions(slotID);
 
-      out:sc_pkcs11_unlock();
+		sc_pkcs11_unlock();
+	}
+	sc_pkcs11_unlock_slot(slot);
 	return rv;
 }
 
@@ -180,17 +194,11 @@ CK_RV C_GetSessionInfo(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pInfo == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
 	sc_log(context, "C_GetSessionInfo(hSession:0x%lx)", hSession);
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
+	rv = sc_pkcs11_lock_session(hSession, &session);
+	if (rv != CKR_OK)
+		return rv;
 
 	sc_log(context, "C_GetSessionInfo(slot:0x%lx)", session->slot->id);
 	pInfo->slotID = session->slot->id;
@@ -208,9 +216,8 @@ CK_RV C_GetSessionInfo(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		    ? CKS_RW_PUBLIC_SESSION : CKS_RO_PUBLIC_SESSION;
 	}
 
-out:
 	sc_log(context, "C_GetSessionInfo(0x%lx) = %s", hSession, lookup_enum(RV_T, rv));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(slot);
 	return rv;
 }
 
@@ -242,20 +249,13 @@ CK_RV C_Login(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pPin == NULL_PTR && ulPinLen > 0)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	if (userType != CKU_USER && userType != CKU_SO && userType != CKU_CONTEXT_SPECIFIC)
+		return CKR_USER_TYPE_INVALID;
+
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	if (userType != CKU_USER && userType != CKU_SO && userType != CKU_CONTEXT_SPECIFIC) {
-		rv = CKR_USER_TYPE_INVALID;
-		goto out;
-	}
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
-
 	sc_log(context, "C_Login(0x%lx, %d)", hSession, userType);
 
 	slot = session->slot;
@@ -293,7 +293,7 @@ CK_RV C_Login(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	}
 
 out:
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(slot);
 	return rv;
 }
 
@@ -303,16 +303,10 @@ CK_RV C_Logout(CK_SESSION_HANDLE hSession)
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
-
 	sc_log(context, "C_Logout(hSession:0x%lx)", hSession);
 
 	slot = session->slot;
@@ -323,7 +317,7 @@ CK_RV C_Logout(CK_SESSION_HANDLE hSession)
 	} else
 		rv = CKR_USER_NOT_LOGGED_IN;
 
-      out:sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(slot);
 	return rv;
 }
 
@@ -337,22 +331,16 @@ CK_RV C_InitPIN(CK_SESSION_HANDLE hSession, CK_CHAR_PTR pPin, CK_ULONG ulPinLen)
 	if (pPin == NULL_PTR && ulPinLen > 0)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
-
+	slot = session->slot;
 	if (!(session->flags & CKF_RW_SESSION)) {
 		rv = CKR_SESSION_READ_ONLY;
 		goto out;
 	}
 
-	slot = session->slot;
 	if (slot->login_user != CKU_SO) {
 		rv = CKR_USER_NOT_LOGGED_IN;
 	} else if (slot->p11card->framework->init_pin == NULL) {
@@ -363,7 +351,7 @@ CK_RV C_InitPIN(CK_SESSION_HANDLE hSession, CK_CHAR_PTR pPin, CK_ULONG ulPinLen)
 	}
 
 out:
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(slot);
 	return rv;
 }
 
@@ -377,16 +365,10 @@ CK_RV C_SetPIN(CK_SESSION_HANDLE hSession,
 	if ((pOldPin == NULL_PTR && ulOldLen > 0) || (pNewPin == NULL_PTR && ulNewLen > 0))
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
-
 	slot = session->slot;
 	sc_log(context, "Changing PIN (session 0x%lx; login user %d)", hSession, slot->login_user);
 
@@ -397,6 +379,6 @@ CK_RV C_SetPIN(CK_SESSION_HANDLE hSession,
 
 	rv = slot->p11card->framework->change_pin(slot, pOldPin, ulOldLen, pNewPin, ulNewLen);
 out:
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(slot);
 	return rv;
 }
@@ -127,14 +127,33 @@ struct sc_pkcs11_object_ops {
 	/* Others to be added when implemented */
 };
 
+/* Attributes most searched for, cached per object by C_FindObjectsInit
+ * the first time a template has them:
+ * CKA_CLASS, CKA_KEY_TYPE, CKA_PRIVATE, CKA_ID and CKA_LABEL */
+#define SC_PKCS11_SEARCH_KEYS		5
+#define SC_PKCS11_SEARCH_KEY_SIZE	64
+/* CKA_CLASS is set by the framework before the object is added to its slot,
+ * which indexes its objects by class */
+#define SC_PKCS11_SEARCH_KEY_CLASS	0
+
+struct sc_pkcs11_search_keys {
+	unsigned int cached;		/* Bit mask of the cached keys */
+	CK_ULONG len[SC_PKCS11_SEARCH_KEYS];	/* CK_UNAVAILABLE_INFORMATION if the object lacks it */
+	CK_BYTE value[SC_PKCS11_SEARCH_KEYS][SC_PKCS11_SEARCH_KEY_SIZE];
+};
+
 struct sc_pkcs11_object {
 	CK_OBJECT_HANDLE handle;
 	int flags;
 	struct sc_pkcs11_object_ops *ops;
+	struct sc_pkcs11_search_keys search_keys;
 };
 
 #define SC_PKCS11_OBJECT_SEEN	0x0001
 #define SC_PKCS11_OBJECT_HIDDEN	0x0002
+/* cmp_attribute() of the search keys compares the get_attribute() values,
+ * so they may be cached */
+#define SC_PKCS11_OBJECT_INDEXED	0x0004
 #define SC_PKCS11_OBJECT_RECURS	0x8000
 
 
@@ -202,6 +221,20 @@ struct sc_pkcs11_card {
 	unsigned int nmechanisms;
 };
 
+/* Open addressing table mapping session and object handles to their
+ * structures, kept next to the lists so that lookups are O(1) */
+struct sc_pkcs11_handle_table {
+	CK_ULONG *handles;		/* 0 marks a free bucket */
+	void **values;			/* NULL with a non-zero handle marks a deleted bucket */
+	unsigned int size;		/* number of buckets, a power of two */
+	unsigned int count;		/* live entries */
+	unsigned int used;		/* live and deleted entries */
+};
+
+/* Objects of a slot by CKA_CLASS: one list for each class from CKO_DATA to
+ * CKO_SECRET_KEY, and a last one for objects of other or unknown class */
+#define SC_PKCS11_CLASS_LISTS	(CKO_SECRET_KEY + 2)
+
 struct sc_pkcs11_slot {
 	CK_SLOT_ID id;			/* ID of the slot */
 	int login_user;			/* Currently logged in user */
@@ -212,11 +245,17 @@ struct sc_pkcs11_slot {
 	unsigned int events;		/* Card events SC_EVENT_CARD_{INSERTED,REMOVED} */
 	void *fw_data;			/* Framework specific data */  /* TODO: get know how it used */
 	list_t objects;			/* Objects in this slot */
+	struct sc_pkcs11_handle_table object_table;	/* Index of objects by handle */
+	list_t class_objects[SC_PKCS11_CLASS_LISTS];	/* Index of objects by CKA_CLASS */
 	unsigned int nsessions;		/* Number of sessions using this slot */
 	sc_timestamp_t slot_state_expires;
 
 	int fw_data_idx;		/* Index of framework data */
 	struct sc_app_info *app_info;	/* Application assosiated to slot */
+
+	void *mutex;			/* Serializes token operations; only set on the lock slot */
+	struct sc_pkcs11_slot *lock_slot;	/* First slot of the reader, owner of the shared mutex */
+	unsigned int lock_users;	/* Threads holding or waiting for the mutex of the lock slot */
 };
 typedef struct sc_pkcs11_slot sc_pkcs11_slot_t;
 
@@ -320,6 +359,7 @@ typedef struct sc_pkcs11_session sc_pkcs11_session_t;
 extern struct sc_context *context;
 extern struct sc_pkcs11_config sc_pkcs11_conf;
 extern list_t sessions;
+extern struct sc_pkcs11_handle_table session_table;
 extern list_t virtual_slots;
 extern list_t cards;
 
@@ -346,6 +386,11 @@ CK_RV slot_get_token(CK_SLOT_ID id, struct sc_pkcs11_slot **);
 CK_RV slot_token_removed(CK_SLOT_ID id);
 CK_RV slot_allocate(struct sc_pkcs11_slot **, struct sc_pkcs11_card *);
 CK_RV slot_find_changed(CK_SLOT_ID_PTR idp, int mask);
+CK_RV slot_add_object(struct sc_pkcs11_slot *, struct sc_pkcs11_object *);
+void slot_remove_object(struct sc_pkcs11_slot *, struct sc_pkcs11_object *);
+struct sc_pkcs11_object *slot_find_object(struct sc_pkcs11_slot *, CK_OBJECT_HANDLE);
+list_t *slot_class_objects(struct sc_pkcs11_slot *, CK_OBJECT_CLASS);
+void slot_free_objects(struct sc_pkcs11_slot *);
 
 /* Session manipulation */
 CK_RV get_session(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session ** session);
@@ -375,6 +420,13 @@ CK_RV attr_find_and_allocate_ptr(CK_ATTRIBUTE_PTR, CK_ULONG, CK_ULONG, void **,
 CK_RV attr_find_var(CK_ATTRIBUTE_PTR, CK_ULONG, CK_ULONG, void *, size_t *);
 CK_RV attr_extract(CK_ATTRIBUTE_PTR, void *, size_t *);
 
+/* Handle tables (misc.c) */
+void handle_table_init(struct sc_pkcs11_handle_table *);
+void handle_table_free(struct sc_pkcs11_handle_table *);
+CK_RV handle_table_insert(struct sc_pkcs11_handle_table *, CK_ULONG, void *);
+void *handle_table_find(struct sc_pkcs11_handle_table *, CK_ULONG);
+void handle_table_remove(struct sc_pkcs11_handle_table *, CK_ULONG);
+
 /* Generic Mechanism functions */
 CK_RV sc_pkcs11_register_mechanism(struct sc_pkcs11_card *,
 				sc_pkcs11_mechanism_type_t *);
@@ -434,6 +486,15 @@ CK_RV sc_pkcs11_lock(void);
 void sc_pkcs11_unlock(void);
 void sc_pkcs11_free_lock(void);
 
+/* Per-slot locking: the global lock protects the session and slot tables,
+ * the slot lock serializes the operations on the token of one reader */
+CK_RV sc_pkcs11_init_slot_lock(struct sc_pkcs11_slot *);
+void sc_pkcs11_free_slot_lock(struct sc_pkcs11_slot *);
+CK_RV sc_pkcs11_lock_slot(CK_SLOT_ID, struct sc_pkcs11_slot **);
+CK_RV sc_pkcs11_lock_session(CK_SESSION_HANDLE, struct sc_pkcs11_session **);
+void sc_pkcs11_unlock_slot(struct sc_pkcs11_slot *);
+int slot_is_busy(sc_reader_t *);
+
 #ifdef __cplusplus
 }
 #endif
@@ -76,6 +76,7 @@ static int object_list_seeker(const void *el, const void *key)
 CK_RV create_slot(sc_reader_t *reader)
 {
 	struct sc_pkcs11_slot *slot;
+	unsigned int i;
 
 	if (list_size(&virtual_slots) >= sc_pkcs11_conf.max_virtual_slots)
 		return CKR_FUNCTION_FAILED;
@@ -84,6 +85,15 @@ CK_RV create_slot(sc_reader_t *reader)
 	if (!slot)
 		return CKR_HOST_MEMORY;
 
+	/* All slots of a reader share the lock of the first one */
+	slot->lock_slot = reader ? reader_get_slot(reader) : NULL;
+	if (slot->lock_slot == NULL)
+		slot->lock_slot = slot;
+	if (sc_pkcs11_init_slot_lock(slot) != CKR_OK) {
+		free(slot);
+		return CKR_GENERAL_ERROR;
+	}
+
 	list_append(&virtual_slots, slot);
 	slot->login_user = -1;
 	slot->id = (CK_SLOT_ID) list_locate(&virtual_slots, slot);
@@ -91,6 +101,9 @@ CK_RV create_slot(sc_reader_t *reader)
 
 	list_init(&slot->objects);
 	list_attributes_seeker(&slot->objects, object_list_seeker);
+	handle_table_init(&slot->object_table);
+	for (i = 0; i < SC_PKCS11_CLASS_LISTS; i++)
+		list_init(&slot->class_objects[i]);
 
 	init_slot_info(&slot->slot_info);
 	if (reader != NULL) {
@@ -104,12 +117,87 @@ CK_RV create_slot(sc_reader_t *reader)
 void delete_slot(struct sc_pkcs11_slot *slot)
 {
 	if (slot) {
-		list_destroy(&slot->objects);
+		slot_free_objects(slot);
 		list_delete(&virtual_slots, slot);
+		sc_pkcs11_free_slot_lock(slot);
 		free(slot);
 	}
 }
 
+/* Objects of the slot indexed under a class, or the list of objects of
+ * other or unknown class */
+list_t *slot_class_objects(struct sc_pkcs11_slot *slot, CK_OBJECT_CLASS class)
+{
+	if (class >= SC_PKCS11_CLASS_LISTS - 1)
+		class = SC_PKCS11_CLASS_LISTS - 1;
+	return &slot->class_objects[class];
+}
+
+/* Class list of an object, from the CKA_CLASS the framework cached */
+static list_t *object_class_list(struct sc_pkcs11_slot *slot, struct sc_pkcs11_object *object)
+{
+	struct sc_pkcs11_search_keys *keys = &object->search_keys;
+	CK_OBJECT_CLASS class = (CK_OBJECT_CLASS)-1;
+
+	if ((object->flags & SC_PKCS11_OBJECT_INDEXED)
+			&& (keys->cached & (1U << SC_PKCS11_SEARCH_KEY_CLASS))
+			&& keys->len[SC_PKCS11_SEARCH_KEY_CLASS] == sizeof(class))
+		memcpy(&class, keys->value[SC_PKCS11_SEARCH_KEY_CLASS], sizeof(class));
+	return slot_class_objects(slot, class);
+}
+
+/* Add an object to the slot, indexed by its handle and class */
+CK_RV slot_add_object(struct sc_pkcs11_slot *slot, struct sc_pkcs11_object *object)
+{
+	CK_RV rv;
+
+	rv = handle_table_insert(&slot->object_table, object->handle, object);
+	if (rv != CKR_OK)
+		return rv;
+	if (list_append(&slot->objects, object) < 0) {
+		handle_table_remove(&slot->object_table, object->handle);
+		return CKR_HOST_MEMORY;
+	}
+	if (list_append(object_class_list(slot, object), object) < 0) {
+		list_delete(&slot->objects, object);
+		handle_table_remove(&slot->object_table, object->handle);
+		return CKR_HOST_MEMORY;
+	}
+	return CKR_OK;
+}
+
+void slot_remove_object(struct sc_pkcs11_slot *slot, struct sc_pkcs11_object *object)
+{
+	handle_table_remove(&slot->object_table, object->handle);
+	list_delete(&slot->objects, object);
+	list_delete(object_class_list(slot, object), object);
+}
+
+/* Free the object lists and indexes of a slot being deleted */
+void slot_free_objects(struct sc_pkcs11_slot *slot)
+{
+	unsigned int i;
+
+	list_destroy(&slot->objects);
+	handle_table_free(&slot->object_table);
+	for (i = 0; i < SC_PKCS11_CLASS_LISTS; i++)
+		list_destroy(&slot->class_objects[i]);
+}
+
+struct sc_pkcs11_object *slot_find_object(struct sc_pkcs11_slot *slot, CK_OBJECT_HANDLE handle)
+{
+	return handle_table_find(&slot->object_table, handle);
+}
+
+/* Check if some thread holds or waits for the lock of the reader's slots.
+ * Busy slots must not be re-detected or torn down. */
+int slot_is_busy(sc_reader_t *reader)
+{
+	struct sc_pkcs11_slot *slot = reader_get_slot(reader);
+
+	return slot != NULL && slot->lock_slot->lock_users > 0;
+}
+
 
 /* create slots associated with a reader, called whenever a reader is seen. */
 CK_RV initialize_reader(sc_reader_t *reader)
@@ -194,6 +282,11 @@ CK_RV card_detect(sc_reader_t *reader)
 
 	rv = CKR_OK;
 
+	if (slot_is_busy(reader)) {
+		sc_log(context, "%s: Slot is busy, keep the token state", reader->name);
+		return CKR_OK;
+	}
+
 	sc_log(context, "%s: Detecting smart card", reader->name);
 	/* Check if someone inserted a card */
 again:
@@ -336,6 +429,8 @@ card_detect_all(void)
 		sc_reader_t *reader = sc_ctx_get_reader(context, i);
 		if (reader->flags & SC_READER_REMOVED) {
 			struct sc_pkcs11_slot *slot;
+			if (slot_is_busy(reader))
+				continue;
 			card_removed(reader);
 			while ((slot = reader_get_slot(reader))) {
 				delete_slot(slot);
@@ -414,6 +509,7 @@ CK_RV slot_get_token(CK_SLOT_ID id, struct sc_pkcs11_slot ** slot)
 CK_RV slot_token_removed(CK_SLOT_ID id)
 {
 	int rv, token_was_present;
+	unsigned int i;
 	struct sc_pkcs11_slot *slot;
 	struct sc_pkcs11_object *object;
 
@@ -427,10 +523,13 @@ CK_RV slot_token_removed(CK_SLOT_ID id)
 	/* Terminate active sessions */
 	sc_pkcs11_close_all_sessions(id);
 
+	for (i = 0; i < SC_PKCS11_CLASS_LISTS; i++)
+		list_clear(&slot->class_objects[i]);
 	while ((object = list_fetch(&slot->objects))) {
 		if (object->ops->release)
 			object->ops->release(object);
 	}
+	handle_table_free(&slot->object_table);
 
 	/* Release framework stuff */
 	if (slot->p11card != NULL) {
@@ -618,6 +618,8 @@ sc_pkcs15init_delete_by_path(struct sc_profile *profile, struct sc_pkcs15_card *
 
 	sc_log(ctx, "Now really delete file");
 	rv = sc_delete_file(p15card->card, &path);
+	if (p15card->opts.use_file_cache)
+		sc_pkcs15_uncache_file(p15card, file_path);
 	LOG_FUNC_RETURN(ctx, rv);
 }
 
@@ -3101,6 +3103,8 @@ sc_pkcs15init_update_certificate(struct sc_pkcs15_card *p15card,
 	if (r < 0)
 		goto done;
 
+	if (p15card->opts.use_file_cache)
+		sc_pkcs15_uncache_file(p15card, path);
 	r = sc_update_binary(p15card->card, 0, rawcert, certlen, 0);
 	if (r < 0)
 		goto done;
@@ -3582,8 +3586,12 @@ sc_pkcs15init_update_file(struct sc_profile *profile,
 
 	/* Present authentication info needed */
 	r = sc_pkcs15init_authenticate(profile, p15card, file, SC_AC_OP_UPDATE);
-	if (r >= 0 && datalen)
+	if (r >= 0 && datalen) {
+		/* The cached copy is stale even if the update fails half-way */
+		if (p15card->opts.use_file_cache)
+			sc_pkcs15_uncache_file(p15card, &file->path);
 		r = sc_update_binary(p15card->card, 0, (const unsigned char *) data, datalen, 0);
+	}
 
 	if (copy)
 		free(copy);
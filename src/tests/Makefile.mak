@@ -2,10 +2,11 @@
 TOPDIR = ..\..
 
 TARGETS = base64.exe p15dump.exe \
-	  p15dump.exe pintest.exe # prngtest.exe lottery.exe
+	  p15dump.exe pintest.exe apdubench.exe p15bench.exe selecttest.exe \
+	  # prngtest.exe lottery.exe
 
-all: print.obj sc-test.obj $(TARGETS)
-$(TARGETS): $(TOPDIR)\win32\versioninfo.res print.obj sc-test.obj \
+all: print.obj sc-test.obj bench.obj $(TARGETS)
+$(TARGETS): $(TOPDIR)\win32\versioninfo.res print.obj sc-test.obj bench.obj \
 	..\common\common.lib ..\libopensc\opensc.lib
 
 !INCLUDE $(TOPDIR)\win32\Make.rules.mak
@@ -15,7 +16,7 @@ $(TARGETS): $(TOPDIR)\win32\versioninfo.res print.obj sc-test.obj \
 
 .c.exe:
 	cl $(COPTS) /c $<
-        link $(LINKFLAGS) /pdb:$*.pdb /out:$@ $*.obj sc-test.obj print.obj \
+        link $(LINKFLAGS) /pdb:$*.pdb /out:$@ $*.obj sc-test.obj print.obj bench.obj \
         ..\common\common.lib ..\libopensc\opensc.lib $(TOPDIR)\win32\versioninfo.res
 	if EXIST $@.manifest mt -manifest $@.manifest -outputresource:$@;1
 
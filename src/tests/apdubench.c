@@ -0,0 +1,65 @@
+/*
+ * apdubench.c: host CPU time spent per APDU
+ *
+ * Selects and reads a transparent EF in a loop and reports the process
+ * CPU time and the time spent outside the reader driver per APDU. Run
+ * it against the virtual reader with latency = 0 to compare builds, e.g.
+ * with and without --disable-function-trace, or with different debug
+ * levels.
+ *
+ * usage: apdubench [-r reader] [-c driver] [-d] [path [iterations]]
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "libopensc/opensc.h"
+#include "sc-test.h"
+
+int main(int argc, char *argv[])
+{
+	int nargs = argc, iterations = 10000, i, r;
+	const char *opt_path = "3F00";
+	struct sc_test_bench bench;
+	sc_path_t path;
+	sc_file_t *file;
+	u8 buf[256];
+
+	r = sc_test_init(&argc, argv);
+	if (r != SC_SUCCESS)
+		return 1;
+	if (argc < nargs)
+		opt_path = argv[argc];
+	if (argc + 1 < nargs)
+		iterations = atoi(argv[argc + 1]);
+	sc_format_path(opt_path, &path);
+
+	if (sc_test_bench_start(&bench) != SC_SUCCESS) {
+		sc_test_cleanup();
+		return 1;
+	}
+	for (i = 0; i < iterations; i++) {
+		sc_lock(card);
+		r = sc_select_file(card, &path, &file);
+		if (r == SC_SUCCESS) {
+			if (file->type == SC_FILE_TYPE_WORKING_EF && file->ef_structure == SC_FILE_EF_TRANSPARENT)
+				r = sc_read_binary(card, 0, buf, file->size < sizeof(buf) ? file->size : sizeof(buf), 0);
+			sc_file_free(file);
+		}
+		sc_unlock(card);
+		if (r < 0) {
+			fprintf(stderr, "%s: %s\n", opt_path, sc_strerror(r));
+			break;
+		}
+	}
+	sc_test_bench_stop(&bench);
+
+	printf("%d iterations, %lu APDUs, debug level %d\n", i, bench.stats->total.count, ctx->debug);
+	sc_test_bench_report(&bench, "APDU", bench.stats->total.count);
+
+	sc_test_bench_free(&bench);
+	sc_test_cleanup();
+	return 0;
+}
@@ -0,0 +1,66 @@
+/*
+ * bench.c: timing of benchmark loops for the test programs
+ *
+ * Measures the process CPU time, the wall clock time and, with the APDU
+ * statistics of the card, the time spent in the reader driver.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "libopensc/opensc.h"
+#include "libopensc/cardctl.h"
+#include "sc-test.h"
+
+int sc_test_bench_start(struct sc_test_bench *bench)
+{
+	bench->stats = calloc(1, sizeof(*bench->stats));
+	if (bench->stats == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	sc_card_ctl(card, SC_CARDCTL_RESET_APDU_STATS, NULL);
+	gettimeofday(&bench->start, NULL);
+	bench->cpu = clock();
+	return SC_SUCCESS;
+}
+
+void sc_test_bench_stop(struct sc_test_bench *bench)
+{
+	struct timeval end;
+
+	bench->cpu = clock() - bench->cpu;
+	gettimeofday(&end, NULL);
+	sc_card_ctl(card, SC_CARDCTL_GET_APDU_STATS, bench->stats);
+	bench->wall = (end.tv_sec - bench->start.tv_sec) * 1000000.0
+		+ (end.tv_usec - bench->start.tv_usec);
+}
+
+/* Time outside the reader driver, in microseconds */
+double sc_test_bench_host_time(const struct sc_test_bench *bench)
+{
+	return bench->wall - bench->stats->total.usec;
+}
+
+/* Prints the times per unit, count units were measured */
+void sc_test_bench_report(const struct sc_test_bench *bench, const char *unit,
+		double count)
+{
+	char label[64];
+
+	if (count == 0)
+		count = 1;
+	snprintf(label, sizeof(label), "CPU time per %s:", unit);
+	printf("%-36s %8.2f us\n", label,
+			(double) bench->cpu * 1000000.0 / CLOCKS_PER_SEC / count);
+	snprintf(label, sizeof(label), "Time outside the reader per %s:", unit);
+	printf("%-36s %8.2f us\n", label, sc_test_bench_host_time(bench) / count);
+	snprintf(label, sizeof(label), "Time in the reader per %s:", unit);
+	printf("%-36s %8.2f us\n", label, bench->stats->total.usec / count);
+}
+
+void sc_test_bench_free(struct sc_test_bench *bench)
+{
+	free(bench->stats);
+	bench->stats = NULL;
+}
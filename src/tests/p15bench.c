@@ -0,0 +1,109 @@
+/*
+ * p15bench.c: PKCS#15 directory file parsing throughput
+ *
+ * Binds the PKCS#15 application, then repeatedly drops the objects of
+ * every PrKDF, PuKDF, SKDF, CDF and DODF and parses those directory
+ * files again with sc_pkcs15_parse_df().  The AODF is left alone so that
+ * PINs stay valid.  Reports the time per parse and per object, with and
+ * without the time spent in the reader driver reading the files.
+ *
+ * usage: p15bench [-r reader] [-c driver] [-d] [iterations]
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "libopensc/opensc.h"
+#include "libopensc/pkcs15.h"
+#include "sc-test.h"
+
+static void drop_objects(struct sc_pkcs15_card *p15card)
+{
+	struct sc_pkcs15_object *obj, *next;
+	struct sc_pkcs15_df *df;
+
+	for (obj = p15card->obj_list; obj != NULL; obj = next) {
+		next = obj->next;
+		if (obj->df != NULL && obj->df->type != SC_PKCS15_AODF) {
+			sc_pkcs15_remove_object(p15card, obj);
+			sc_pkcs15_free_object(obj);
+		}
+	}
+	for (df = p15card->df_list; df != NULL; df = df->next)
+		if (df->type != SC_PKCS15_AODF)
+			df->enumerated = 0;
+}
+
+static int parse_all(struct sc_pkcs15_card *p15card)
+{
+	struct sc_pkcs15_df *df;
+	int r;
+
+	for (df = p15card->df_list; df != NULL; df = df->next) {
+		if (df->enumerated)
+			continue;
+		r = sc_pkcs15_parse_df(p15card, df);
+		if (r != SC_SUCCESS)
+			return r;
+	}
+	return SC_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+	int nargs = argc, iterations = 1000, i, r, objects = 0, ret = 1;
+	struct sc_pkcs15_card *p15card = NULL;
+	struct sc_pkcs15_object *obj;
+	struct sc_test_bench bench;
+	double n;
+
+	r = sc_test_init(&argc, argv);
+	if (r != SC_SUCCESS)
+		return 1;
+	if (argc < nargs)
+		iterations = atoi(argv[argc]);
+
+	bench.stats = NULL;
+	sc_lock(card);
+	r = sc_pkcs15_bind(card, NULL, &p15card);
+	if (r == SC_SUCCESS)
+		r = parse_all(p15card);
+	if (r != SC_SUCCESS) {
+		fprintf(stderr, "PKCS#15 bind failed: %s\n", sc_strerror(r));
+		goto out;
+	}
+	for (obj = p15card->obj_list; obj != NULL; obj = obj->next)
+		if (obj->df != NULL && obj->df->type != SC_PKCS15_AODF)
+			objects++;
+
+	if (sc_test_bench_start(&bench) != SC_SUCCESS)
+		goto out;
+	for (i = 0; i < iterations; i++) {
+		drop_objects(p15card);
+		r = parse_all(p15card);
+		if (r != SC_SUCCESS) {
+			fprintf(stderr, "parsing failed: %s\n", sc_strerror(r));
+			break;
+		}
+	}
+	sc_test_bench_stop(&bench);
+
+	n = i ? (double) i : 1;
+	printf("%d iterations, %d objects, %lu APDUs, debug level %d, %s\n",
+			i, objects, bench.stats->total.count, ctx->debug,
+			p15card->opts.use_df_arena ? "arena" : "heap");
+	sc_test_bench_report(&bench, "parse", n);
+	printf("%-36s %8.2f us\n", "Time outside the reader per object:",
+			sc_test_bench_host_time(&bench) / n / (objects ? objects : 1));
+	ret = 0;
+
+out:
+	if (p15card != NULL)
+		sc_pkcs15_unbind(p15card);
+	sc_unlock(card);
+	sc_test_bench_free(&bench);
+	sc_test_cleanup();
+	return ret;
+}
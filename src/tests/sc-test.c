@@ -79,13 +79,17 @@ int sc_test_init(int *argc, char *argv[])
 	while (1) {
 		if (opt_reader >= 0) {
 			rc = sc_detect_card_presence(sc_ctx_get_reader(ctx, opt_reader));
-			printf("Card %s.\n", rc == 1 ? "present" : "absent");
 			if (rc < 0)
 				return rc;
+			rc &= SC_READER_CARD_PRESENT;
+			printf("Card %s.\n", rc ? "present" : "absent");
 		} else {
-			for (i = rc = 0; rc != 1 && i < (int) sc_ctx_get_reader_count(ctx); i++)
-				rc = sc_detect_card_presence(sc_ctx_get_reader(ctx, opt_reader));
-			if (rc == 1)
+			for (i = rc = 0; rc <= 0 && i < (int) sc_ctx_get_reader_count(ctx); i++) {
+				rc = sc_detect_card_presence(sc_ctx_get_reader(ctx, i));
+				if (rc > 0)
+					rc &= SC_READER_CARD_PRESENT;
+			}
+			if (rc > 0)
 				opt_reader = i - 1;
 		}
 
@@ -1,6 +1,11 @@
 #ifndef _SC_TEST_H
 #define _SC_TEST_H
 
+#include <time.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
 #include "libopensc/pkcs15.h"
 
 #ifdef __cplusplus
@@ -17,6 +22,20 @@ void sc_test_cleanup(void);
 void sc_test_print_card(const sc_pkcs15_card_t *);
 void sc_test_print_object(const struct sc_pkcs15_object *);
 
+/* bench.c */
+struct sc_test_bench {
+	struct sc_apdu_stats *stats;
+	struct timeval start;
+	clock_t cpu;
+	double wall;		/* microseconds */
+};
+
+int sc_test_bench_start(struct sc_test_bench *);
+void sc_test_bench_stop(struct sc_test_bench *);
+double sc_test_bench_host_time(const struct sc_test_bench *);
+void sc_test_bench_report(const struct sc_test_bench *, const char *unit, double count);
+void sc_test_bench_free(struct sc_test_bench *);
+
 #ifdef __cplusplus
 }
 #endif
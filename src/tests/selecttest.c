@@ -0,0 +1,99 @@
+/*
+ * selecttest.c: Check that a failed transmit drops the selection cache
+ *
+ * Selects and reads EF(TokenInfo), then fails the next transmit after
+ * resetting the card, the way PC/SC reports SCARD_W_RESET_CARD. Selecting
+ * the same file again must be sent to the card, which is back at the MF,
+ * and the file must be readable again.
+ *
+ * usage: selecttest [-r reader] [-c driver] [-d]
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "libopensc/opensc.h"
+#include "sc-test.h"
+
+static const struct sc_reader_operations *reader_ops;
+static struct sc_reader_operations failing_ops;
+static int fail_next;
+
+static int failing_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
+{
+	if (fail_next) {
+		fail_next = 0;
+		if (reader_ops->reset != NULL)
+			reader_ops->reset(reader, 0);
+		return SC_ERROR_TRANSMIT_FAILED;
+	}
+	return reader_ops->transmit(reader, apdu);
+}
+
+static int select_and_read(const sc_path_t *path, u8 *buf, size_t len)
+{
+	int r;
+
+	r = sc_select_file(card, path, NULL);
+	if (r != SC_SUCCESS)
+		return r;
+	return sc_read_binary(card, 0, buf, len, 0);
+}
+
+int main(int argc, char *argv[])
+{
+	sc_path_t path;
+	u8 buf[4];
+	unsigned long selects;
+	int r, ret = 1;
+
+	r = sc_test_init(&argc, argv);
+	if (r != SC_SUCCESS)
+		return 1;
+
+	if (SC_SUCCESS != sc_lock(card)) {
+		sc_test_cleanup();
+		return 1;
+	}
+	reader_ops = card->reader->ops;
+	failing_ops = *reader_ops;
+	failing_ops.transmit = failing_transmit;
+	card->reader->ops = &failing_ops;
+
+	sc_format_path("3F0050155032", &path);
+
+	r = select_and_read(&path, buf, sizeof(buf));
+	if (r < 0) {
+		fprintf(stderr, "reading EF(TokenInfo) failed: %s\n", sc_strerror(r));
+		goto out;
+	}
+
+	fail_next = 1;
+	r = sc_read_binary(card, 0, buf, sizeof(buf), 0);
+	if (r >= 0) {
+		fprintf(stderr, "transmit did not fail\n");
+		goto out;
+	}
+
+	selects = card->apdu_stats->ins[0xA4].count;
+	memset(buf, 0, sizeof(buf));
+	r = select_and_read(&path, buf, sizeof(buf));
+	if (card->apdu_stats->ins[0xA4].count == selects) {
+		fprintf(stderr, "SELECT FILE skipped after a failed transmit\n");
+		goto out;
+	}
+	if (r < 0 || buf[0] != 0x30) {
+		fprintf(stderr, "reading EF(TokenInfo) again failed: %s\n", sc_strerror(r));
+		goto out;
+	}
+	printf("SELECT FILE sent again after a failed transmit\n");
+	ret = 0;
+
+out:
+	card->reader->ops = reader_ops;
+	sc_unlock(card);
+	sc_test_cleanup();
+	return ret;
+}
@@ -50,7 +50,8 @@ static int	verbose = 0;
 
 enum {
 	OPT_SERIAL = 0x100,
-	OPT_LIST_ALG
+	OPT_LIST_ALG,
+	OPT_APDU_STATS
 };
 
 static const struct option options[] = {
@@ -67,6 +68,7 @@ static const struct option options[] = {
 	{ "reader",		1, NULL,		'r' },
 	{ "card-driver",	1, NULL,		'c' },
 	{ "list-algorithms",    0, NULL,	OPT_LIST_ALG },
+	{ "apdu-stats",		0, NULL,	OPT_APDU_STATS },
 	{ "wait",		0, NULL,		'w' },
 	{ "verbose",		0, NULL,		'v' },
 	{ NULL, 0, NULL, 0 }
@@ -86,6 +88,7 @@ static const char *option_help[] = {
 	"Uses reader number <arg> [0]",
 	"Forces the use of driver <arg> [auto-detect]",
 	"Lists algorithms supported by card",
+	"Prints the APDUs sent to the card, per instruction",
 	"Wait for a card to be inserted",
 	"Verbose operation. Use several times to enable debug output.",
 };
@@ -639,6 +642,52 @@ static int list_algorithms(void)
 	return 0;
 }
 
+static void print_apdu_counter(const char *label, const struct sc_apdu_counter *counter)
+{
+	int i;
+
+	printf("%-6s %8lu %10lu %10lu %10.1f %9.2f ", label, counter->count,
+			counter->bytes_sent, counter->bytes_received,
+			counter->usec / 1000.0, counter->usec / 1000.0 / counter->count);
+	for (i = 0; i < SC_APDU_STATS_BUCKETS; i++)
+		printf(" %lu", counter->histogram[i]);
+	printf("\n");
+}
+
+static int print_apdu_stats(void)
+{
+	struct sc_apdu_stats *stats;
+	char label[8];
+	int i, r;
+
+	stats = malloc(sizeof(*stats));
+	if (stats == NULL)
+		return 1;
+	r = sc_card_ctl(card, SC_CARDCTL_GET_APDU_STATS, stats);
+	if (r) {
+		fprintf(stderr, "sc_card_ctl(*, SC_CARDCTL_GET_APDU_STATS, *) failed: %s\n",
+				sc_strerror(r));
+		free(stats);
+		return 1;
+	}
+
+	printf("GET RESPONSE: %lu, retransmitted: %lu, SELECTs skipped: %lu, MSEs skipped: %lu\n",
+			stats->get_responses, stats->retransmits, stats->selects_skipped,
+			stats->sec_envs_skipped);
+	printf("%-6s %8s %10s %10s %10s %9s  %s\n", "INS", "APDUs", "sent", "received",
+			"total ms", "avg ms", "histogram (<1, <2, <4 ... <1024, >=1024 ms)");
+	for (i = 0; i < 256; i++) {
+		if (stats->ins[i].count == 0)
+			continue;
+		snprintf(label, sizeof(label), "%02X", i);
+		print_apdu_counter(label, &stats->ins[i]);
+	}
+	if (stats->total.count)
+		print_apdu_counter("total", &stats->total);
+	free(stats);
+	return 0;
+}
+
 int main(int argc, char * const argv[])
 {
 	int err = 0, r, c, long_optind = 0;
@@ -653,6 +702,7 @@ int main(int argc, char * const argv[])
 	int do_print_serial = 0;
 	int do_print_name = 0;
 	int do_list_algorithms = 0;
+	int do_apdu_stats = 0;
 	int action_count = 0;
 	const char *opt_driver = NULL;
 	const char *opt_conf_entry = NULL;
@@ -738,6 +788,10 @@ int main(int argc, char * const argv[])
 			do_list_algorithms = 1;
 			action_count++;
 			break;
+		case OPT_APDU_STATS:
+			do_apdu_stats = 1;
+			action_count++;
+			break;
 		}
 	}
 	if (action_count == 0)
@@ -841,6 +895,12 @@ int main(int argc, char * const argv[])
 			goto end;
 		action_count--;
 	}
+
+	if (do_apdu_stats) {
+		if ((err = print_apdu_stats()))
+			goto end;
+		action_count--;
+	}
 end:
 	if (card) {
 		sc_unlock(card);
@@ -0,0 +1,157 @@
+/*
+ * opensc-trace.c: decode binary APDU traces written by libopensc
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libopensc/opensc.h"
+#include "libopensc/trace.h"
+#include "util.h"
+
+static const char *app_name = "opensc-trace";
+
+static unsigned long opt_slower_than = 0;
+
+static const struct option options[] = {
+	{ "slower-than",	1, NULL,		's' },
+	{ "help",		0, NULL,		'h' },
+	{ NULL, 0, NULL, 0 }
+};
+
+static const char *option_help[] = {
+	"Only print events that took at least <arg> milliseconds",
+	"Print this help message",
+};
+
+static const char *event_name(unsigned int event)
+{
+	switch (event) {
+	case SC_TRACE_APDU:
+		return "APDU";
+	case SC_TRACE_CONNECT:
+		return "connect";
+	case SC_TRACE_DISCONNECT:
+		return "disconnect";
+	case SC_TRACE_LOCK:
+		return "lock";
+	case SC_TRACE_UNLOCK:
+		return "unlock";
+	case SC_TRACE_RESET:
+		return "reset";
+	}
+	return "unknown";
+}
+
+static void print_record(const struct sc_trace_record *record, uint64_t start)
+{
+	printf("%12.6f  reader %u  %8.3f ms  %-10s",
+			(record->time - start) / 1000000.0, record->reader,
+			record->duration / 1000.0, event_name(record->event));
+	if (record->event == SC_TRACE_APDU) {
+		printf(" %02X %02X %02X %02X  case %u  Lc %u  Le %u",
+				record->cla, record->ins, record->p1, record->p2,
+				record->cse & SC_APDU_SHORT_MASK, record->lc, record->le);
+		if (record->result == SC_SUCCESS)
+			printf("  -> %02X %02X  %u bytes", record->sw1, record->sw2,
+					record->resplen);
+	}
+	if (record->result != SC_SUCCESS)
+		printf("  %s", sc_strerror(record->result));
+	printf("\n");
+}
+
+/* Decodes the dumps in a file, returns 0 on success */
+static int decode_file(const char *filename)
+{
+	struct sc_trace_header header;
+	struct sc_trace_record record;
+	uint64_t start;
+	unsigned int i;
+	FILE *f;
+	int err = 0;
+
+	f = fopen(filename, "rb");
+	if (f == NULL) {
+		util_error("cannot open %s", filename);
+		return 1;
+	}
+	while (fread(&header, sizeof(header), 1, f) == 1) {
+		if (memcmp(header.magic, SC_TRACE_MAGIC, sizeof(header.magic)) != 0
+				|| header.version != SC_TRACE_VERSION) {
+			util_error("%s is not an APDU trace", filename);
+			err = 1;
+			break;
+		}
+		if (header.byte_order != SC_TRACE_BYTE_ORDER
+				|| header.record_size != sizeof(struct sc_trace_record)) {
+			util_error("%s was written on another platform", filename);
+			err = 1;
+			break;
+		}
+
+		printf("Trace of process %u: %u events", header.pid, header.count);
+		if (header.lost)
+			printf(", %lu older ones overwritten", (unsigned long) header.lost);
+		printf("\n");
+		start = 0;
+		for (i = 0; i < header.count; i++) {
+			if (fread(&record, sizeof(record), 1, f) != 1) {
+				util_error("%s is truncated", filename);
+				err = 1;
+				goto out;
+			}
+			if (i == 0)
+				start = record.time;
+			if (record.duration >= opt_slower_than * 1000)
+				print_record(&record, start);
+		}
+		printf("Dumped %.6f s after the first event\n\n",
+				(header.time - start) / 1000000.0);
+	}
+out:
+	fclose(f);
+	return err;
+}
+
+int main(int argc, char * const argv[])
+{
+	int err = 0, c, long_optind = 0;
+
+	while (1) {
+		c = getopt_long(argc, argv, "s:h", options, &long_optind);
+		if (c == -1)
+			break;
+		switch (c) {
+		case 's':
+			opt_slower_than = strtoul(optarg, NULL, 10);
+			break;
+		case 'h':
+		case '?':
+			util_print_usage_and_die(app_name, options, option_help, "FILE...");
+		}
+	}
+	if (optind == argc)
+		util_print_usage_and_die(app_name, options, option_help, "FILE...");
+
+	for (; optind < argc; optind++)
+		err |= decode_file(argv[optind]);
+	return err;
+}
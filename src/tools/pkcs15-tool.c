@@ -237,7 +237,7 @@ static void print_cert_info(const struct sc_pkcs15_object *obj)
 
 	print_access_rules(obj->access_rules, SC_PKCS15_MAX_ACCESS_RULES);
 
-        rv = sc_pkcs15_read_certificate(p15card, cert_info, &cert_parsed);
+        rv = sc_pkcs15_read_certificate_fields(p15card, cert_info, SC_PKCS15_CERT_SERIAL, &cert_parsed);
 	if (rv >= 0 && cert_parsed)   {
 		printf("\tEncoded serial : %02X %02X ", *(cert_parsed->serial), *(cert_parsed->serial + 1));
 		util_hex_dump(stdout, cert_parsed->serial + 2, cert_parsed->serial_len - 2, "");